@@ -0,0 +1,431 @@
+// chat_bench: load generator and latency benchmark for the chat server.
+//
+// Opens many client connections, spreads them over rooms, then has a subset
+// of them broadcast timestamped messages. Every delivery is timed from the
+// sender's clock (all clients live in this process) to report connection
+// setup rate, message throughput and fan-out latency percentiles.
+//
+// With -m it starts the server itself once per listed front end (for
+// example -m thread,epoll,uring) and prints the runs side by side.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define PORT 8888
+#define BENCH_BUFF 65536
+#define IDLE_TIMEOUT_MS 2000   // Quiet period that ends the broadcast phase
+#define STALL_TIMEOUT_MS 30000 // No progress while setting up; outlasts SYN retransmit backoff
+#define SERVER_START_MS 5000   // How long a launched server gets to start listening
+#define MAX_MODES 8
+
+struct bench_conn {
+    int fd;
+    int id;
+    int prompts;          // "chat>" prompts seen; one per command reply
+    size_t inlen;
+    char inbuf[BENCH_BUFF];
+};
+
+struct bench_opts {
+    const char *host;
+    int port;
+    int conns;
+    int rooms;
+    int senders;
+    int messages;         // Per sender
+    int interval_us;      // Gap between a sender's messages
+    const char *modes;    // Comma-separated front ends to launch and compare
+    const char *server;   // Server binary launched for each mode
+    const char *loops;    // Its -w argument
+};
+
+struct bench_result {
+    double setup_s;
+    double script_s;
+    double run_s;
+    long sent;
+    long total;
+    size_t deliveries;
+    uint32_t p50, p99, p999, max;
+};
+
+static struct bench_conn *conns;
+static int epfd;
+
+static uint32_t *latencies; // Microseconds, one per delivery
+static size_t num_latencies, cap_latencies;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-r rooms] [-s senders] "
+                    "[-n messages_per_sender] [-i interval_us]\n"
+                    "       [-m mode[,mode...] [-x server_binary] [-w loops]]\n", prog);
+    exit(1);
+}
+
+static void record_latency(uint64_t ns) {
+    if (num_latencies == cap_latencies) {
+        cap_latencies = cap_latencies ? cap_latencies * 2 : 1 << 16;
+        latencies = realloc(latencies, cap_latencies * sizeof(uint32_t));
+        if (latencies == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    latencies[num_latencies++] = ns / 1000;
+}
+
+static void send_line(struct bench_conn *c, const char *line) {
+    size_t len = strlen(line), off = 0;
+    while (off < len) {
+        ssize_t n = send(c->fd, line + off, len - off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+        off += n;
+    }
+}
+
+// Count prompts and time every benchmark message in what arrived
+static int drain(struct bench_conn *c) {
+    while (1) {
+        ssize_t n = recv(c->fd, c->inbuf + c->inlen, BENCH_BUFF - 1 - c->inlen, 0);
+        if (n == 0) {
+            fprintf(stderr, "connection %d closed by server\n", c->id);
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->inlen += n;
+
+        // Lines end in '\n'; a "chat>" prompt (no newline) ends each reply
+        uint64_t now = now_ns();
+        char *p = c->inbuf, *line = c->inbuf, *limit = c->inbuf + c->inlen;
+        while (p < limit) {
+            size_t left = limit - p;
+            if (*p == '\n') {
+                *p = '\0';
+                char *mark = strstr(line, "> bench ");
+                unsigned long long sent;
+                if (mark != NULL && sscanf(mark, "> bench %llu", &sent) == 1) {
+                    record_latency(now - sent);
+                }
+                line = ++p;
+            } else if (left >= 5 && memcmp(p, "chat>", 5) == 0) {
+                c->prompts++;
+                p += 5;
+                line = p;
+            } else if (left < 5 && memcmp(p, "chat>", left) == 0) {
+                break; // Prompt split across reads
+            } else {
+                p++;
+            }
+        }
+
+        c->inlen = limit - line;
+        if (c->inlen == BENCH_BUFF - 1) {
+            c->inlen = 0; // Overlong line; not one of ours
+        }
+        memmove(c->inbuf, line, c->inlen);
+    }
+}
+
+// Run the event loop until every connection has seen `prompts` prompts
+static void wait_prompts(int n, int prompts) {
+    struct epoll_event events[256];
+    int done;
+
+    do {
+        done = 0;
+        for (int i = 0; i < n; i++) {
+            done += conns[i].prompts >= prompts;
+        }
+        if (done == n) {
+            return;
+        }
+        int ready = epoll_wait(epfd, events, 256, STALL_TIMEOUT_MS);
+        if (ready == 0) {
+            fprintf(stderr, "timed out waiting for replies (%d/%d ready)\n", done, n);
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < ready; i++) {
+            if (drain(&conns[events[i].data.u32]) < 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+    } while (1);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(double p) {
+    if (num_latencies == 0) {
+        return 0;
+    }
+    size_t i = (size_t) (p * (num_latencies - 1));
+    return latencies[i];
+}
+
+// Connect, run the scripted setup and the broadcast phase against the
+// server at addr, and measure them
+static void run_bench(const struct bench_opts *o, const struct sockaddr_in *addr, struct bench_result *res) {
+    num_latencies = 0;
+    conns = calloc(o->conns, sizeof(struct bench_conn));
+    epfd = epoll_create1(0);
+    if (conns == NULL || epfd == -1) {
+        perror("setup");
+        exit(EXIT_FAILURE);
+    }
+
+    // 1. Connection setup: connect and wait for every MOTD prompt
+    uint64_t start = now_ns();
+    for (int i = 0; i < o->conns; i++) {
+        struct bench_conn *c = &conns[i];
+        int one = 1;
+        c->id = i;
+        c->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (c->fd == -1 || connect(c->fd, (const struct sockaddr *) addr, sizeof(*addr)) == -1) {
+            fprintf(stderr, "connection %d: %s\n", i, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(c->fd, F_SETFL, O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = i };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+    wait_prompts(o->conns, 1);
+    res->setup_s = (now_ns() - start) / 1e9;
+
+    // 2. Scripted login/create/join: everyone leaves the Lobby for its room
+    char line[256];
+    for (int r = 0; r < o->rooms; r++) {
+        snprintf(line, sizeof(line), "create benchroom%d\n", r);
+        send_line(&conns[0], line);
+    }
+    wait_prompts(1, 1 + o->rooms);
+    conns[0].prompts = 1;
+    uint64_t script_start = now_ns();
+    for (int i = 0; i < o->conns; i++) {
+        snprintf(line, sizeof(line), "login bench%d\njoin benchroom%d\nleave Lobby\n", i, i % o->rooms);
+        send_line(&conns[i], line);
+    }
+    wait_prompts(o->conns, 4);
+    res->script_s = (now_ns() - script_start) / 1e9;
+
+    // 3. Broadcast: senders stamp each message with the send time
+    struct epoll_event events[256];
+    long sent = 0;
+    uint64_t next_round = now_ns(), last_activity = now_ns();
+    int round = 0;
+
+    start = now_ns();
+    while (1) {
+        uint64_t now = now_ns();
+        if (round < o->messages && now >= next_round) {
+            for (int i = 0; i < o->senders; i++) {
+                // Spread senders over rooms: sender i is connection i * conns / senders
+                struct bench_conn *c = &conns[(long) i * o->conns / o->senders];
+                snprintf(line, sizeof(line), "bench %llu %d\n", (unsigned long long) now_ns(), round);
+                send_line(c, line);
+                sent++;
+            }
+            round++;
+            next_round = now + (uint64_t) o->interval_us * 1000;
+        }
+
+        int timeout = 100;
+        if (round < o->messages) {
+            timeout = next_round > now ? (int) ((next_round - now + 999999) / 1000000) : 0;
+        }
+        int ready = epoll_wait(epfd, events, 256, timeout);
+        for (int i = 0; i < ready; i++) {
+            if (drain(&conns[events[i].data.u32]) < 0) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (ready > 0) {
+            last_activity = now_ns();
+        } else if (round >= o->messages && now_ns() - last_activity > IDLE_TIMEOUT_MS * 1000000ULL) {
+            break;
+        }
+    }
+    res->run_s = (last_activity - start) / 1e9;
+    res->sent = sent;
+    res->total = (long) o->senders * o->messages;
+
+    qsort(latencies, num_latencies, sizeof(uint32_t), compare_u32);
+    res->deliveries = num_latencies;
+    res->p50 = percentile(0.5);
+    res->p99 = percentile(0.99);
+    res->p999 = percentile(0.999);
+    res->max = percentile(1.0);
+
+    for (int i = 0; i < o->conns; i++) {
+        close(conns[i].fd);
+    }
+    close(epfd);
+    free(conns);
+}
+
+static void print_result(const struct bench_opts *o, const struct bench_result *res) {
+    printf("connections        %d in %.3f s (%.0f conn/s)\n", o->conns, res->setup_s, o->conns / res->setup_s);
+    printf("login/join/leave   %d in %.3f s (%.0f cmd/s)\n", 3 * o->conns, res->script_s, 3 * o->conns / res->script_s);
+    printf("messages sent      %ld of %ld (%.0f msg/s)\n", res->sent, res->total,
+           res->run_s > 0 ? res->sent / res->run_s : 0);
+    printf("deliveries         %zu (%.0f msg/s)\n", res->deliveries,
+           res->run_s > 0 ? res->deliveries / res->run_s : 0);
+    printf("fan-out latency us p50 %u p99 %u p999 %u max %u\n", res->p50, res->p99, res->p999, res->max);
+}
+
+// Launch the server in one mode on o->port and wait until it accepts connections
+static pid_t launch_server(const struct bench_opts *o, const char *mode, const struct sockaddr_in *addr) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        // Don't outlive a benchmark that exits early
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        char port[8];
+        snprintf(port, sizeof(port), "%d", o->port);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execl(o->server, o->server, "-m", mode, "-w", o->loops, "-p", port, "-l", "warn", (char *) NULL);
+        _exit(127);
+    }
+
+    uint64_t deadline = now_ns() + SERVER_START_MS * 1000000ULL;
+    while (now_ns() < deadline) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int up = connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) == 0;
+        close(fd);
+        if (up) {
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            break;
+        }
+        usleep(20000);
+    }
+    fprintf(stderr, "server did not start in mode %s\n", mode);
+    kill(pid, SIGKILL);
+    exit(EXIT_FAILURE);
+}
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGINT);
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+    }
+}
+
+// One benchmark run per mode, each against a freshly started server
+static void compare_modes(const struct bench_opts *o, const struct sockaddr_in *addr) {
+    char modes[256];
+    char *names[MAX_MODES];
+    struct bench_result results[MAX_MODES];
+    int count = 0;
+
+    snprintf(modes, sizeof(modes), "%s", o->modes);
+    for (char *mode = strtok(modes, ","); mode != NULL && count < MAX_MODES; mode = strtok(NULL, ",")) {
+        names[count] = mode;
+        pid_t pid = launch_server(o, mode, addr);
+        fprintf(stderr, "running %s...\n", mode);
+        run_bench(o, addr, &results[count]);
+        stop_server(pid);
+        count++;
+    }
+
+    printf("%-8s %10s %10s %10s %12s %8s %8s %8s %8s\n",
+           "mode", "conn/s", "cmd/s", "msg/s", "deliveries/s", "p50_us", "p99_us", "p999_us", "max_us");
+    for (int i = 0; i < count; i++) {
+        const struct bench_result *res = &results[i];
+        printf("%-8s %10.0f %10.0f %10.0f %12.0f %8u %8u %8u %8u\n", names[i],
+               o->conns / res->setup_s, 3 * o->conns / res->script_s,
+               res->run_s > 0 ? res->sent / res->run_s : 0,
+               res->run_s > 0 ? res->deliveries / res->run_s : 0,
+               res->p50, res->p99, res->p999, res->max);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct bench_opts o = { "127.0.0.1", PORT, 1000, 10, 100, 100, 1000, NULL, "./server", "4" };
+    struct bench_result res;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:r:s:n:i:m:x:w:")) != -1) {
+        switch (opt) {
+        case 'h': o.host = optarg; break;
+        case 'p': o.port = atoi(optarg); break;
+        case 'c': o.conns = atoi(optarg); break;
+        case 'r': o.rooms = atoi(optarg); break;
+        case 's': o.senders = atoi(optarg); break;
+        case 'n': o.messages = atoi(optarg); break;
+        case 'i': o.interval_us = atoi(optarg); break;
+        case 'm': o.modes = optarg; break;
+        case 'x': o.server = optarg; break;
+        case 'w': o.loops = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (o.conns < 1 || o.rooms < 1 || o.senders < 0 || o.messages < 0) {
+        usage(argv[0]);
+    }
+    if (o.senders > o.conns) {
+        o.senders = o.conns;
+    }
+
+    // Thousands of sockets need more than the default descriptor limit
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(o.port) };
+    if (inet_pton(AF_INET, o.host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad host %s\n", o.host);
+        return 1;
+    }
+
+    if (o.modes != NULL) {
+        compare_modes(&o, &addr);
+        return 0;
+    }
+    run_bench(&o, &addr, &res);
+    print_result(&o, &res);
+    return 0;
+}
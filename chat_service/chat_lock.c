@@ -0,0 +1,117 @@
+#include "chat_lock.h"
+#include "stats.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Guards the registry list only, never held while taking a chat_lock
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct chat_lock *registry = NULL;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+void chat_lock_init(struct chat_lock *lock, const char *name) {
+    pthread_rwlock_init(&lock->rw, NULL);
+    snprintf(lock->name, sizeof(lock->name), "%s", name);
+    atomic_init(&lock->acquisitions, 0);
+    atomic_init(&lock->contended, 0);
+    atomic_init(&lock->wait_ns, 0);
+
+    pthread_mutex_lock(&registry_mutex);
+    lock->prev = NULL;
+    lock->next = registry;
+    if (registry != NULL) {
+        registry->prev = lock;
+    }
+    registry = lock;
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void chat_lock_destroy(struct chat_lock *lock) {
+    pthread_mutex_lock(&registry_mutex);
+    if (lock->prev == NULL) {
+        registry = lock->next;
+    } else {
+        lock->prev->next = lock->next;
+    }
+    if (lock->next != NULL) {
+        lock->next->prev = lock->prev;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+
+    pthread_rwlock_destroy(&lock->rw);
+}
+
+// Uncontended acquisitions cost one trylock; only waiters pay for the clock
+void chat_rdlock(struct chat_lock *lock) {
+    if (pthread_rwlock_tryrdlock(&lock->rw) == EBUSY) {
+        unsigned long start = now_ns();
+        pthread_rwlock_rdlock(&lock->rw);
+        atomic_fetch_add_explicit(&lock->contended, 1, memory_order_relaxed);
+        unsigned long waited = now_ns() - start;
+        atomic_fetch_add_explicit(&lock->wait_ns, waited, memory_order_relaxed);
+        stats_observe(STAT_HIST_LOCK_WAIT, waited / 1000);
+    }
+    atomic_fetch_add_explicit(&lock->acquisitions, 1, memory_order_relaxed);
+}
+
+void chat_wrlock(struct chat_lock *lock) {
+    if (pthread_rwlock_trywrlock(&lock->rw) == EBUSY) {
+        unsigned long start = now_ns();
+        pthread_rwlock_wrlock(&lock->rw);
+        atomic_fetch_add_explicit(&lock->contended, 1, memory_order_relaxed);
+        unsigned long waited = now_ns() - start;
+        atomic_fetch_add_explicit(&lock->wait_ns, waited, memory_order_relaxed);
+        stats_observe(STAT_HIST_LOCK_WAIT, waited / 1000);
+    }
+    atomic_fetch_add_explicit(&lock->acquisitions, 1, memory_order_relaxed);
+}
+
+void chat_unlock(struct chat_lock *lock) {
+    pthread_rwlock_unlock(&lock->rw);
+}
+
+void chat_lock_report(char *buffer, size_t size) {
+    size_t len = strlen(buffer);
+
+    pthread_mutex_lock(&registry_mutex);
+    for (struct chat_lock *lock = registry; lock != NULL && len < size; lock = lock->next) {
+        int n = snprintf(buffer + len, size - len, "%s %lu %lu %lu\n", lock->name,
+                         atomic_load_explicit(&lock->acquisitions, memory_order_relaxed),
+                         atomic_load_explicit(&lock->contended, memory_order_relaxed),
+                         atomic_load_explicit(&lock->wait_ns, memory_order_relaxed) / 1000);
+        if (n < 0 || (size_t) n >= size - len) {
+            // Out of room: drop the partial line
+            buffer[len] = '\0';
+            break;
+        }
+        len += n;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void chat_lock_metrics(char *buffer, size_t size) {
+    size_t len = strlen(buffer);
+
+    pthread_mutex_lock(&registry_mutex);
+    for (struct chat_lock *lock = registry; lock != NULL && len < size; lock = lock->next) {
+        int n = snprintf(buffer + len, size - len,
+                         "chat_lock_acquisitions_total{lock=\"%s\"} %lu\n"
+                         "chat_lock_contended_total{lock=\"%s\"} %lu\n"
+                         "chat_lock_wait_us_total{lock=\"%s\"} %lu\n",
+                         lock->name, atomic_load_explicit(&lock->acquisitions, memory_order_relaxed),
+                         lock->name, atomic_load_explicit(&lock->contended, memory_order_relaxed),
+                         lock->name, atomic_load_explicit(&lock->wait_ns, memory_order_relaxed) / 1000);
+        if (n < 0 || (size_t) n >= size - len) {
+            buffer[len] = '\0';
+            break;
+        }
+        len += n;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
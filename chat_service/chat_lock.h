@@ -0,0 +1,32 @@
+#ifndef CHAT_LOCK_H
+#define CHAT_LOCK_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Reader/writer lock that counts how often callers had to wait for it.
+// Every lock is registered so its counters can be reported by name.
+struct chat_lock {
+    pthread_rwlock_t rw;
+    char name[40];
+    atomic_ulong acquisitions; // Successful acquisitions, both modes
+    atomic_ulong contended;    // Acquisitions that found the lock busy
+    atomic_ulong wait_ns;      // Total time spent blocked on the lock
+    struct chat_lock *next;    // Registry of live locks
+    struct chat_lock *prev;
+};
+
+void chat_lock_init(struct chat_lock *lock, const char *name);
+void chat_lock_destroy(struct chat_lock *lock);
+void chat_rdlock(struct chat_lock *lock);
+void chat_wrlock(struct chat_lock *lock);
+void chat_unlock(struct chat_lock *lock);
+
+// Append "name acquisitions contended wait_us" lines for every live lock
+void chat_lock_report(char *buffer, size_t size);
+
+// The same counters as labelled metrics lines for the stats report
+void chat_lock_metrics(char *buffer, size_t size);
+
+#endif // CHAT_LOCK_H
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define MAX_EVENTS 256
+
+// One reactor: its own listening socket (SO_REUSEPORT) and epoll set
+struct event_loop {
+   int id;
+   int epfd;
+   int listen_fd;
+   int wake_fd;      // eventfd written when loops_state changes
+   pthread_t thread;
+};
+
+// Shutdown runs in stages so clients can still be served after accepting stops
+enum loops_state {
+   LOOPS_RUNNING,
+   LOOPS_DRAINING, // Listeners closed; connections still served
+   LOOPS_STOPPED   // Loops return
+};
+
+static struct event_loop *loops;
+static int loops_count;
+static atomic_int loops_state = LOOPS_RUNNING;
+
+// Tag the wake eventfd and the shard relay eventfd in the epoll set; the
+// listener is tagged NULL
+static char wake_tag;
+static char relay_tag;
+
+// Accept every pending connection on this loop's listener
+static void loop_accept(struct event_loop *loop) {
+   while(loop->listen_fd != -1) {
+      int fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if(fd == -1) {
+         if(errno == EINTR) {
+            continue;
+         }
+         if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            chat_log(CHAT_LOG_ERROR, "Accept: %s", strerror(errno));
+         }
+         return;
+      }
+      if(!client_admit(fd)) {
+         continue;
+      }
+
+      struct client_conn *conn = client_open(fd);
+
+      struct epoll_event ev;
+      // EPOLLOUT edges tell us when a full socket can take queued output
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.ptr = conn;
+      if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+         chat_log(CHAT_LOG_ERROR, "epoll_ctl: %s", strerror(errno));
+         client_close(conn);
+      }
+   }
+}
+
+// Drain a readable client (edge-triggered), handing each read to the
+// connection's input parser. Returns non-zero once the connection has been closed.
+static int loop_read(struct client_conn *conn) {
+   while(1) {
+      ssize_t received = read(conn->socket, conn->inbuf + conn->inlen, INBUF_SIZE - 1 - conn->inlen);
+      if(received > 0) {
+         conn->inlen += received;
+         stats_add(STAT_BYTES_IN, received);
+         if(client_process_input(conn)) {
+            client_close(conn);
+            return 1;
+         }
+         continue;
+      }
+      if(received == -1 && errno == EINTR) {
+         continue;
+      }
+      if(received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+         return 0;
+      }
+
+      // EOF or hard error
+      chat_log(CHAT_LOG_INFO, "Client disconnected: %s", conn->username);
+      client_close(conn);
+      return 1;
+   }
+}
+
+static void *event_loop_run(void *ptr) {
+   struct event_loop *loop = ptr;
+   struct epoll_event events[MAX_EVENTS];
+
+   send_queue_never_wait();
+   while(1) {
+      int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+      if(n == -1) {
+         if(errno == EINTR) {
+            continue;
+         }
+         chat_log(CHAT_LOG_ERROR, "epoll_wait: %s", strerror(errno));
+         break;
+      }
+
+      for(int i = 0; i < n; i++) {
+         struct client_conn *conn = events[i].data.ptr;
+         if(conn == NULL) {
+            loop_accept(loop);
+            continue;
+         }
+         if(events[i].data.ptr == &relay_tag) {
+            shard_relay_drain();
+            continue;
+         }
+         if(events[i].data.ptr == &wake_tag) {
+            uint64_t count;
+            if(read(loop->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+               chat_log(CHAT_LOG_ERROR, "Wake read: %s", strerror(errno));
+            }
+            int state = atomic_load(&loops_state);
+            if(state >= LOOPS_DRAINING && loop->listen_fd != -1) {
+               // Closing the listener also drops it from the epoll set
+               close(loop->listen_fd);
+               loop->listen_fd = -1;
+            }
+            if(state == LOOPS_STOPPED) {
+               return NULL;
+            }
+            continue;
+         }
+         if(events[i].events & EPOLLOUT) {
+            send_queue_flush(conn->socket);
+         }
+         if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            loop_read(conn);
+         }
+      }
+   }
+   return NULL;
+}
+
+static void wake_loops(int state) {
+   uint64_t one = 1;
+
+   atomic_store(&loops_state, state);
+   for(int i = 0; i < loops_count; i++) {
+      if(write(loops[i].wake_fd, &one, sizeof(one)) == -1) {
+         chat_log(CHAT_LOG_ERROR, "Wake write: %s", strerror(errno));
+      }
+   }
+}
+
+// Start num_loops reactors on listen_port, each on its own thread
+int start_event_loops(int num_loops) {
+   loops = calloc(num_loops, sizeof(struct event_loop));
+   if(loops == NULL) {
+      perror("Failed to allocate event loops");
+      exit(EXIT_FAILURE);
+   }
+   loops_count = num_loops;
+
+   for(int i = 0; i < num_loops; i++) {
+      struct event_loop *loop = &loops[i];
+      loop->id = i;
+      loop->listen_fd = get_server_socket(1);
+      if(start_server(loop->listen_fd, listen_backlog) == -1) {
+         printf("Start server error\n");
+         exit(1);
+      }
+      if(fcntl(loop->listen_fd, F_SETFL, O_NONBLOCK) == -1) {
+         perror("fcntl");
+         exit(EXIT_FAILURE);
+      }
+
+      loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+      loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if(loop->epfd == -1 || loop->wake_fd == -1) {
+         perror("epoll_create1");
+         exit(EXIT_FAILURE);
+      }
+
+      // The listener is tagged with a NULL connection pointer
+      struct epoll_event ev;
+      ev.events = EPOLLIN | EPOLLET;
+      ev.data.ptr = NULL;
+      if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listen_fd, &ev) == -1) {
+         perror("epoll_ctl");
+         exit(EXIT_FAILURE);
+      }
+      ev.events = EPOLLIN;
+      ev.data.ptr = &wake_tag;
+      if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &ev) == -1) {
+         perror("epoll_ctl");
+         exit(EXIT_FAILURE);
+      }
+
+      // A shard runs one loop, the only consumer of its relay rings
+      if(i == 0 && shard_wake_fd() != -1) {
+         ev.data.ptr = &relay_tag;
+         if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, shard_wake_fd(), &ev) == -1) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+         }
+      }
+   }
+
+   for(int i = 0; i < num_loops; i++) {
+      pthread_create(&loops[i].thread, NULL, event_loop_run, &loops[i]);
+   }
+   return 0;
+}
+
+// Close every listener; the loops keep serving their connections
+void event_loops_stop_accepting(void) {
+   wake_loops(LOOPS_DRAINING);
+}
+
+// Make every loop return and wait for it
+void stop_event_loops(void) {
+   wake_loops(LOOPS_STOPPED);
+   for(int i = 0; i < loops_count; i++) {
+      pthread_join(loops[i].thread, NULL);
+      close(loops[i].epfd);
+      close(loops[i].wake_fd);
+   }
+   free(loops);
+   loops = NULL;
+   loops_count = 0;
+}
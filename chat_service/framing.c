@@ -0,0 +1,67 @@
+#include "server.h"
+
+static const char *const op_commands[] = {
+    [OP_TEXT] = NULL,
+    [OP_LOGIN] = "login",
+    [OP_CREATE] = "create",
+    [OP_JOIN] = "join",
+    [OP_LEAVE] = "leave",
+    [OP_CONNECT] = "connect",
+    [OP_DISCONNECT] = "disconnect",
+    [OP_ROOMS] = "rooms",
+    [OP_USERS] = "users",
+    [OP_SEND] = NULL,
+    [OP_EXIT] = "exit",
+};
+
+const char *frame_op_command(uint8_t op) {
+    if (op >= sizeof(op_commands) / sizeof(op_commands[0])) {
+        return NULL;
+    }
+    return op_commands[op];
+}
+
+long frame_parse(const char *buf, size_t len, uint8_t *op, const char **payload, size_t *payload_len) {
+    if (len < FRAME_HEADER_LEN) {
+        return 0;
+    }
+
+    const unsigned char *p = (const unsigned char *) buf;
+    uint32_t frame_len = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+    if (frame_len < 1 || frame_len > FRAME_MAX_LEN) {
+        return -1;
+    }
+    if (len < 4 + (size_t) frame_len) {
+        return 0;
+    }
+
+    *op = p[4];
+    *payload = buf + FRAME_HEADER_LEN;
+    *payload_len = frame_len - 1;
+    return 4 + frame_len;
+}
+
+struct chat_msg *frame_text(uint8_t op, const char *data, size_t len) {
+    static const char prompt[] = "chat>";
+    size_t prompt_len = sizeof(prompt) - 1;
+
+    if (len >= prompt_len && memcmp(data + len - prompt_len, prompt, prompt_len) == 0) {
+        len -= prompt_len;
+    }
+
+    struct chat_msg *msg = malloc(sizeof(struct chat_msg) + FRAME_HEADER_LEN + len);
+    if (msg == NULL) {
+        perror("Failed to allocate outbound frame");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t frame_len = len + 1;
+    msg->data[0] = frame_len >> 24;
+    msg->data[1] = frame_len >> 16;
+    msg->data[2] = frame_len >> 8;
+    msg->data[3] = frame_len;
+    msg->data[4] = op;
+    memcpy(msg->data + FRAME_HEADER_LEN, data, len);
+    atomic_init(&msg->refs, 1);
+    msg->len = FRAME_HEADER_LEN + len;
+    return msg;
+}
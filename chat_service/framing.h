@@ -0,0 +1,46 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "send_queue.h"
+
+// Binary framing, negotiated with the text command "binary". Every frame is
+//   uint32 length (big endian, counts the opcode and payload)
+//   uint8  opcode
+//   payload
+// A client may pipeline any number of frames per write and split them
+// across writes freely; the server parses them incrementally.
+#define FRAME_HEADER_LEN 5
+#define FRAME_MAX_LEN MAXBUFF
+
+// Client to server. A command's argument, if any, is the payload.
+enum frame_op {
+    OP_TEXT = 0x01,       // Payload is a text-protocol command line
+    OP_LOGIN = 0x02,
+    OP_CREATE = 0x03,
+    OP_JOIN = 0x04,
+    OP_LEAVE = 0x05,
+    OP_CONNECT = 0x06,
+    OP_DISCONNECT = 0x07,
+    OP_ROOMS = 0x08,
+    OP_USERS = 0x09,
+    OP_SEND = 0x0a,       // Payload is a chat message for the sender's rooms and DMs
+    OP_EXIT = 0x0b,
+
+    // Server to client
+    OP_REPLY = 0x80,      // Response to the client's own command
+    OP_CHAT = 0x81        // Message from another user, or a room's catch-up on join
+};
+
+// Text-protocol command name for an opcode, or NULL
+const char *frame_op_command(uint8_t op);
+
+// Parse one frame from buf. Returns the bytes it spans, 0 if the frame is
+// not complete yet, or -1 if the stream is malformed.
+long frame_parse(const char *buf, size_t len, uint8_t *op, const char **payload, size_t *payload_len);
+
+// Build a frame holding data, dropping a trailing text prompt ("chat>")
+struct chat_msg *frame_text(uint8_t op, const char *data, size_t len);
+
+#endif // FRAMING_H
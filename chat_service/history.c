@@ -0,0 +1,104 @@
+#include "history.h"
+#include "send_queue.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int history_replay_count = HISTORY_DEFAULT_REPLAY;
+static atomic_size_t history_reserved; // Arena bytes handed out across rooms
+
+void history_configure(int replay) {
+    history_replay_count = replay < HISTORY_ENTRIES ? replay : HISTORY_ENTRIES;
+}
+
+void history_init(struct room_history *history) {
+    pthread_mutex_init(&history->lock, NULL);
+    history->arena = NULL;
+    history->write = 0;
+    history->head = 0;
+    history->count = 0;
+}
+
+void history_free(struct room_history *history) {
+    if (history->arena != NULL) {
+        free(history->arena);
+        atomic_fetch_sub(&history_reserved, HISTORY_ROOM_BYTES);
+    }
+    pthread_mutex_destroy(&history->lock);
+}
+
+// Claim an arena within the global budget; caller holds the lock
+static bool history_reserve(struct room_history *history) {
+    if (atomic_fetch_add(&history_reserved, HISTORY_ROOM_BYTES) + HISTORY_ROOM_BYTES > HISTORY_GLOBAL_BYTES) {
+        atomic_fetch_sub(&history_reserved, HISTORY_ROOM_BYTES);
+        return false;
+    }
+    history->arena = malloc(HISTORY_ROOM_BYTES);
+    if (history->arena == NULL) {
+        atomic_fetch_sub(&history_reserved, HISTORY_ROOM_BYTES);
+        return false;
+    }
+    return true;
+}
+
+void history_append(struct room_history *history, const char *data, size_t len) {
+    if (history_replay_count == 0 || len == 0 || len > HISTORY_ROOM_BYTES) {
+        return;
+    }
+
+    pthread_mutex_lock(&history->lock);
+    if (history->arena == NULL && !history_reserve(history)) {
+        pthread_mutex_unlock(&history->lock);
+        return;
+    }
+
+    // Messages are never split: one that doesn't fit the end starts over at 0
+    if (history->write + len > HISTORY_ROOM_BYTES) {
+        history->write = 0;
+    }
+
+    // Entries lie in arena order starting from the oldest, so the ones
+    // this message overwrites are always at the head
+    while (history->count > 0) {
+        struct history_entry *oldest = &history->entries[history->head];
+        bool overlaps = oldest->offset < history->write + len && history->write < oldest->offset + oldest->len;
+        if (!overlaps && history->count < HISTORY_ENTRIES) {
+            break;
+        }
+        history->head = (history->head + 1) % HISTORY_ENTRIES;
+        history->count--;
+    }
+
+    struct history_entry *e = &history->entries[(history->head + history->count) % HISTORY_ENTRIES];
+    e->offset = history->write;
+    e->len = len;
+    memcpy(history->arena + history->write, data, len);
+    history->write += len;
+    history->count++;
+    pthread_mutex_unlock(&history->lock);
+}
+
+struct chat_msg *history_replay(struct room_history *history) {
+    struct chat_msg *msg = NULL;
+
+    pthread_mutex_lock(&history->lock);
+    unsigned n = history->count < (unsigned) history_replay_count ? history->count : (unsigned) history_replay_count;
+    unsigned first = history->head + history->count - n;
+    size_t total = 0;
+
+    for (unsigned i = 0; i < n; i++) {
+        total += history->entries[(first + i) % HISTORY_ENTRIES].len;
+    }
+    if (total > 0) {
+        // One body for the whole catch-up, so it leaves in one write
+        msg = chat_msg_new(NULL, total);
+        size_t offset = 0;
+        for (unsigned i = 0; i < n; i++) {
+            struct history_entry *e = &history->entries[(first + i) % HISTORY_ENTRIES];
+            memcpy(msg->data + offset, history->arena + e->offset, e->len);
+            offset += e->len;
+        }
+    }
+    pthread_mutex_unlock(&history->lock);
+    return msg;
+}
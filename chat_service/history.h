@@ -0,0 +1,44 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct chat_msg;
+
+// Recent messages of one room, kept so late joiners can catch up. Message
+// bytes live in a per-room arena used as a circular buffer; appending
+// evicts the oldest messages it overwrites, so nothing is allocated per
+// message. Arenas are created on a room's first message and count against
+// a global budget; rooms that find the budget spent keep no history.
+#define HISTORY_ENTRIES 128                  // Messages remembered per room at most
+#define HISTORY_ROOM_BYTES (16 * 1024)       // Arena size per room
+#define HISTORY_GLOBAL_BYTES (64 * 1024 * 1024)
+#define HISTORY_DEFAULT_REPLAY 20            // Messages replayed on join
+
+struct history_entry {
+    uint32_t offset;
+    uint32_t len;
+};
+
+struct room_history {
+    pthread_mutex_t lock; // Appends run under the room's read lock, in parallel
+    char *arena;          // HISTORY_ROOM_BYTES, NULL until the first message
+    size_t write;         // Arena offset of the next message
+    unsigned head;        // Oldest entry
+    unsigned count;
+    struct history_entry entries[HISTORY_ENTRIES];
+};
+
+// Messages replayed on join; 0 turns history off
+void history_configure(int replay);
+
+void history_init(struct room_history *history);
+void history_free(struct room_history *history);
+void history_append(struct room_history *history, const char *data, size_t len);
+
+// The last messages as one reference-counted body, or NULL when there are none
+struct chat_msg *history_replay(struct room_history *history);
+
+#endif // HISTORY_H
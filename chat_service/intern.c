@@ -0,0 +1,216 @@
+#include "intern.h"
+#include "list.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TABLE_MIN_CAPACITY 64
+#define TABLE_TOMBSTONE UINT32_MAX
+
+struct name_entry {
+    char str[NAME_LEN];
+    uint32_t hash;
+    atomic_uint refs;   // Only reaches zero under the table's write lock
+    uint32_t next_free; // Free list link while unused
+    void *bound[NAME_KINDS];
+};
+
+// Open addressing from a name's hash to its id; deleted ids become
+// tombstones until the next resize
+struct name_table {
+    pthread_rwlock_t lock;
+    uint32_t *slots;
+    size_t capacity; // Always a power of two
+    size_t count;    // Live entries
+    size_t used;     // Live entries plus tombstones
+};
+
+static struct name_table tables[NAME_SHARDS];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+// Id allocation; ids are handed out densely from next_id and reused LIFO
+static struct name_entry *chunks[NAME_CHUNKS];
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t free_head = NAME_NONE;
+static uint32_t next_id = 1;
+
+static void tables_init(void) {
+    for (int i = 0; i < NAME_SHARDS; i++) {
+        pthread_rwlock_init(&tables[i].lock, NULL);
+    }
+}
+
+static struct name_entry *entry(uint32_t id) {
+    return &chunks[id / NAME_CHUNK][id % NAME_CHUNK];
+}
+
+// Shards use the top hash bits; probing uses the low ones
+static struct name_table *table_for(uint32_t hash) {
+    pthread_once(&tables_once, tables_init);
+    return &tables[(uint64_t) hash * NAME_SHARDS >> 32];
+}
+
+static uint32_t alloc_id(void) {
+    uint32_t id;
+
+    pthread_mutex_lock(&alloc_lock);
+    if (free_head != NAME_NONE) {
+        id = free_head;
+        free_head = entry(id)->next_free;
+    } else {
+        id = next_id++;
+        if (id / NAME_CHUNK >= NAME_CHUNKS) {
+            fprintf(stderr, "Name table exhausted\n");
+            exit(EXIT_FAILURE);
+        }
+        if (chunks[id / NAME_CHUNK] == NULL) {
+            chunks[id / NAME_CHUNK] = calloc(NAME_CHUNK, sizeof(struct name_entry));
+            if (chunks[id / NAME_CHUNK] == NULL) {
+                perror("Failed to allocate name chunk");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return id;
+}
+
+static void free_id(uint32_t id) {
+    pthread_mutex_lock(&alloc_lock);
+    entry(id)->next_free = free_head;
+    free_head = id;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Linear probe for name; returns its slot or NULL. Caller holds the table lock.
+static uint32_t *table_probe(struct name_table *table, const char *name, uint32_t hash) {
+    if (table->capacity == 0) {
+        return NULL;
+    }
+    size_t i = hash & (table->capacity - 1);
+    while (table->slots[i] != NAME_NONE) {
+        uint32_t id = table->slots[i];
+        if (id != TABLE_TOMBSTONE && entry(id)->hash == hash && strcmp(entry(id)->str, name) == 0) {
+            return &table->slots[i];
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return NULL;
+}
+
+static void table_insert(struct name_table *table, uint32_t id) {
+    // Keep live entries plus tombstones under 70% so probes stay short
+    if ((table->used + 1) * 10 > table->capacity * 7) {
+        size_t capacity = table->capacity ? table->capacity : TABLE_MIN_CAPACITY;
+        while ((table->count + 1) * 10 > capacity * 5) {
+            capacity *= 2;
+        }
+        uint32_t *slots = calloc(capacity, sizeof(uint32_t));
+        if (slots == NULL) {
+            perror("Memory allocation failed for name table");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < table->capacity; i++) {
+            uint32_t old = table->slots[i];
+            if (old == NAME_NONE || old == TABLE_TOMBSTONE) {
+                continue;
+            }
+            size_t j = entry(old)->hash & (capacity - 1);
+            while (slots[j] != NAME_NONE) {
+                j = (j + 1) & (capacity - 1);
+            }
+            slots[j] = old;
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
+        table->used = table->count;
+    }
+
+    size_t i = entry(id)->hash & (table->capacity - 1);
+    while (table->slots[i] != NAME_NONE && table->slots[i] != TABLE_TOMBSTONE) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    if (table->slots[i] == NAME_NONE) {
+        table->used++;
+    }
+    table->slots[i] = id;
+    table->count++;
+}
+
+uint32_t name_intern(const char *name) {
+    char key[NAME_LEN];
+    snprintf(key, sizeof(key), "%s", name);
+    uint32_t hash = hashName(key);
+    struct name_table *table = table_for(hash);
+
+    pthread_rwlock_wrlock(&table->lock);
+    uint32_t *slot = table_probe(table, key, hash);
+    uint32_t id;
+    if (slot != NULL) {
+        id = *slot;
+        atomic_fetch_add(&entry(id)->refs, 1);
+    } else {
+        id = alloc_id();
+        struct name_entry *e = entry(id);
+        memcpy(e->str, key, sizeof(key));
+        e->hash = hash;
+        atomic_store(&e->refs, 1);
+        memset(e->bound, 0, sizeof(e->bound));
+        table_insert(table, id);
+    }
+    pthread_rwlock_unlock(&table->lock);
+    return id;
+}
+
+uint32_t name_acquire(const char *name) {
+    char key[NAME_LEN];
+    snprintf(key, sizeof(key), "%s", name);
+    uint32_t hash = hashName(key);
+    struct name_table *table = table_for(hash);
+
+    // Read lock: the last release needs the write lock, so refs > 0 here
+    pthread_rwlock_rdlock(&table->lock);
+    uint32_t *slot = table_probe(table, key, hash);
+    uint32_t id = slot != NULL ? *slot : NAME_NONE;
+    if (id != NAME_NONE) {
+        atomic_fetch_add(&entry(id)->refs, 1);
+    }
+    pthread_rwlock_unlock(&table->lock);
+    return id;
+}
+
+void name_release(uint32_t id) {
+    struct name_entry *e = entry(id);
+
+    // Drop a reference that is not the last without locking
+    unsigned refs = atomic_load(&e->refs);
+    while (refs > 1) {
+        if (atomic_compare_exchange_weak(&e->refs, &refs, refs - 1)) {
+            return;
+        }
+    }
+
+    struct name_table *table = table_for(e->hash);
+    pthread_rwlock_wrlock(&table->lock);
+    if (atomic_fetch_sub(&e->refs, 1) == 1) {
+        *table_probe(table, e->str, e->hash) = TABLE_TOMBSTONE;
+        table->count--;
+        free_id(id);
+    }
+    pthread_rwlock_unlock(&table->lock);
+}
+
+const char *name_str(uint32_t id) {
+    return entry(id)->str;
+}
+
+void name_bind(uint32_t id, enum name_kind kind, void *node) {
+    entry(id)->bound[kind] = node;
+}
+
+void *name_bound(uint32_t id, enum name_kind kind) {
+    return entry(id)->bound[kind];
+}
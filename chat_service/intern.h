@@ -0,0 +1,43 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdint.h>
+
+// Interned names. Every distinct user or room name is stored once and
+// known by a 32-bit id; the registries keep ids, so two names are equal
+// exactly when their ids are, and the bytes of a name live in one place.
+// An id can also carry the user and room currently registered under it,
+// which makes it the registries' name index as well.
+//
+// Entries are reference counted; an id is recycled once its last holder
+// releases it. Entry storage is allocated in chunks that are never freed
+// or moved, so name_str() stays readable (though perhaps stale) even after
+// a release.
+#define NAME_LEN 30        // Longer names are truncated, on intern and lookup alike
+#define NAME_NONE 0
+#define NAME_SHARDS 16     // Independently locked lookup tables
+#define NAME_CHUNK 1024    // Entries per storage chunk
+#define NAME_CHUNKS 4096   // So ids stay below 4M
+
+enum name_kind {
+    NAME_USER,
+    NAME_ROOM,
+    NAME_KINDS
+};
+
+// A new reference to name, interning it first if needed
+uint32_t name_intern(const char *name);
+
+// A new reference to name if it is already interned, else NAME_NONE.
+// Lookups only take the table's read lock.
+uint32_t name_acquire(const char *name);
+
+void name_release(uint32_t id);
+const char *name_str(uint32_t id);
+
+// Registry binding: the node registered under id. Read and written under
+// the registry's own locks.
+void name_bind(uint32_t id, enum name_kind kind, void *node);
+void *name_bound(uint32_t id, enum name_kind kind);
+
+#endif // INTERN_H
@@ -1,73 +1,125 @@
 #include "list.h"
+#include "log.h"
+#include "shard.h"
+
+// Every node this file hands out comes from a slab pool
+static struct pool user_pool = POOL_INITIALIZER("user_node", sizeof(struct user_node));
+static struct pool room_pool = POOL_INITIALIZER("room_node", sizeof(struct room_node));
+static struct pool link_pool = POOL_INITIALIZER("room_link", sizeof(struct room_link));
+
+// Callers of addUser hold users_lock for writing
+static uint32_t next_user_id = 1;
+
+// FNV-1a over the NUL-terminated name
+uint32_t hashName(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Shards use the top hash bits; probing uses the low ones. The name is
+// truncated as intern.c stores it, so an overlong argument maps to the
+// same shard as the record it names.
+int userShard(const char *username) {
+    char key[NAME_LEN];
+    snprintf(key, sizeof(key), "%s", username);
+    return (int) ((uint64_t) hashName(key) * USER_SHARDS >> 32);
+}
+
+// The registry node bound to name, or NULL
+static void *findBound(const char *name, enum name_kind kind) {
+    uint32_t id = name_acquire(name);
+    if (id == NAME_NONE) {
+        return NULL;
+    }
+    void *node = name_bound(id, kind);
+    name_release(id);
+    return node;
+}
 
 // Add a user to the user list
 struct user_node* addUser(struct user_node *head, int socket, char *username) {
     if (findUser(head, username) == NULL) {
-        struct user_node *new_user = (struct user_node*) malloc(sizeof(struct user_node));
-        if (new_user == NULL) {
-            perror("Memory allocation failed for new user");
-            exit(EXIT_FAILURE);
-        }
+        struct user_node *new_user = (struct user_node*) pool_alloc(&user_pool);
         new_user->socket = socket;
-        strcpy(new_user->username, username);
-        new_user->dm_connections = NULL;
+        new_user->name = name_intern(username);
+        name_bind(new_user->name, NAME_USER, new_user);
+        new_user->id = next_user_id++;
+        new_user->dms = (struct dm_set) { 0 };
+        new_user->rooms_joined = NULL;
+        new_user->prev = NULL;
         new_user->next = head;
+        if (head != NULL) {
+            head->prev = new_user;
+        }
         head = new_user;
     } else {
-        printf("Username already exists: %s\n", username);
+        chat_log(CHAT_LOG_INFO, "Username already exists: %s", username);
     }
     return head;
 }
 
 // Search for a user by username
 struct user_node* findUser(struct user_node *head, char* username) {
-    struct user_node* current = head;
-    while (current != NULL) {
-        if (strcmp(current->username, username) == 0) {
-            return current;
-        }
-        current = current->next;
+    if (head == NULL) {
+        return NULL;
     }
-    return NULL;
+    return (struct user_node*) findBound(username, NAME_USER);
 }
 
 // Remove a user from the user list
 struct user_node* removeUser(struct user_node *head, char *username) {
-    struct user_node *current = head;
-    struct user_node *previous = NULL;
-
-    while (current != NULL && strcmp(current->username, username) != 0) {
-        previous = current;
-        current = current->next;
-    }
+    struct user_node *current = findUser(head, username);
 
     if (current == NULL) { // User not found
         return head;
     }
 
-    if (current == head) {
-        head = head->next;
+    if (current->prev == NULL) {
+        head = current->next;
     } else {
-        previous->next = current->next;
+        current->prev->next = current->next;
+    }
+    if (current->next != NULL) {
+        current->next->prev = current->prev;
     }
 
-    // Free direct message connections
-    struct user_node *dm = current->dm_connections;
-    while(dm != NULL) {
-        struct user_node *temp = dm;
-        dm = dm->next;
-        free(temp);
+    // Peers must not keep pointing at the freed node
+    dropUserDMs(current);
+
+    // Callers leave every room before removing a user
+    while(current->rooms_joined != NULL) {
+        removeUserFromRoom(current->rooms_joined->room, current);
     }
 
-    free(current);
+    name_bind(current->name, NAME_USER, NULL);
+    name_release(current->name);
+    pool_free(&user_pool, current);
     return head;
 }
 
+// Change a registered user's name, keeping the index in step
+bool renameUser(struct user_node *head, char *oldname, char *newname) {
+    struct user_node *user = findUser(head, oldname);
+    if (user == NULL || findUser(head, newname) != NULL) {
+        return false;
+    }
+    uint32_t old = user->name;
+    user->name = name_intern(newname);
+    name_bind(user->name, NAME_USER, user);
+    name_bind(old, NAME_USER, NULL);
+    name_release(old);
+    return true;
+}
+
 // Display all users in the user list
 void displayUsers(struct user_node *head) {
     struct user_node *current = head;
     while (current != NULL) {
-        printf("User: %s\n", current->username);
+        printf("User: %s\n", name_str(current->name));
         current = current->next;
     }
 }
@@ -75,175 +127,236 @@ void displayUsers(struct user_node *head) {
 // Add a room to the room list
 struct room_node* addRoom(struct room_node *head, char *roomname) {
     if (findRoom(head, roomname) == NULL) {
-        struct room_node *new_room = (struct room_node*) malloc(sizeof(struct room_node));
-        if (new_room == NULL) {
-            perror("Memory allocation failed for new room");
-            exit(EXIT_FAILURE);
-        }
-        strcpy(new_room->roomname, roomname);
-        new_room->users = NULL;
+        struct room_node *new_room = (struct room_node*) pool_alloc(&room_pool);
+        new_room->name = name_intern(roomname);
+        name_bind(new_room->name, NAME_ROOM, new_room);
+        new_room->members = NULL;
+        char lockname[40];
+        snprintf(lockname, sizeof(lockname), "room:%s", roomname);
+        chat_lock_init(&new_room->lock, lockname);
+        history_init(&new_room->history);
+        token_bucket_init(&new_room->limit);
+        new_room->prev = NULL;
         new_room->next = head;
+        if (head != NULL) {
+            head->prev = new_room;
+        }
         head = new_room;
+        shard_room_add(roomname);
     } else {
-        printf("Room already exists: %s\n", roomname);
+        chat_log(CHAT_LOG_INFO, "Room already exists: %s", roomname);
     }
     return head;
 }
 
 // Search for a room by name
 struct room_node* findRoom(struct room_node *head, char* roomname) {
-    struct room_node* current = head;
-    while (current != NULL) {
-        if (strcmp(current->roomname, roomname) == 0) {
-            return current;
-        }
-        current = current->next;
+    if (head == NULL) {
+        return NULL;
     }
-    return NULL;
+    return (struct room_node*) findBound(roomname, NAME_ROOM);
 }
 
 // Remove a room from the room list
 struct room_node* removeRoom(struct room_node *head, char *roomname) {
-    struct room_node *current = head;
-    struct room_node *previous = NULL;
-
-    while (current != NULL && strcmp(current->roomname, roomname) != 0) {
-        previous = current;
-        current = current->next;
-    }
+    struct room_node *current = findRoom(head, roomname);
 
     if (current == NULL) { // Room not found
         return head;
     }
 
-    if (current == head) {
-        head = head->next;
+    if (current->prev == NULL) {
+        head = current->next;
     } else {
-        previous->next = current->next;
+        current->prev->next = current->next;
+    }
+    if (current->next != NULL) {
+        current->next->prev = current->prev;
     }
 
-    // Free the list of users in the room
-    struct user_node *user = current->users;
-    while(user != NULL) {
-        struct user_node *temp = user;
-        user = user->next;
-        free(temp);
+    // Drop every membership, which also takes the room out of each member's joined set
+    while(current->members != NULL) {
+        removeUserFromRoom(current, current->members->user);
     }
 
-    free(current);
+    chat_lock_destroy(&current->lock);
+    history_free(&current->history);
+    name_bind(current->name, NAME_ROOM, NULL);
+    name_release(current->name);
+    pool_free(&room_pool, current);
     return head;
 }
 
-// List all rooms and append to buffer
-void listAllRooms(struct room_node *head, char *buffer) {
-    struct room_node *current = head;
-    while (current != NULL) {
-        strcat(buffer, current->roomname);
-        strcat(buffer, "\n");
-        current = current->next;
+// Append name and a newline to the string in buffer, unless that would
+// not fit in size bytes. Returns false once it is full.
+static bool appendName(char *buffer, size_t size, size_t *len, uint32_t name) {
+    int n = snprintf(buffer + *len, size - *len, "%s\n", name_str(name));
+    if (n < 0 || (size_t) n >= size - *len) {
+        // Out of room: drop the partial line
+        buffer[*len] = '\0';
+        return false;
+    }
+    *len += n;
+    return true;
+}
+
+// List all users and append to buffer, as many as fit in size bytes
+void listAllUsers(struct user_node *head, char *buffer, size_t size) {
+    size_t len = strlen(buffer);
+    for (struct user_node *current = head; current != NULL; current = current->next) {
+        if (!appendName(buffer, size, &len, current->name)) {
+            break;
+        }
     }
 }
 
+// List all rooms and append to buffer, as many as fit in size bytes
+void listAllRooms(struct room_node *head, char *buffer, size_t size) {
+    size_t len = strlen(buffer);
+    for (struct room_node *current = head; current != NULL; current = current->next) {
+        if (!appendName(buffer, size, &len, current->name)) {
+            break;
+        }
+    }
+}
+
+// Check membership through the user's joined set, O(rooms joined)
+bool isUserInRoom(struct room_node *room, struct user_node *user) {
+    struct room_link *link = user->rooms_joined;
+    while(link != NULL) {
+        if(link->room == room) {
+            return true;
+        }
+        link = link->next;
+    }
+    return false;
+}
+
 // Add a user to a specific room
 void addUserToRoom(struct room_node *room, struct user_node *user) {
     // Ensure the user isn't already in the room
-    struct user_node *current = room->users;
-    while(current != NULL) {
-        if(strcmp(current->username, user->username) == 0) {
-            // User already exists in the room
-            return;
-        }
-        current = current->next;
+    if(isUserInRoom(room, user)) {
+        return;
     }
 
-    // Add the user to the room's user list
-    struct user_node *new_user = (struct user_node*) malloc(sizeof(struct user_node));
-    if (new_user == NULL) {
-        perror("Memory allocation failed for user in room");
-        exit(EXIT_FAILURE);
+    struct room_link *link = (struct room_link*) pool_alloc(&link_pool);
+    link->room = room;
+    link->user = user;
+
+    // Record the room in the user's joined set
+    link->next = user->rooms_joined;
+    user->rooms_joined = link;
+
+    // Add the user to the room's member list
+    link->prev_member = NULL;
+    link->next_member = room->members;
+    if(room->members != NULL) {
+        room->members->prev_member = link;
     }
-    strcpy(new_user->username, user->username);
-    new_user->socket = user->socket;
-    new_user->dm_connections = NULL;
-    new_user->next = room->users;
-    room->users = new_user;
+    room->members = link;
+    shard_room_join(name_str(room->name));
 }
 
 // Remove a user from a specific room
-void removeUserFromRoom(struct room_node *room, char *username) {
-    struct user_node *current = room->users;
-    struct user_node *previous = NULL;
-
-    while (current != NULL && strcmp(current->username, username) != 0) {
-        previous = current;
-        current = current->next;
+void removeUserFromRoom(struct room_node *room, struct user_node *user) {
+    // Find the membership in the user's joined set
+    struct room_link **link = &user->rooms_joined;
+    while(*link != NULL && (*link)->room != room) {
+        link = &(*link)->next;
     }
-
-    if (current == NULL) { // User not found in the room
+    if(*link == NULL) { // User not in the room
         return;
     }
+    struct room_link *found = *link;
+    *link = found->next;
 
-    if (current == room->users) {
-        room->users = room->users->next;
+    // Unlink it from the room's member list
+    if(found->prev_member == NULL) {
+        room->members = found->next_member;
     } else {
-        previous->next = current->next;
+        found->prev_member->next_member = found->next_member;
+    }
+    if(found->next_member != NULL) {
+        found->next_member->prev_member = found->prev_member;
     }
 
-    free(current);
+    pool_free(&link_pool, found);
 }
 
-// List all users in a specific room and append to buffer
-void listUsersInRoom(struct room_node *room, char *buffer) {
-    struct user_node *current = room->users;
-    while(current != NULL) {
-        strcat(buffer, current->username);
-        strcat(buffer, "\n");
-        current = current->next;
+// List all users in a specific room and append to buffer, as many as fit
+// in size bytes
+void listUsersInRoom(struct room_node *room, char *buffer, size_t size) {
+    size_t len = strlen(buffer);
+    for (struct room_link *current = room->members; current != NULL; current = current->next_member) {
+        if (!appendName(buffer, size, &len, current->user->name)) {
+            break;
+        }
     }
 }
 
-// Connect two users for direct messaging
-bool connectUsersDM(struct user_node *head, char *user1, char *user2) {
-    struct user_node *u1 = findUser(head, user1);
-    struct user_node *u2 = findUser(head, user2);
+// Position of id in set, or where it would be inserted
+static uint32_t dmSearch(const struct dm_set *set, uint32_t id) {
+    uint32_t lo = 0, hi = set->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (set->peers[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
 
-    if(u1 == NULL || u2 == NULL) {
+static bool dmContains(const struct dm_set *set, uint32_t id) {
+    uint32_t i = dmSearch(set, id);
+    return i < set->count && set->peers[i].id == id;
+}
+
+// Add peer to set; false if it was already there
+static bool dmInsert(struct dm_set *set, struct user_node *peer) {
+    uint32_t i = dmSearch(set, peer->id);
+    if (i < set->count && set->peers[i].id == peer->id) {
         return false;
     }
-
-    // Ensure users are not already connected
-    struct user_node *current = u1->dm_connections;
-    while(current != NULL) {
-        if(strcmp(current->username, user2) == 0) {
-            return false; // Already connected
+    if (set->count == set->capacity) {
+        uint32_t capacity = set->capacity ? set->capacity * 2 : 4;
+        struct dm_peer *peers = realloc(set->peers, capacity * sizeof(struct dm_peer));
+        if (peers == NULL) {
+            perror("Failed to grow DM set");
+            exit(EXIT_FAILURE);
         }
-        current = current->next;
+        set->peers = peers;
+        set->capacity = capacity;
     }
+    memmove(&set->peers[i + 1], &set->peers[i], (set->count - i) * sizeof(struct dm_peer));
+    set->peers[i] = (struct dm_peer) { peer->id, peer };
+    set->count++;
+    return true;
+}
 
-    // Add user2 to user1's DM connections
-    struct user_node *new_link1 = (struct user_node*) malloc(sizeof(struct user_node));
-    if (new_link1 == NULL) {
-        perror("Memory allocation failed for DM connection");
-        exit(EXIT_FAILURE);
+static void dmErase(struct dm_set *set, uint32_t id) {
+    uint32_t i = dmSearch(set, id);
+    if (i < set->count && set->peers[i].id == id) {
+        memmove(&set->peers[i], &set->peers[i + 1], (set->count - i - 1) * sizeof(struct dm_peer));
+        set->count--;
     }
-    strcpy(new_link1->username, u2->username);
-    new_link1->socket = u2->socket;
-    new_link1->dm_connections = NULL;
-    new_link1->next = u1->dm_connections;
-    u1->dm_connections = new_link1;
+}
 
-    // Add user1 to user2's DM connections
-    struct user_node *new_link2 = (struct user_node*) malloc(sizeof(struct user_node));
-    if (new_link2 == NULL) {
-        perror("Memory allocation failed for DM connection");
-        exit(EXIT_FAILURE);
+// Connect two users for direct messaging
+bool connectUsersDM(struct user_node *head, char *user1, char *user2) {
+    struct user_node *u1 = findUser(head, user1);
+    struct user_node *u2 = findUser(head, user2);
+
+    if(u1 == NULL || u2 == NULL) {
+        return false;
     }
-    strcpy(new_link2->username, u1->username);
-    new_link2->socket = u1->socket;
-    new_link2->dm_connections = NULL;
-    new_link2->next = u2->dm_connections;
-    u2->dm_connections = new_link2;
 
+    // Already connected when user2 is in user1's set
+    if(!dmInsert(&u1->dms, u2)) {
+        return false;
+    }
+    dmInsert(&u2->dms, u1);
     return true;
 }
 
@@ -256,54 +369,24 @@ bool disconnectUsersDM(struct user_node *head, char *user1, char *user2) {
         return false;
     }
 
-    // Remove user2 from user1's DM connections
-    struct user_node *current = u1->dm_connections;
-    struct user_node *previous = NULL;
-    while(current != NULL && strcmp(current->username, user2) != 0) {
-        previous = current;
-        current = current->next;
-    }
-
-    if(current != NULL) {
-        if(previous == NULL) {
-            u1->dm_connections = current->next;
-        } else {
-            previous->next = current->next;
-        }
-        free(current);
-    }
-
-    // Remove user1 from user2's DM connections
-    current = u2->dm_connections;
-    previous = NULL;
-    while(current != NULL && strcmp(current->username, user1) != 0) {
-        previous = current;
-        current = current->next;
-    }
-
-    if(current != NULL) {
-        if(previous == NULL) {
-            u2->dm_connections = current->next;
-        } else {
-            previous->next = current->next;
-        }
-        free(current);
-    }
-
+    dmErase(&u1->dms, u2->id);
+    dmErase(&u2->dms, u1->id);
     return true;
 }
 
 // Check if two users are connected via direct messaging
 bool isConnectedDM(struct user_node *head, char *user1, char *user2) {
     struct user_node *u1 = findUser(head, user1);
-    if(u1 == NULL) return false;
+    struct user_node *u2 = findUser(head, user2);
+    if(u1 == NULL || u2 == NULL) return false;
 
-    struct user_node *current = u1->dm_connections;
-    while(current != NULL) {
-        if(strcmp(current->username, user2) == 0) {
-            return true;
-        }
-        current = current->next;
+    return dmContains(&u1->dms, u2->id);
+}
+
+void dropUserDMs(struct user_node *user) {
+    for(uint32_t i = 0; i < user->dms.count; i++) {
+        dmErase(&user->dms.peers[i].user->dms, user->id);
     }
-    return false;
+    free(user->dms.peers);
+    user->dms = (struct dm_set) { 0 };
 }
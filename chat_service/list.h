@@ -4,41 +4,105 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include "chat_lock.h"
+#include "pool.h"
+#include "history.h"
+#include "ratelimit.h"
+#include "intern.h"
+
+// The user index is split into independently locked shards
+#define USER_SHARDS 16
+
+struct room_node;
+
+// One user's membership of one room. It sits on both the user's joined set
+// and the room's member list, and points at the single registry user_node,
+// so a rename never has to touch room membership.
+struct room_link {
+    struct room_node *room;
+    struct user_node *user;
+    struct room_link *next;        // Next room joined by the same user
+    struct room_link *next_member; // Neighbours in the room's member list
+    struct room_link *prev_member;
+};
+
+// One end of a DM edge: the peer's id (the sort key) and its registry node
+struct dm_peer {
+    uint32_t id;
+    struct user_node *user;
+};
+
+// A user's DM peers, sorted by id. Edges are symmetric: every peer lists
+// this user back, so dropping a user only visits its own peers.
+struct dm_set {
+    struct dm_peer *peers;
+    uint32_t count;
+    uint32_t capacity;
+};
 
 // Node representing a user in the system
 struct user_node {
-    char username[30];
+    uint32_t name;          // Interned; a rename swaps this one field
+    uint32_t id;            // Unique for the life of the process, never reused
     int socket;
     struct user_node *next;
-    struct user_node *dm_connections; // Direct message connections
+    struct user_node *prev; // Only maintained on the user registry list
+    struct dm_set dms;      // Direct message connections
+    struct room_link *rooms_joined; // Memberships of this user
 };
 
 // Node representing a room in the system
 struct room_node {
-    char roomname[30];
+    uint32_t name;             // Interned; rooms are never renamed, so it doubles as the room's id
     struct room_node *next;
-    struct user_node *users; // List of users in the room
+    struct room_node *prev;
+    struct room_link *members; // Memberships of users in the room
+    struct chat_lock lock;     // Guards members
+    struct room_history history; // Recent messages, replayed on join
+    struct token_bucket limit;   // Broadcasts fanned out to the room
 };
 
+// FNV-1a over a name, shared by the intern tables and the shard routing
+uint32_t hashName(const char *name);
+
+// The user and room lists are process-wide registries: every node added with
+// addUser/addRoom is bound to its interned name (see intern.h), so
+// findUser/findRoom and the removals are O(1) regardless of list length.
+// The list heads are still returned so callers can iterate them as before.
+// User bindings are guarded by USER_SHARDS locks; userShard() names the one
+// covering a username, truncated to NAME_LEN like every registry lookup.
+int userShard(const char *username);
+
 // User management functions
 struct user_node* addUser(struct user_node *head, int socket, char *username);
 struct user_node* findUser(struct user_node *head, char* username);
 struct user_node* removeUser(struct user_node *head, char *username);
 void displayUsers(struct user_node *head);
+bool renameUser(struct user_node *head, char *oldname, char *newname);
 
 // Room management functions
 struct room_node* addRoom(struct room_node *head, char *roomname);
 struct room_node* findRoom(struct room_node *head, char* roomname);
 struct room_node* removeRoom(struct room_node *head, char *roomname);
-void listAllRooms(struct room_node *head, char *buffer);
+// The list functions append one name per line to the string in buffer,
+// stopping before a name that would not fit in size bytes
+void listAllUsers(struct user_node *head, char *buffer, size_t size);
+void listAllRooms(struct room_node *head, char *buffer, size_t size);
+// Membership changes take the registry user_node and keep its rooms_joined
+// set in step with the room's user list
 void addUserToRoom(struct room_node *room, struct user_node *user);
-void removeUserFromRoom(struct room_node *room, char *username);
-void listUsersInRoom(struct room_node *room, char *buffer);
+void removeUserFromRoom(struct room_node *room, struct user_node *user);
+bool isUserInRoom(struct room_node *room, struct user_node *user);
+void listUsersInRoom(struct room_node *room, char *buffer, size_t size);
 
 // Direct message (DM) management functions
 bool connectUsersDM(struct user_node *head, char *user1, char *user2);
 bool disconnectUsersDM(struct user_node *head, char *user1, char *user2);
 bool isConnectedDM(struct user_node *head, char *user1, char *user2);
 
+// Remove every DM edge of user, on both ends
+void dropUserDMs(struct user_node *user);
+
 #endif // LINKED_LIST_H
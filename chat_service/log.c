@@ -0,0 +1,239 @@
+#include "log.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_RING_MASK (LOG_RING_SLOTS - 1)
+
+struct log_record {
+    uint64_t time_ns;         // CLOCK_REALTIME
+    uint8_t level;
+    uint16_t len;
+    char text[LOG_LINE_MAX];
+};
+
+// Single-producer (the owning thread), single-consumer (whoever holds
+// rings_mutex) ring. head and tail only grow; slots are indexed by mask.
+struct log_ring {
+    _Atomic uint64_t head;    // Next record to write out
+    _Atomic uint64_t tail;    // Next slot the owner fills
+    atomic_bool dead;         // Owner exited; free once drained
+    unsigned sampled;         // Owner only: records seen for sampling
+    struct log_ring *next;
+    struct log_record slots[LOG_RING_SLOTS];
+};
+
+enum log_level log_min_level = CHAT_LOG_INFO;
+static unsigned log_sample_every = 1;
+static int log_fd = STDOUT_FILENO;
+
+// Guards the ring list and serializes draining
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *rings = NULL;
+
+static __thread struct log_ring *local;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static const char *const level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+bool parse_log_level(const char *name, enum log_level *level) {
+    if (strcmp(name, "debug") == 0) {
+        *level = CHAT_LOG_DEBUG;
+    } else if (strcmp(name, "info") == 0) {
+        *level = CHAT_LOG_INFO;
+    } else if (strcmp(name, "warn") == 0) {
+        *level = CHAT_LOG_WARN;
+    } else if (strcmp(name, "error") == 0) {
+        *level = CHAT_LOG_ERROR;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// The writer frees an exited thread's ring after draining it
+static void ring_retire(void *ptr) {
+    struct log_ring *ring = ptr;
+    local = NULL;
+    atomic_store_explicit(&ring->dead, true, memory_order_release);
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, ring_retire);
+}
+
+static struct log_ring *local_ring(void) {
+    if (local != NULL) {
+        return local;
+    }
+
+    struct log_ring *ring = malloc(sizeof(struct log_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dead, false);
+    ring->sampled = 0;
+    pthread_once(&ring_key_once, ring_key_create);
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+
+    local = ring;
+    return ring;
+}
+
+void chat_log_write(enum log_level level, const char *fmt, ...) {
+    struct log_ring *ring = local_ring();
+    struct timespec ts;
+    va_list ap;
+
+    if (ring == NULL) {
+        stats_add(STAT_LOG_DROPPED, 1);
+        return;
+    }
+    if (level < CHAT_LOG_WARN && log_sample_every > 1 && ring->sampled++ % log_sample_every != 0) {
+        return;
+    }
+
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == LOG_RING_SLOTS) {
+        stats_add(STAT_LOG_DROPPED, 1);
+        return;
+    }
+
+    struct log_record *rec = &ring->slots[tail & LOG_RING_MASK];
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->level = level;
+    va_start(ap, fmt);
+    int n = vsnprintf(rec->text, LOG_LINE_MAX, fmt, ap);
+    va_end(ap);
+    rec->len = n < 0 ? 0 : (n >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : n);
+
+    // Publish the filled slot to the writer
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static void write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return; // Nowhere left to report it
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// Move every pending record into batch, writing it out whenever it fills.
+// Caller holds rings_mutex. Returns the number of records written.
+static size_t drain_rings(char *batch) {
+    size_t len = 0, count = 0;
+    time_t cached_sec = -1;
+    char stamp[32] = "";
+
+    struct log_ring **link = &rings;
+    while (*link != NULL) {
+        struct log_ring *ring = *link;
+        // Read dead before tail so a ring is never freed with records left
+        bool dead = atomic_load_explicit(&ring->dead, memory_order_acquire);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        for (; head < tail; head++) {
+            struct log_record *rec = &ring->slots[head & LOG_RING_MASK];
+            time_t sec = rec->time_ns / 1000000000ULL;
+            if (sec != cached_sec) {
+                struct tm tm;
+                localtime_r(&sec, &tm);
+                strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+                cached_sec = sec;
+            }
+
+            if (len + rec->len + 64 > LOG_BATCH_SIZE) {
+                write_all(batch, len);
+                len = 0;
+            }
+            len += snprintf(batch + len, LOG_BATCH_SIZE - len, "%s.%03u %s %.*s\n", stamp,
+                            (unsigned) (rec->time_ns / 1000000 % 1000), level_names[rec->level],
+                            (int) rec->len, rec->text);
+            count++;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        if (dead) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+
+    if (len > 0) {
+        write_all(batch, len);
+    }
+    return count;
+}
+
+static void *log_writer(void *arg) {
+    char *batch = arg;
+    struct timespec idle = { 0, LOG_IDLE_MS * 1000000L };
+
+    while (1) {
+        pthread_mutex_lock(&rings_mutex);
+        size_t written = drain_rings(batch);
+        pthread_mutex_unlock(&rings_mutex);
+        if (written == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+int log_init(const char *path, enum log_level level, unsigned sample_every) {
+    pthread_t thread;
+
+    log_min_level = level;
+    log_sample_every = sample_every > 0 ? sample_every : 1;
+    if (path != NULL) {
+        log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log_fd == -1) {
+            perror("Failed to open log file");
+            return -1;
+        }
+    }
+
+    char *batch = malloc(LOG_BATCH_SIZE);
+    if (batch == NULL || pthread_create(&thread, NULL, log_writer, batch) != 0) {
+        perror("Failed to start log writer");
+        free(batch);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+void log_flush(void) {
+    static char batch[LOG_BATCH_SIZE]; // Only used under rings_mutex
+
+    pthread_mutex_lock(&rings_mutex);
+    drain_rings(batch);
+    pthread_mutex_unlock(&rings_mutex);
+}
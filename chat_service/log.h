@@ -0,0 +1,44 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Asynchronous logging. chat_log() formats into the calling thread's own
+// ring with no locks and no system calls; a background writer drains every
+// ring and hands the records to the log file in batched write() calls. A
+// full ring drops the record (counted in stats) rather than stall the caller.
+#define LOG_RING_SLOTS 128    // Records per thread; a power of two
+#define LOG_LINE_MAX 232      // Longest message text kept per record
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_IDLE_MS 10        // Writer sleep when every ring is empty
+
+enum log_level {
+    CHAT_LOG_DEBUG,
+    CHAT_LOG_INFO,
+    CHAT_LOG_WARN,
+    CHAT_LOG_ERROR
+};
+
+extern enum log_level log_min_level;
+
+// Records below log_min_level cost one comparison; arguments aren't evaluated
+#define chat_log(level, ...) \
+    do { \
+        if ((level) >= log_min_level) { \
+            chat_log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+void chat_log_write(enum log_level level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Start the writer. path NULL logs to stdout. Debug and info records are
+// sampled one in sample_every per thread; warnings and errors always pass.
+int log_init(const char *path, enum log_level level, unsigned sample_every);
+
+// Write out everything logged so far, from the calling thread
+void log_flush(void);
+
+bool parse_log_level(const char *name, enum log_level *level);
+
+#endif // LOG_H
@@ -0,0 +1,148 @@
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Freed objects store the free-list link in their first bytes
+struct free_obj {
+    struct free_obj *next;
+};
+
+struct pool_cache {
+    struct free_obj *head;
+    int count;
+};
+
+static struct pool *pools[POOL_MAX_POOLS];
+static atomic_int num_pools;
+
+static __thread struct pool_cache caches[POOL_MAX_POOLS];
+static __thread int cache_registered;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+// Move up to count objects from the shared free list into the cache,
+// carving a new slab when it runs dry; caller holds the pool lock
+static void refill(struct pool *pool, struct pool_cache *cache, int count) {
+    if (pool->free_list == NULL) {
+        // Each slab starts with a pointer chaining it to the previous one
+        size_t obj_size = pool->obj_size < sizeof(struct free_obj) ? sizeof(struct free_obj) : pool->obj_size;
+        obj_size = (obj_size + 15) & ~(size_t) 15;
+        char *slab = malloc(16 + obj_size * POOL_SLAB_OBJS);
+        if (slab == NULL) {
+            perror("Memory allocation failed for pool slab");
+            exit(EXIT_FAILURE);
+        }
+        *(void **) slab = pool->slabs;
+        pool->slabs = slab;
+        atomic_fetch_add(&pool->slab_count, 1);
+
+        for (int i = POOL_SLAB_OBJS - 1; i >= 0; i--) {
+            struct free_obj *obj = (struct free_obj *) (slab + 16 + i * obj_size);
+            obj->next = pool->free_list;
+            pool->free_list = obj;
+        }
+    }
+
+    while (count-- > 0 && pool->free_list != NULL) {
+        struct free_obj *obj = pool->free_list;
+        pool->free_list = obj->next;
+        obj->next = cache->head;
+        cache->head = obj;
+        cache->count++;
+    }
+}
+
+// Hand count cached objects back to the shared free list
+static void spill(struct pool *pool, struct pool_cache *cache, int count) {
+    pthread_mutex_lock(&pool->lock);
+    while (count-- > 0 && cache->head != NULL) {
+        struct free_obj *obj = cache->head;
+        cache->head = obj->next;
+        cache->count--;
+        obj->next = pool->free_list;
+        pool->free_list = obj;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// A dying thread (thread mode has one per client) returns its caches
+static void release_caches(void *unused) {
+    int n = atomic_load(&num_pools);
+    for (int i = 0; i < n; i++) {
+        spill(pools[i], &caches[i], caches[i].count);
+    }
+}
+
+static void make_cache_key(void) {
+    pthread_key_create(&cache_key, release_caches);
+}
+
+static struct pool_cache *cache_for(struct pool *pool) {
+    if (pool->id < 0) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->id < 0) {
+            int id = atomic_fetch_add(&num_pools, 1);
+            if (id >= POOL_MAX_POOLS) {
+                fprintf(stderr, "Too many object pools\n");
+                exit(EXIT_FAILURE);
+            }
+            pools[id] = pool;
+            pool->id = id;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (!cache_registered) {
+        pthread_once(&cache_key_once, make_cache_key);
+        pthread_setspecific(cache_key, caches);
+        cache_registered = 1;
+    }
+    return &caches[pool->id];
+}
+
+void *pool_alloc(struct pool *pool) {
+    struct pool_cache *cache = cache_for(pool);
+
+    if (cache->head == NULL) {
+        pthread_mutex_lock(&pool->lock);
+        refill(pool, cache, POOL_BATCH);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    struct free_obj *obj = cache->head;
+    cache->head = obj->next;
+    cache->count--;
+    atomic_fetch_add_explicit(&pool->live, 1, memory_order_relaxed);
+    return obj;
+}
+
+void pool_free(struct pool *pool, void *ptr) {
+    struct pool_cache *cache = cache_for(pool);
+    struct free_obj *obj = ptr;
+
+    obj->next = cache->head;
+    cache->head = obj;
+    cache->count++;
+    atomic_fetch_sub_explicit(&pool->live, 1, memory_order_relaxed);
+
+    if (cache->count > POOL_CACHE_MAX) {
+        spill(pool, cache, POOL_BATCH);
+    }
+}
+
+void pool_metrics(char *buffer, size_t size) {
+    size_t len = strlen(buffer);
+    int n = atomic_load(&num_pools);
+
+    for (int i = 0; i < n && len < size; i++) {
+        int w = snprintf(buffer + len, size - len, "chat_pool_live{pool=\"%s\"} %ld\nchat_pool_slabs{pool=\"%s\"} %lu\n",
+                         pools[i]->name, atomic_load(&pools[i]->live),
+                         pools[i]->name, atomic_load(&pools[i]->slab_count));
+        if (w < 0 || (size_t) w >= size - len) {
+            buffer[len] = '\0';
+            break;
+        }
+        len += w;
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Fixed-size object pool. Objects are carved out of POOL_SLAB_OBJS-object
+// slabs that are never returned to malloc; freed objects go to a small
+// per-thread cache first and spill back to the shared free list in batches,
+// so connect/disconnect storms rarely touch the pool lock.
+#define POOL_SLAB_OBJS 256
+#define POOL_CACHE_MAX 64   // Objects a thread keeps before spilling
+#define POOL_BATCH 32       // Objects moved per refill or spill
+#define POOL_MAX_POOLS 8
+
+struct pool {
+    const char *name;
+    size_t obj_size;
+    atomic_int id;          // Index of this pool's per-thread cache, -1 until first use
+    pthread_mutex_t lock;   // Guards free_list and slabs
+    void *free_list;
+    void *slabs;
+    atomic_ulong slab_count;
+    atomic_long live;       // Objects handed out and not yet freed
+};
+
+#define POOL_INITIALIZER(name, size) \
+    { (name), (size), -1, PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 0 }
+
+void *pool_alloc(struct pool *pool);
+void pool_free(struct pool *pool, void *obj);
+
+// Append live objects and slabs of every pool in use, as labelled metrics
+// lines for the stats report
+void pool_metrics(char *buffer, size_t size);
+
+#endif // POOL_H
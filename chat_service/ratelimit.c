@@ -0,0 +1,68 @@
+#include "ratelimit.h"
+#include <stdlib.h>
+#include <time.h>
+
+struct rate_limit conn_rate;
+struct rate_limit room_rate;
+
+void token_bucket_init(struct token_bucket *bucket) {
+    atomic_init(&bucket->tat, 0);
+}
+
+bool rate_allow(const struct rate_limit *limit, struct token_bucket *bucket, uint64_t now_ns) {
+    if (limit->interval_ns == 0) {
+        return true;
+    }
+
+    uint64_t tat = atomic_load_explicit(&bucket->tat, memory_order_relaxed);
+    while (1) {
+        uint64_t start = tat > now_ns ? tat : now_ns;
+        if (start - now_ns > limit->tolerance_ns) {
+            return false;
+        }
+        if (atomic_compare_exchange_weak_explicit(&bucket->tat, &tat, start + limit->interval_ns,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+bool parse_rate_limit(const char *arg, struct rate_limit *limit) {
+    char *end;
+    double rate = strtod(arg, &end);
+    long burst = 1;
+
+    if (end == arg || rate < 0) {
+        return false;
+    }
+    if (*end == ':') {
+        burst = strtol(end + 1, &end, 10);
+        if (burst < 1) {
+            return false;
+        }
+    }
+    if (*end != '\0') {
+        return false;
+    }
+
+    if (rate == 0) {
+        limit->interval_ns = 0;
+        limit->tolerance_ns = 0;
+        return true;
+    }
+    limit->interval_ns = (uint64_t) (1e9 / rate);
+    if (limit->interval_ns == 0) {
+        limit->interval_ns = 1;
+    }
+    // The request that finds tat exactly tolerance ahead is still allowed,
+    // so burst back-to-back requests pass from a full bucket
+    limit->tolerance_ns = (burst - 1) * limit->interval_ns;
+    return true;
+}
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,33 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Token buckets kept as a single timestamp (the generic cell rate
+// algorithm): tat is when the bucket would be full again. A request is
+// allowed while tat lies less than burst * interval ahead of now, and
+// pushes tat one interval further. One compare-and-swap per check, no lock.
+struct token_bucket {
+    _Atomic uint64_t tat; // Nanoseconds, CLOCK_MONOTONIC
+};
+
+// Rate shared by every bucket of one kind; interval_ns 0 means unlimited
+struct rate_limit {
+    uint64_t interval_ns;
+    uint64_t tolerance_ns;
+};
+
+extern struct rate_limit conn_rate; // Commands and messages per connection
+extern struct rate_limit room_rate; // Broadcasts fanned out per room
+
+void token_bucket_init(struct token_bucket *bucket);
+bool rate_allow(const struct rate_limit *limit, struct token_bucket *bucket, uint64_t now_ns);
+
+// Parse "rate[:burst]" (per second) into limit; rate 0 disables it
+bool parse_rate_limit(const char *arg, struct rate_limit *limit);
+
+uint64_t monotonic_ns(void);
+
+#endif // RATELIMIT_H
@@ -0,0 +1,715 @@
+#include "server.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define SEND_QUEUE_MASK (SEND_QUEUE_ENTRIES - 1)
+
+// Queued slice [offset, offset + len) of a shared message
+struct send_entry {
+    struct chat_msg *msg;
+    size_t offset;
+    size_t len;
+};
+
+// Per-socket ring of pending messages; head is the next to send and
+// head_offset counts the bytes of it already written
+struct send_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t drained; // Signalled whenever a flush frees space
+    int socket;
+    bool active;
+    bool corked;
+    atomic_bool framed; // Read without the lock by broadcasters
+    unsigned generation; // Bumped when the queue is reopened or discarded
+    unsigned inflight;   // Head entries an asynchronous write points into
+    struct send_entry ring[SEND_QUEUE_ENTRIES];
+    unsigned head, tail;
+    size_t head_offset;
+    size_t bytes;
+};
+
+static enum slow_policy queue_policy = SLOW_DROP_OLDEST;
+static size_t queue_max_bytes = SEND_QUEUE_DEFAULT_BYTES;
+
+// Indexed by socket descriptor; slots are created on first use and reused
+static _Atomic(struct send_queue *) *queues;
+static int max_queues;
+
+static int writer_epfd = -1;
+
+// Set on io_uring loop threads; see send_queue_defer
+static __thread void (*defer_hook)(int socket);
+
+// Set on every event loop thread; see send_queue_never_wait
+static __thread bool never_wait;
+
+// A push held back by a batch until the sender's locks are released
+struct held_push {
+    int socket;
+    unsigned generation; // Of the queue when it was held back
+    struct chat_msg *msg;
+    size_t offset, len;
+};
+
+static __thread int batch_depth;
+static __thread struct held_push *held;
+static __thread int held_count, held_cap;
+
+static atomic_ulong queued_bytes;     // Bytes waiting in every queue
+static atomic_ulong dropped_messages; // Discarded by the drop-oldest policy or a dead socket
+static atomic_ulong slow_disconnects; // Clients shut down for not keeping up
+static atomic_ulong backpressure_waits;
+
+struct chat_msg *chat_msg_new(const void *data, size_t len) {
+    struct chat_msg *msg = malloc(sizeof(struct chat_msg) + len);
+    if (msg == NULL) {
+        perror("Failed to allocate outbound message");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&msg->refs, 1);
+    msg->len = len;
+    if (data != NULL) {
+        memcpy(msg->data, data, len);
+    }
+    return msg;
+}
+
+// Format straight into the message body, sized to fit
+struct chat_msg *chat_msg_printf(const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    struct chat_msg *msg = malloc(sizeof(struct chat_msg) + len + 1);
+    if (msg == NULL) {
+        perror("Failed to allocate outbound message");
+        exit(EXIT_FAILURE);
+    }
+    va_start(args, fmt);
+    vsnprintf(msg->data, len + 1, fmt, args);
+    va_end(args);
+    atomic_init(&msg->refs, 1);
+    msg->len = len;
+    return msg;
+}
+
+void chat_msg_hold(struct chat_msg *msg) {
+    atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+}
+
+void chat_msg_release(struct chat_msg *msg) {
+    if (atomic_fetch_sub_explicit(&msg->refs, 1, memory_order_acq_rel) == 1) {
+        free(msg);
+    }
+}
+
+bool parse_slow_policy(const char *name, enum slow_policy *policy) {
+    if (strcmp(name, "drop-oldest") == 0) {
+        *policy = SLOW_DROP_OLDEST;
+    } else if (strcmp(name, "disconnect") == 0) {
+        *policy = SLOW_DISCONNECT;
+    } else if (strcmp(name, "backpressure") == 0) {
+        *policy = SLOW_BACKPRESSURE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void send_queue_init(enum slow_policy policy, size_t max_bytes) {
+    struct rlimit rl;
+
+    queue_policy = policy;
+    queue_max_bytes = max_bytes;
+
+    // One slot per possible descriptor
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < (1 << 22)) {
+        max_queues = (int) rl.rlim_cur;
+    } else {
+        max_queues = 1 << 22;
+    }
+    queues = calloc(max_queues, sizeof(*queues));
+    if (queues == NULL) {
+        perror("Failed to allocate send queues");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static struct send_queue *queue_for(int socket) {
+    if (socket < 0 || socket >= max_queues) {
+        return NULL;
+    }
+    return atomic_load_explicit(&queues[socket], memory_order_acquire);
+}
+
+void send_queue_open(int socket) {
+    struct send_queue *q = queue_for(socket);
+
+    if (socket < 0 || socket >= max_queues) {
+        return;
+    }
+    if (q == NULL) {
+        q = calloc(1, sizeof(struct send_queue));
+        if (q == NULL) {
+            perror("Failed to allocate send queue");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->drained, NULL);
+        // Descriptors are unique while open, so nobody races us for this slot
+        atomic_store_explicit(&queues[socket], q, memory_order_release);
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->socket = socket;
+    q->head = q->tail = 0;
+    q->head_offset = 0;
+    q->bytes = 0;
+    q->active = true;
+    q->corked = false;
+    q->generation++;
+    q->inflight = 0;
+    atomic_store(&q->framed, false);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Release the oldest entry; caller holds the lock
+static void pop_entry(struct send_queue *q) {
+    struct send_entry *e = &q->ring[q->head & SEND_QUEUE_MASK];
+    size_t unsent = e->len - q->head_offset;
+
+    q->bytes -= unsent;
+    atomic_fetch_sub_explicit(&queued_bytes, unsent, memory_order_relaxed);
+    chat_msg_release(e->msg);
+    e->msg = NULL;
+    q->head++;
+    q->head_offset = 0;
+}
+
+static void discard_all(struct send_queue *q) {
+    // A write still in flight keeps its own references and finds the
+    // generation changed when it completes
+    q->generation++;
+    q->inflight = 0;
+    while (q->head != q->tail) {
+        pop_entry(q);
+        atomic_fetch_add_explicit(&dropped_messages, 1, memory_order_relaxed);
+    }
+    pthread_cond_broadcast(&q->drained);
+}
+
+void send_queue_close(int socket) {
+    struct send_queue *q = queue_for(socket);
+    if (q == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->active = false;
+    discard_all(q);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Drop written bytes from the head of the queue
+static void consume(struct send_queue *q, size_t written) {
+    stats_add(STAT_BYTES_OUT, written);
+    while (written > 0) {
+        struct send_entry *e = &q->ring[q->head & SEND_QUEUE_MASK];
+        size_t unsent = e->len - q->head_offset;
+        if (written < unsent) {
+            q->head_offset += written;
+            q->bytes -= written;
+            atomic_fetch_sub_explicit(&queued_bytes, written, memory_order_relaxed);
+            written = 0;
+        } else {
+            written -= unsent;
+            pop_entry(q);
+        }
+    }
+    pthread_cond_broadcast(&q->drained);
+}
+
+// Write as much of the queue as the socket takes without blocking.
+// Returns -1 after a hard socket error, when the queue is deactivated.
+static int flush_locked(struct send_queue *q) {
+    // An asynchronous write owns the head; its completion sends the rest
+    if (q->inflight) {
+        return 0;
+    }
+    while (q->head != q->tail) {
+        struct iovec iov[SEND_IOV_MAX];
+        int n = 0;
+
+        for (unsigned i = q->head; i != q->tail && n < SEND_IOV_MAX; i++, n++) {
+            struct send_entry *e = &q->ring[i & SEND_QUEUE_MASK];
+            size_t offset = (i == q->head) ? q->head_offset : 0;
+            iov[n].iov_base = e->msg->data + e->offset + offset;
+            iov[n].iov_len = e->len - offset;
+        }
+
+        // sendmsg() is writev() with flags: MSG_DONTWAIT also covers the
+        // blocking sockets used in thread mode
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t written = sendmsg(q->socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            q->active = false;
+            discard_all(q);
+            return -1;
+        }
+
+        consume(q, written);
+    }
+    return 0;
+}
+
+int send_queue_flush(int socket) {
+    struct send_queue *q = queue_for(socket);
+    int status;
+
+    if (q == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&q->lock);
+    status = q->active ? flush_locked(q) : 0;
+    pthread_mutex_unlock(&q->lock);
+    return status;
+}
+
+void send_queue_cork(int socket) {
+    struct send_queue *q = queue_for(socket);
+    if (q != NULL) {
+        pthread_mutex_lock(&q->lock);
+        q->corked = true;
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+void send_queue_uncork(int socket) {
+    struct send_queue *q = queue_for(socket);
+    if (q != NULL) {
+        pthread_mutex_lock(&q->lock);
+        q->corked = false;
+        bool pending = q->active && q->head != q->tail;
+        if (pending && defer_hook == NULL) {
+            flush_locked(q);
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (pending && defer_hook != NULL) {
+            defer_hook(socket);
+        }
+    }
+}
+
+void send_queue_defer(void (*hook)(int socket)) {
+    defer_hook = hook;
+}
+
+bool send_queue_begin_async(int socket, struct send_async *op) {
+    struct send_queue *q = queue_for(socket);
+    if (q == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->active || q->inflight || q->head == q->tail) {
+        pthread_mutex_unlock(&q->lock);
+        return false;
+    }
+    int n = 0;
+    for (unsigned i = q->head; i != q->tail && n < SEND_IOV_MAX; i++, n++) {
+        struct send_entry *e = &q->ring[i & SEND_QUEUE_MASK];
+        size_t offset = (i == q->head) ? q->head_offset : 0;
+        chat_msg_hold(e->msg);
+        op->msgs[n] = e->msg;
+        op->iov[n].iov_base = e->msg->data + e->offset + offset;
+        op->iov[n].iov_len = e->len - offset;
+    }
+    q->inflight = n;
+    op->socket = socket;
+    op->generation = q->generation;
+    op->count = n;
+    op->hdr = (struct msghdr) { .msg_iov = op->iov, .msg_iovlen = n };
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+bool send_queue_end_async(struct send_async *op, int result) {
+    struct send_queue *q = queue_for(op->socket);
+    bool more = false;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->generation == op->generation) {
+        q->inflight = 0;
+        if (result >= 0) {
+            consume(q, result);
+        } else if (result != -EAGAIN && result != -EINTR) {
+            q->active = false;
+            discard_all(q);
+        }
+        // A write that made no progress waits for the socket to drain
+        more = result > 0 && q->active && q->head != q->tail;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    for (int i = 0; i < op->count; i++) {
+        chat_msg_release(op->msgs[i]);
+    }
+    return more;
+}
+
+void send_queue_set_framed(int socket, bool framed) {
+    struct send_queue *q = queue_for(socket);
+    if (q != NULL) {
+        atomic_store(&q->framed, framed);
+    }
+}
+
+bool send_queue_framed(int socket) {
+    struct send_queue *q = queue_for(socket);
+    return q != NULL && atomic_load(&q->framed);
+}
+
+static bool queue_full(struct send_queue *q, size_t len) {
+    return q->tail - q->head == SEND_QUEUE_ENTRIES || (q->bytes > 0 && q->bytes + len > queue_max_bytes);
+}
+
+// Apply the slow-consumer policy until len more bytes fit.
+// Returns false when the message has to be dropped.
+static bool make_room(struct send_queue *q, size_t len) {
+    struct timespec deadline;
+    unsigned keep;
+
+    switch (queue_policy) {
+    case SLOW_DROP_OLDEST:
+        // A partly written head entry has to finish or the stream would
+        // tear, and entries an asynchronous write points into must stay
+        keep = q->inflight ? q->inflight : (q->head_offset ? 1u : 0u);
+        while (queue_full(q, len) && q->tail - q->head > keep) {
+            if (keep) {
+                // Keep the protected head entries and drop the one behind them
+                unsigned victim = q->head + keep;
+                struct send_entry *e = &q->ring[victim & SEND_QUEUE_MASK];
+                q->bytes -= e->len;
+                atomic_fetch_sub_explicit(&queued_bytes, e->len, memory_order_relaxed);
+                chat_msg_release(e->msg);
+                for (unsigned i = victim; i + 1 != q->tail; i++) {
+                    q->ring[i & SEND_QUEUE_MASK] = q->ring[(i + 1) & SEND_QUEUE_MASK];
+                }
+                q->tail--;
+            } else {
+                pop_entry(q);
+            }
+            atomic_fetch_add_explicit(&dropped_messages, 1, memory_order_relaxed);
+        }
+        return !queue_full(q, len);
+
+    case SLOW_BACKPRESSURE:
+        if (never_wait) {
+            goto disconnect;
+        }
+        atomic_fetch_add_explicit(&backpressure_waits, 1, memory_order_relaxed);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SEND_TIMEOUT_MS / 1000;
+        deadline.tv_nsec += (SEND_TIMEOUT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (q->active && queue_full(q, len)) {
+            if (pthread_cond_timedwait(&q->drained, &q->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        if (q->active && !queue_full(q, len)) {
+            return true;
+        }
+        if (!q->active) {
+            return false;
+        }
+        // Waited long enough: treat it like the disconnect policy
+        /* fall through */
+
+    case SLOW_DISCONNECT:
+    disconnect:
+        atomic_fetch_add_explicit(&slow_disconnects, 1, memory_order_relaxed);
+        q->active = false;
+        discard_all(q);
+        // The owner sees EOF and runs the usual disconnect path
+        shutdown(q->socket, SHUT_RDWR);
+        return false;
+    }
+    return false;
+}
+
+static bool is_held(int socket) {
+    for (int i = 0; i < held_count; i++) {
+        if (held[i].socket == socket) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Set a push aside for send_queue_batch_end. Caller holds q->lock.
+static void hold_push(struct send_queue *q, const char *data, size_t len, struct chat_msg *shared) {
+    if (held_count == held_cap) {
+        int cap = held_cap ? held_cap * 2 : 16;
+        struct held_push *grown = realloc(held, cap * sizeof(struct held_push));
+        if (grown == NULL) {
+            perror("Failed to hold back outbound message");
+            exit(EXIT_FAILURE);
+        }
+        held = grown;
+        held_cap = cap;
+    }
+    struct held_push *h = &held[held_count++];
+    h->socket = q->socket;
+    h->generation = q->generation;
+    if (shared != NULL) {
+        chat_msg_hold(shared);
+        h->msg = shared;
+        h->offset = data - shared->data;
+    } else {
+        h->msg = chat_msg_new(data, len);
+        h->offset = 0;
+    }
+    h->len = len;
+}
+
+// Queue data for socket, writing straight away if nothing is ahead of it.
+// Unsent bytes are queued as a slice of shared when given, else copied.
+// With generation given, the data is dropped if the queue has been
+// reopened since. Returns -1 if the data was dropped.
+static int queue_push(int socket, const char *data, size_t len, struct chat_msg *shared,
+                      const unsigned *generation) {
+    struct send_queue *q = queue_for(socket);
+
+    if (q == NULL || len == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->active || (generation != NULL && *generation != q->generation)) {
+        atomic_fetch_add_explicit(&dropped_messages, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+
+    // A corked batch that outgrew the queue goes out before any policy applies
+    if (q->corked && queue_full(q, len) && flush_locked(q) < 0) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+
+    // A batch never waits for room, and keeps a socket's pushes in order
+    if (batch_depth > 0 && queue_policy == SLOW_BACKPRESSURE && !never_wait &&
+        (queue_full(q, len) || (held_count > 0 && is_held(socket)))) {
+        hold_push(q, data, len, shared);
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+
+    // Fast path: an idle socket usually takes the whole message at once
+    if (q->head == q->tail && !q->corked && defer_hook == NULL) {
+        ssize_t written = send(socket, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written > 0) {
+            stats_add(STAT_BYTES_OUT, written);
+            data += written;
+            len -= written;
+        } else if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            q->active = false;
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+        if (len == 0) {
+            pthread_mutex_unlock(&q->lock);
+            return 0;
+        }
+    }
+
+    if (queue_full(q, len) && !make_room(q, len)) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+
+    struct send_entry *e = &q->ring[q->tail & SEND_QUEUE_MASK];
+    if (shared != NULL) {
+        chat_msg_hold(shared);
+        e->msg = shared;
+        e->offset = data - shared->data;
+    } else {
+        e->msg = chat_msg_new(data, len);
+        e->offset = 0;
+    }
+    e->len = len;
+    q->tail++;
+    q->bytes += len;
+    atomic_fetch_add_explicit(&queued_bytes, len, memory_order_relaxed);
+
+    // Uncorked data is only ever queued behind a write that found the socket
+    // full, so an EPOLLOUT edge is on its way to whoever flushes this socket.
+    // A deferring thread writes it out itself at the end of its batch.
+    bool defer = !q->corked && defer_hook != NULL;
+    pthread_mutex_unlock(&q->lock);
+    if (defer) {
+        defer_hook(socket);
+    }
+    return 0;
+}
+
+int send_queue_push(int socket, const void *data, size_t len) {
+    return queue_push(socket, data, len, NULL, NULL);
+}
+
+// Queue a reference to msg; the caller keeps its own reference
+int send_queue_push_msg(int socket, struct chat_msg *msg) {
+    return queue_push(socket, msg->data, msg->len, msg, NULL);
+}
+
+void send_queue_never_wait(void) {
+    never_wait = true;
+}
+
+void send_queue_batch_begin(void) {
+    batch_depth++;
+}
+
+void send_queue_batch_end(void) {
+    if (--batch_depth > 0) {
+        return;
+    }
+    // No locks are held now, so these may wait for room
+    for (int i = 0; i < held_count; i++) {
+        struct held_push *h = &held[i];
+        queue_push(h->socket, h->msg->data + h->offset, h->len, h->msg, &h->generation);
+        chat_msg_release(h->msg);
+    }
+    held_count = 0;
+}
+
+size_t send_queue_drain(int timeout_ms) {
+    struct timespec start, now;
+    struct pollfd *pending = NULL;
+    size_t left = 0;
+    int cap = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (1) {
+        int n = 0;
+        left = 0;
+        for (int fd = 0; fd < max_queues; fd++) {
+            struct send_queue *q = queue_for(fd);
+            if (q == NULL) {
+                continue;
+            }
+            pthread_mutex_lock(&q->lock);
+            if (q->active) {
+                q->corked = false;
+                flush_locked(q);
+            }
+            size_t bytes = q->active ? q->bytes : 0;
+            pthread_mutex_unlock(&q->lock);
+            if (bytes == 0) {
+                continue;
+            }
+
+            left += bytes;
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                struct pollfd *grown = realloc(pending, cap * sizeof(struct pollfd));
+                if (grown == NULL) {
+                    free(pending);
+                    return left;
+                }
+                pending = grown;
+            }
+            pending[n].fd = fd;
+            pending[n].events = POLLOUT;
+            n++;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (n == 0 || elapsed_ms >= timeout_ms) {
+            break;
+        }
+        // Wake when any socket takes more, but rescan at least every 50ms
+        poll(pending, n, timeout_ms - elapsed_ms < 50 ? timeout_ms - elapsed_ms : 50);
+    }
+
+    free(pending);
+    return left;
+}
+
+static void *writer_run(void *ptr) {
+    struct epoll_event events[256];
+
+    while (1) {
+        int n = epoll_wait(writer_epfd, events, 256, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            chat_log(CHAT_LOG_ERROR, "Writer epoll_wait: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            send_queue_flush(events[i].data.fd);
+        }
+    }
+    return NULL;
+}
+
+void send_queue_start_writer(void) {
+    pthread_t writer;
+
+    writer_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (writer_epfd == -1) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    pthread_create(&writer, NULL, writer_run, NULL);
+    pthread_detach(writer);
+}
+
+// Edge-triggered EPOLLOUT fires each time a full socket buffer drains;
+// closing the socket drops it from the set
+void send_queue_watch(int socket) {
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLET;
+    ev.data.fd = socket;
+    if (epoll_ctl(writer_epfd, EPOLL_CTL_ADD, socket, &ev) == -1) {
+        chat_log(CHAT_LOG_ERROR, "Writer epoll_ctl: %s", strerror(errno));
+    }
+}
+
+void send_queue_report(char *buffer, size_t size) {
+    size_t len = strlen(buffer);
+    snprintf(buffer + len, size - len,
+             "queued_bytes %lu\nsent_bytes %lu\ndropped_messages %lu\nslow_disconnects %lu\nbackpressure_waits %lu\n",
+             atomic_load(&queued_bytes), (unsigned long) stats_total(STAT_BYTES_OUT), atomic_load(&dropped_messages),
+             atomic_load(&slow_disconnects), atomic_load(&backpressure_waits));
+}
+
+void send_queue_metrics(char *buffer, size_t size) {
+    size_t len = strlen(buffer);
+    snprintf(buffer + len, size - len,
+             "chat_send_queued_bytes %lu\nchat_send_dropped_messages_total %lu\n"
+             "chat_send_slow_disconnects_total %lu\nchat_send_backpressure_waits_total %lu\n",
+             atomic_load(&queued_bytes), atomic_load(&dropped_messages),
+             atomic_load(&slow_disconnects), atomic_load(&backpressure_waits));
+}
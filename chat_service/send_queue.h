@@ -0,0 +1,115 @@
+#ifndef SEND_QUEUE_H
+#define SEND_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Messages a single client may have waiting before the slow-consumer policy applies
+#define SEND_QUEUE_ENTRIES 256
+#define SEND_QUEUE_DEFAULT_BYTES (256 * 1024)
+
+// Largest batch handed to one sendmsg() call
+#define SEND_IOV_MAX 64
+
+// What to do when a client's outbound queue is full
+enum slow_policy {
+    SLOW_DROP_OLDEST,  // Discard the oldest unsent messages to make room
+    SLOW_DISCONNECT,   // Shut the client's socket down
+    SLOW_BACKPRESSURE  // Make the sender wait for room (up to SEND_TIMEOUT_MS), then disconnect;
+                       // loop threads never wait and disconnect at once
+};
+
+// Immutable, reference-counted message body. A broadcast builds one and
+// every recipient queue holds a reference instead of its own copy; the
+// last queue to finish writing it frees it.
+struct chat_msg {
+    atomic_int refs;
+    size_t len;
+    char data[];
+};
+
+// With data NULL the body is left for the caller to fill
+struct chat_msg *chat_msg_new(const void *data, size_t len);
+struct chat_msg *chat_msg_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void chat_msg_hold(struct chat_msg *msg);
+void chat_msg_release(struct chat_msg *msg);
+
+// Outbound bytes for every client socket are queued here and written out
+// with batched sendmsg() calls whenever the socket can take them, so a slow
+// client never blocks the thread producing messages for it. In epoll mode
+// each loop flushes its own sockets on EPOLLOUT; in thread mode a single
+// writer thread watches every client socket.
+void send_queue_init(enum slow_policy policy, size_t max_bytes);
+void send_queue_open(int socket);
+void send_queue_close(int socket);
+int send_queue_push(int socket, const void *data, size_t len);
+int send_queue_push_msg(int socket, struct chat_msg *msg);
+int send_queue_flush(int socket);
+
+// While corked, pushes skip the immediate send and only queue; uncorking
+// writes everything queued in one batch
+void send_queue_cork(int socket);
+void send_queue_uncork(int socket);
+
+// Whether the client on socket negotiated binary framing
+void send_queue_set_framed(int socket, bool framed);
+bool send_queue_framed(int socket);
+
+// Flush every queue until all are empty or timeout_ms passes. Returns the
+// bytes still queued.
+size_t send_queue_drain(int timeout_ms);
+
+// Thread mode: start the writer thread and hand it client sockets
+void send_queue_start_writer(void);
+void send_queue_watch(int socket);
+
+// io_uring front end. A thread that installs a defer hook never writes to
+// sockets itself: its pushes and uncorks only queue, then call hook(socket)
+// so the loop can batch the writes into one submission.
+void send_queue_defer(void (*hook)(int socket));
+
+// Called by event loop threads: they flush their own sockets, so waiting
+// for room under the backpressure policy could only time out
+void send_queue_never_wait(void);
+
+// Between these, a push that would have to wait for room under the
+// backpressure policy is held back, along with later pushes to the same
+// socket; the end waits for room and sends them. Fan-out done under
+// registry locks is wrapped in a batch that ends once they are released.
+void send_queue_batch_begin(void);
+void send_queue_batch_end(void);
+
+// One asynchronous sendmsg of the head of a queue. It holds its own
+// reference on every message it points into, so the bytes stay valid even
+// if the queue is discarded while the write is in flight.
+struct send_async {
+    int socket;
+    unsigned generation; // Of the queue when the write began
+    int count;
+    struct chat_msg *msgs[SEND_IOV_MAX];
+    struct iovec iov[SEND_IOV_MAX];
+    struct msghdr hdr;
+};
+
+// Fill op from the queue's head and mark those entries in flight. Returns
+// false when there is nothing to send or a write is already in flight;
+// only one is, per socket, so the stream stays in order.
+bool send_queue_begin_async(int socket, struct send_async *op);
+
+// Account for a finished write (bytes written, or -errno) and drop op's
+// references. Returns true when it made progress and more is queued
+// behind it; after a full socket, wait for it to become writable instead.
+bool send_queue_end_async(struct send_async *op, int result);
+
+// Append the global queue counters to buffer
+void send_queue_report(char *buffer, size_t size);
+
+// The same counters as metrics lines for the stats report
+void send_queue_metrics(char *buffer, size_t size);
+
+bool parse_slow_policy(const char *name, enum slow_policy *policy);
+
+#endif // SEND_QUEUE_H
@@ -1,72 +1,476 @@
+#define _GNU_SOURCE
 
 #include "server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
 
-int chat_serv_sock_fd; // Server socket
+int listen_backlog = BACKLOG;
+int listen_port = PORT;
+
+// Thread mode acceptors, each with its own listener when there are several
+static int acceptor_fds[ACCEPTORS_MAX];
+static pthread_t acceptor_threads[ACCEPTORS_MAX];
+static int acceptor_count;
 
 /////////////////////////////////////////////
-// USE THESE LOCKS AND COUNTER TO SYNCHRONIZE
+// USE THESE LOCKS TO SYNCHRONIZE (see server.h for the lock order)
+
+struct chat_lock dm_lock;
+struct chat_lock rooms_lock;
+struct chat_lock users_lock;
+struct chat_lock user_shard_locks[USER_SHARDS];
 
-int numReaders = 0; // Keep count of the number of readers
+void init_locks(void) {
+   char name[40];
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;  // Mutex lock
-pthread_mutex_t rw_lock = PTHREAD_MUTEX_INITIALIZER;  // Read/Write lock
+   chat_lock_init(&dm_lock, "dm");
+   chat_lock_init(&rooms_lock, "rooms");
+   chat_lock_init(&users_lock, "users");
+   for(int i = 0; i < USER_SHARDS; i++) {
+      sprintf(name, "user_shard:%d", i);
+      chat_lock_init(&user_shard_locks[i], name);
+   }
+}
 
 /////////////////////////////////////////////
 
 char const *server_MOTD = "Thanks for connecting to the BisonChat Server.\n\nchat>";
 
-struct node *head = NULL; // User list
+struct user_node *head = NULL; // User list
 struct room_node *rooms = NULL; // Room list
 
+static void usage(const char *prog) {
+   fprintf(stderr, "Usage: %s [-m thread|epoll|shards|uring] [-w loops_or_shards] [-q queue_bytes] [-s drop-oldest|disconnect|backpressure] [-u stats_socket]\n"
+                   "       [-l debug|info|warn|error] [-L log_file] [-S sample_every]\n"
+                   "       [-f snapshot_file] [-F snapshot_interval_s] [-H history_replay]\n"
+                   "       [-r conn_rate[:burst]] [-R room_rate[:burst]]\n"
+                   "       [-a acceptors] [-b backlog] [-c max_connections] [-p port]\n", prog);
+   exit(1);
+}
+
+// Block SIGINT and SIGTERM in this and every later thread and return a
+// descriptor that reads them instead
+static int shutdown_signal_fd(void) {
+   sigset_t set;
+
+   sigemptyset(&set);
+   sigaddset(&set, SIGINT);
+   sigaddset(&set, SIGTERM);
+   pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+   int fd = signalfd(-1, &set, SFD_CLOEXEC);
+   if(fd == -1) {
+      perror("signalfd");
+      exit(EXIT_FAILURE);
+   }
+   return fd;
+}
+
+static void wait_shutdown_signal(int signal_fd) {
+   struct signalfd_siginfo info;
+
+   while(read(signal_fd, &info, sizeof(info)) == -1 && errno == EINTR) {
+   }
+   chat_log(CHAT_LOG_INFO, "Gracefully shutting down the server (signal %u)...", info.ssi_signo);
+}
+
+// Supervisor for -m shards: fork a worker per shard, then pass the
+// shutdown signal on to them and wait for them all. Returns only in the
+// workers, with shard_id set.
+static void start_shards(int count, int signal_fd, const char *log_path, enum log_level level, int sample_every) {
+   pid_t pids[SHARD_MAX];
+   int status;
+
+   if(shard_init(count) == -1) {
+      exit(1);
+   }
+   for(int i = 0; i < count; i++) {
+      pids[i] = fork();
+      if(pids[i] == -1) {
+         perror("fork");
+         exit(EXIT_FAILURE);
+      }
+      if(pids[i] == 0) {
+         // A worker must not outlive its supervisor
+         prctl(PR_SET_PDEATHSIG, SIGTERM);
+         shard_attach(i);
+         return;
+      }
+   }
+
+   if(log_init(log_path, level, sample_every) == -1) {
+      exit(1);
+   }
+   chat_log(CHAT_LOG_INFO, "Server Launched! Listening on PORT: %d (%d shard processes)", listen_port, count);
+   wait_shutdown_signal(signal_fd);
+   for(int i = 0; i < count; i++) {
+      kill(pids[i], SIGTERM);
+   }
+   for(int i = 0; i < count; i++) {
+      while(waitpid(pids[i], &status, 0) == -1 && errno == EINTR) {
+      }
+   }
+   chat_log(CHAT_LOG_INFO, "All shards stopped");
+   log_flush();
+   exit(0);
+}
+
+// Accept up to ACCEPT_BATCH pending connections, giving each admitted one
+// its own detached thread. Returns false once the listener is shut down.
+static bool accept_batch(int listen_fd) {
+   for(int i = 0; i < ACCEPT_BATCH; i++) {
+      int new_client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if(new_client == -1) {
+         if(errno == EINTR || errno == ECONNABORTED) {
+            continue;
+         }
+         if(errno == EINVAL) {
+            return false;
+         }
+         if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            chat_log(CHAT_LOG_ERROR, "Accept: %s", strerror(errno));
+         }
+         return true;
+      }
+      if(!client_admit(new_client)) {
+         continue;
+      }
+
+      pthread_t new_client_thread;
+      int *pclient = malloc(sizeof(int));
+      if(pclient == NULL) {
+          perror("Failed to allocate memory for client socket");
+          exit(EXIT_FAILURE);
+      }
+      *pclient = new_client;
+      pthread_create(&new_client_thread, NULL, client_receive, pclient);
+      pthread_detach(new_client_thread); // Detach thread to reclaim resources when done
+   }
+   return true;
+}
+
+static void *acceptor_run(void *ptr) {
+   struct pollfd pfd = { .fd = *(int *) ptr, .events = POLLIN };
+
+   while(1) {
+      if(poll(&pfd, 1, -1) == -1) {
+         if(errno != EINTR) {
+            chat_log(CHAT_LOG_ERROR, "poll: %s", strerror(errno));
+         }
+         continue;
+      }
+      // A shut down listener reports a hangup
+      if((pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) || !accept_batch(pfd.fd)) {
+         return NULL;
+      }
+   }
+}
+
+// Start count acceptor threads on listen_port. Several share the port through
+// SO_REUSEPORT so a connection storm is spread over their accept queues.
+static void start_acceptors(int count) {
+   acceptor_count = count;
+   for(int i = 0; i < count; i++) {
+      acceptor_fds[i] = get_server_socket(count > 1);
+      if(start_server(acceptor_fds[i], listen_backlog) == -1) {
+         printf("Start server error\n");
+         exit(1);
+      }
+      if(fcntl(acceptor_fds[i], F_SETFL, O_NONBLOCK) == -1) {
+         perror("fcntl");
+         exit(EXIT_FAILURE);
+      }
+   }
+   for(int i = 0; i < count; i++) {
+      pthread_create(&acceptor_threads[i], NULL, acceptor_run, &acceptor_fds[i]);
+   }
+}
+
+// Shutting a listener down wakes its acceptor, which then returns
+static void stop_acceptors(void) {
+   for(int i = 0; i < acceptor_count; i++) {
+      shutdown(acceptor_fds[i], SHUT_RD);
+   }
+   for(int i = 0; i < acceptor_count; i++) {
+      pthread_join(acceptor_threads[i], NULL);
+      close(acceptor_fds[i]);
+   }
+   acceptor_count = 0;
+}
+
+static long elapsed_ms(const struct timespec *start) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Runs on the main thread once a shutdown signal arrives: stop accepting,
+// tell every client, give their queues SHUTDOWN_DRAIN_MS to go out, hang
+// up, and free the registries once the front ends have let go of them.
+static int server_shutdown(enum server_mode mode) {
+   struct timespec start;
+
+   if(mode == MODE_EPOLL) {
+      event_loops_stop_accepting();
+   } else if(mode == MODE_URING) {
+      uring_loops_stop_accepting();
+   } else {
+      stop_acceptors();
+   }
+
+   // Saved while every client is still in its rooms
+   snapshot_save();
+
+   notify_clients(SHUTDOWN_NOTICE);
+   size_t unsent = send_queue_drain(SHUTDOWN_DRAIN_MS);
+   if(unsent > 0) {
+      chat_log(CHAT_LOG_WARN, "Shutdown deadline passed with %zu bytes unsent", unsent);
+   }
+
+   hangup_clients();
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   while(clients_active() > 0 && elapsed_ms(&start) < SHUTDOWN_CLOSE_MS) {
+      usleep(10000);
+   }
+   if(mode == MODE_EPOLL) {
+      stop_event_loops();
+   } else if(mode == MODE_URING) {
+      stop_uring_loops();
+   }
+
+   int remaining = clients_active();
+   if(remaining > 0) {
+      // Their threads may still touch the registries; the exit reclaims them
+      chat_log(CHAT_LOG_WARN, "%d connections still open at exit", remaining);
+   } else {
+      chat_wrlock(&dm_lock);
+      chat_wrlock(&rooms_lock);
+      chat_wrlock(&users_lock);
+
+      // Free rooms first: dropping a room's memberships needs its members
+      while(rooms != NULL) {
+          rooms = removeRoom(rooms, (char *) name_str(rooms->name));
+      }
+      // Normally empty by now: every connection removed its own user
+      while(head != NULL) {
+          head = removeUser(head, (char *) name_str(head->name));
+      }
+
+      chat_unlock(&users_lock);
+      chat_unlock(&rooms_lock);
+      chat_unlock(&dm_lock);
+   }
+
+   chat_log(CHAT_LOG_INFO, "--------CLOSING ACTIVE USERS AND ROOMS--------");
+   log_flush();
+   return 0;
+}
+
 int main(int argc, char **argv) {
+   enum server_mode mode = MODE_THREAD;
+   int num_loops = 1;
+   enum slow_policy policy = SLOW_DROP_OLDEST;
+   long queue_bytes = SEND_QUEUE_DEFAULT_BYTES;
+   const char *stats_path = NULL;
+   enum log_level level = CHAT_LOG_INFO;
+   const char *log_path = NULL;
+   int sample_every = 1;
+   const char *snapshot_file = NULL;
+   int snapshot_every = SNAPSHOT_DEFAULT_INTERVAL;
+   int acceptors = 1;
+   int opt;
 
-   // Set up SIGINT handler for graceful shutdown
-   signal(SIGINT, sigintHandler);
+   while((opt = getopt(argc, argv, "m:w:q:s:u:l:L:S:f:F:H:r:R:a:b:c:p:")) != -1) {
+      switch(opt) {
+      case 'm':
+         if(strcmp(optarg, "thread") == 0) {
+            mode = MODE_THREAD;
+         } else if(strcmp(optarg, "epoll") == 0) {
+            mode = MODE_EPOLL;
+         } else if(strcmp(optarg, "shards") == 0) {
+            mode = MODE_SHARDS;
+         } else if(strcmp(optarg, "uring") == 0) {
+            mode = MODE_URING;
+         } else {
+            usage(argv[0]);
+         }
+         break;
+      case 'w':
+         num_loops = atoi(optarg);
+         if(num_loops < 1) {
+            usage(argv[0]);
+         }
+         break;
+      case 'q':
+         queue_bytes = atol(optarg);
+         if(queue_bytes < 1) {
+            usage(argv[0]);
+         }
+         break;
+      case 's':
+         if(!parse_slow_policy(optarg, &policy)) {
+            usage(argv[0]);
+         }
+         break;
+      case 'u':
+         stats_path = optarg;
+         break;
+      case 'l':
+         if(!parse_log_level(optarg, &level)) {
+            usage(argv[0]);
+         }
+         break;
+      case 'L':
+         log_path = optarg;
+         break;
+      case 'S':
+         sample_every = atoi(optarg);
+         if(sample_every < 1) {
+            usage(argv[0]);
+         }
+         break;
+      case 'f':
+         snapshot_file = optarg;
+         break;
+      case 'F':
+         snapshot_every = atoi(optarg);
+         break;
+      case 'H':
+         if(atoi(optarg) < 0) {
+            usage(argv[0]);
+         }
+         history_configure(atoi(optarg));
+         break;
+      case 'r':
+         if(!parse_rate_limit(optarg, &conn_rate)) {
+            usage(argv[0]);
+         }
+         break;
+      case 'R':
+         if(!parse_rate_limit(optarg, &room_rate)) {
+            usage(argv[0]);
+         }
+         break;
+      case 'a':
+         acceptors = atoi(optarg);
+         if(acceptors < 1 || acceptors > ACCEPTORS_MAX) {
+            usage(argv[0]);
+         }
+         break;
+      case 'b':
+         listen_backlog = atoi(optarg);
+         if(listen_backlog < 1) {
+            usage(argv[0]);
+         }
+         break;
+      case 'c':
+         max_clients = atoi(optarg);
+         if(max_clients < 0) {
+            usage(argv[0]);
+         }
+         break;
+      case 'p':
+         listen_port = atoi(optarg);
+         if(listen_port < 1 || listen_port > 65535) {
+            usage(argv[0]);
+         }
+         break;
+      default:
+         usage(argv[0]);
+      }
+   }
+
+   // Shutdown signals are read from a signalfd by the main thread; block
+   // them before any thread starts so none of them is interrupted instead
+   int signal_fd = shutdown_signal_fd();
+
+   // Fork before any thread exists. Each worker is then an epoll server
+   // with one loop, keeping its own stats socket and snapshot file.
+   char stats_shard_path[PATH_MAX];
+   char snapshot_shard_path[PATH_MAX];
+   if(mode == MODE_SHARDS) {
+      start_shards(num_loops, signal_fd, log_path, level, sample_every);
+      mode = MODE_EPOLL;
+      num_loops = 1;
+      if(stats_path != NULL) {
+         snprintf(stats_shard_path, sizeof(stats_shard_path), "%s.%d", stats_path, shard_id);
+         stats_path = stats_shard_path;
+      }
+      if(snapshot_file != NULL) {
+         snprintf(snapshot_shard_path, sizeof(snapshot_shard_path), "%s.%d", snapshot_file, shard_id);
+         snapshot_file = snapshot_shard_path;
+      }
+   }
+
+   if(log_init(log_path, level, sample_every) == -1) {
+      exit(1);
+   }
+   init_locks();
+   send_queue_init(policy, queue_bytes);
+
+   // Metrics for scrapers, served on a local socket
+   if(stats_path != NULL && stats_serve(stats_path) == -1) {
+      exit(1);
+   }
+
+   // A client vanishing mid-send must not kill the server
+   signal(SIGPIPE, SIG_IGN);
 
    //////////////////////////////////////////////////////
    // Create the default room for all clients to join when initially connecting
    //////////////////////////////////////////////////////
 
    // Initialize rooms with default room "Lobby"
-   rooms = insertFirstR(rooms, DEFAULT_ROOM);
+   rooms = addRoom(rooms, DEFAULT_ROOM);
    if(rooms == NULL) {
        printf("Failed to create default room\n");
        exit(1);
    }
 
-   // Open server socket
-   chat_serv_sock_fd = get_server_socket();
-
-   // Start listening for connections
-   if(start_server(chat_serv_sock_fd, BACKLOG) == -1) {
-      printf("Start server error\n");
-      exit(1);
+   // Warm restart: bring back the rooms and DM graph of the last run
+   if(snapshot_file != NULL) {
+      snapshot_load(snapshot_file);
+      if(snapshot_start(snapshot_file, snapshot_every) == -1) {
+         exit(1);
+      }
    }
-   
-   printf("Server Launched! Listening on PORT: %d\n", PORT);
-    
-   // Main execution loop
-   while(1) {
-      // Accept a connection and start a thread
-      int new_client = accept_client(chat_serv_sock_fd);
-      if(new_client != -1) {
-         pthread_t new_client_thread;
-         int *pclient = malloc(sizeof(int));
-         if(pclient == NULL) {
-             perror("Failed to allocate memory for client socket");
-             exit(EXIT_FAILURE);
-         }
-         *pclient = new_client;
-         pthread_create(&new_client_thread, NULL, client_receive, pclient);
-         pthread_detach(new_client_thread); // Detach thread to reclaim resources when done
+
+   if(mode == MODE_URING) {
+      if(start_uring_loops(num_loops) == 0) {
+         chat_log(CHAT_LOG_INFO, "Server Launched! Listening on PORT: %d (%d io_uring loops)", listen_port, num_loops);
+         wait_shutdown_signal(signal_fd);
+         return server_shutdown(mode);
       }
+      chat_log(CHAT_LOG_WARN, "Falling back to epoll loops");
+      mode = MODE_EPOLL;
    }
 
-   close(chat_serv_sock_fd);
+   if(mode == MODE_EPOLL) {
+      // Each loop binds its own listening socket on listen_port
+      start_event_loops(num_loops);
+      chat_log(CHAT_LOG_INFO, "Server Launched! Listening on PORT: %d (%d epoll loops)", listen_port, num_loops);
+      wait_shutdown_signal(signal_fd);
+      return server_shutdown(mode);
+   }
+
+   // Client output is flushed by one writer thread in thread mode
+   send_queue_start_writer();
+
+   start_acceptors(acceptors);
+   chat_log(CHAT_LOG_INFO, "Server Launched! Listening on PORT: %d (%d acceptors)", listen_port, acceptors);
+   wait_shutdown_signal(signal_fd);
+   return server_shutdown(mode);
 }
 
 // Create and return the server socket
-int get_server_socket(char *hostname, char *port) {
+int get_server_socket(int reuse_port) {
     int opt = 1;   
     int master_socket;
     struct sockaddr_in address; 
@@ -84,13 +488,20 @@ int get_server_socket(char *hostname, char *port) {
         perror("Setsockopt");   
         exit(EXIT_FAILURE);   
     }   
+
+    // Let several event loops bind the same port; the kernel spreads connections
+    if( reuse_port && setsockopt(master_socket, SOL_SOCKET, SO_REUSEPORT, (char *)&opt, sizeof(opt)) < 0 )
+    {
+        perror("Setsockopt SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
     
     // Type of socket created  
     address.sin_family = AF_INET;   
     address.sin_addr.s_addr = INADDR_ANY;   
-    address.sin_port = htons( PORT );   
+    address.sin_port = htons( listen_port );   
          
-    // Bind the socket to localhost port 8888  
+    // Bind the socket to the listening port  
     if (bind(master_socket, (struct sockaddr *)&address, sizeof(address))<0)   
     {   
         perror("Bind failed");   
@@ -109,70 +520,3 @@ int start_server(int serv_socket, int backlog) {
    }
    return status;
 }
-
-// Accept a new client connection
-int accept_client(int serv_sock) {
-   int reply_sock_fd = -1;
-   socklen_t sin_size = sizeof(struct sockaddr_storage);
-   struct sockaddr_storage client_addr;
-
-   // Accept a connection request from a client
-   if ((reply_sock_fd = accept(serv_sock, (struct sockaddr *)&client_addr, &sin_size)) == -1) {
-      perror("Accept");
-   }
-   return reply_sock_fd;
-}
-
-/* Handle SIGINT (CTRL+C) for graceful shutdown */
-void sigintHandler(int sig_num) {
-   printf("\nGracefully shutting down the server...\n");
-
-   //////////////////////////////////////////////////////////
-   // Closing client sockets and freeing memory from user list
-   //////////////////////////////////////////////////////////
-
-   // Acquire write lock to modify user and room lists
-   pthread_mutex_lock(&rw_lock);
-   
-   // Close all client sockets and free user list
-   struct node *current = head;
-   while(current != NULL) {
-       close(current->socket);
-       current = current->next;
-   }
-
-   // Free user list
-   while(head != NULL) {
-       struct node *temp = head;
-       head = head->next;
-       // Free DM connections
-       struct node *dm = temp->dm_connections;
-       while(dm != NULL) {
-           struct node *dmtmp = dm;
-           dm = dm->next;
-           free(dmtmp);
-       }
-       free(temp);
-   }
-
-   // Free rooms and their user lists
-   while(rooms != NULL) {
-       struct room_node *rtemp = rooms;
-       rooms = rooms->next;
-       // Free users in the room
-       struct node *u = rtemp->users;
-       while(u != NULL) {
-           struct node *utemp = u;
-           u = u->next;
-           free(utemp);
-       }
-       free(rtemp);
-   }
-
-   pthread_mutex_unlock(&rw_lock);
-
-   printf("--------CLOSING ACTIVE USERS AND ROOMS--------\n");
-
-   close(chat_serv_sock_fd);
-   exit(0);
-}
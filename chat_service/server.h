@@ -12,29 +12,110 @@
 #include <pthread.h>
 #include <signal.h>
 #include "list.h"
+#include "send_queue.h"
+#include "framing.h"
+#include "stats.h"
+#include "log.h"
+#include "snapshot.h"
+#include "shard.h"
 
 #define PORT 8888
-#define BACKLOG 10
+#define BACKLOG 1024     // Default listen backlog; the kernel caps it at net.core.somaxconn
+#define ACCEPTORS_MAX 64
+#define ACCEPT_BATCH 64  // Connections a thread-mode acceptor takes per wakeup
 #define MAXBUFF 2096
 
 #define DEFAULT_ROOM "Lobby"
 
+// Per-connection input buffer; holds at least one maximum-size frame
+#define INBUF_SIZE (2 * MAXBUFF)
+
+// Longest a sender waits for a full client queue under the backpressure policy
+#define SEND_TIMEOUT_MS 5000
+
+// On shutdown, how long queued output gets to reach clients, then how long
+// front ends get to close the connections after we hang up
+#define SHUTDOWN_DRAIN_MS 2000
+#define SHUTDOWN_CLOSE_MS 1000
+#define SHUTDOWN_NOTICE "Server is shutting down.\n"
+
+// Sent to connections turned away by admission control
+#define BUSY_REPLY "Server busy, try again later.\n"
+
+// Front end used to drive client connections
+enum server_mode {
+    MODE_THREAD, // One detached thread per client, blocking reads
+    MODE_EPOLL,  // N edge-triggered epoll loops sharing the port via SO_REUSEPORT
+    MODE_SHARDS, // N processes of one epoll loop each, relaying room messages (see shard.h)
+    MODE_URING   // N io_uring loops, as epoll loops but with multishot accept/recv; falls back to epoll
+};
+
+// State for one connected client, owned by the thread or event loop serving it
+struct client_conn {
+    int socket;
+    char username[30];
+    struct user_node *user; // Registry record; only this connection frees it
+    bool binary;            // Negotiated binary framing
+    struct token_bucket limit; // Commands and messages from this client
+    size_t inlen;           // Unprocessed bytes in inbuf
+    char inbuf[INBUF_SIZE];
+};
+
 // Function prototypes
-int get_server_socket();
+int get_server_socket(int reuse_port);
 int start_server(int serv_socket, int backlog);
-int accept_client(int serv_sock);
 void *client_receive(void *ptr);
-void sigintHandler(int sig_num);
+
+// Admission control, run by every front end on each accepted socket
+// before client_open. Once max_clients connections are open the socket
+// gets BUSY_REPLY and is closed, and this returns false. The limit is
+// checked rather than reserved, so acceptors racing each other can each
+// let one connection past it.
+bool client_admit(int socket);
+
+// Connection lifecycle and command dispatch shared by every front end
+struct client_conn *client_open(int socket);
+int client_process_input(struct client_conn *conn);
+int handle_command(struct client_conn *conn, char *line);
+void client_close(struct client_conn *conn);
+
+// Shutdown helpers: queue a notice to every registered user, hang up on
+// all of them, and count connections not yet closed by their front end
+void notify_clients(const char *text);
+void hangup_clients(void);
+int clients_active(void);
+
+// Deliver a room message relayed from another shard to the room's local
+// members. Returns false when nobody here is in the room.
+bool relay_deliver(const char *room, const char *data, size_t len);
+
+// Epoll front end
+int start_event_loops(int num_loops);
+void event_loops_stop_accepting(void);
+void stop_event_loops(void);
+
+// io_uring front end; start returns -1 when the kernel cannot run it
+int start_uring_loops(int num_loops);
+void uring_loops_stop_accepting(void);
+void stop_uring_loops(void);
 
 // Global variables
-extern int chat_serv_sock_fd; // Server socket
-extern struct node *head;     // User list
+extern int listen_backlog; // Backlog for every listening socket
+extern int listen_port;    // Port every listening socket binds, PORT unless -p
+extern int max_clients;    // Open connections admitted at once; 0 for no limit
+extern struct user_node *head;     // User list
 extern struct room_node *rooms; // Room list
 
-// Synchronization primitives
-extern int numReaders;
-extern pthread_mutex_t mutex;
-extern pthread_mutex_t rw_lock;
+// Synchronization primitives. When several are held they are taken in
+// this order: dm_lock, rooms_lock, a room's lock, users_lock, then user
+// shard locks in ascending shard number.
+extern struct chat_lock dm_lock;      // DM connection lists of every user
+extern struct chat_lock rooms_lock;   // Room list and room index
+extern struct chat_lock users_lock;   // User list links (iteration, add, remove)
+extern struct chat_lock user_shard_locks[USER_SHARDS]; // User index shards and records
+void init_locks(void);
+void lock_user_shards(int s1, int s2, bool write);
+void unlock_user_shards(int s1, int s2);
 
 // Message of the Day
 extern char const *server_MOTD;
@@ -1,66 +1,170 @@
 #include "server.h"
+#include <errno.h>
+#include <poll.h>
 
-#define DEFAULT_ROOM "Lobby"
-
-// USE THESE LOCKS AND COUNTER TO SYNCHRONIZE
-extern int numReaders;
-extern pthread_mutex_t rw_lock;
-extern pthread_mutex_t mutex;
-
-extern struct node *head;     // User list
+extern struct user_node *head;     // User list
 extern struct room_node *rooms; // Room list
 
 extern char const *server_MOTD;
 
 // Define delimiters for command parsing
-#define delimiters " \n"
-
-// Helper functions for synchronization
-void reader_lock() {
-    pthread_mutex_lock(&mutex);
-    numReaders++;
-    if(numReaders == 1){
-        pthread_mutex_lock(&rw_lock);
+#define delimiters " \t\r\n"
+
+// Room for the "locks" report: the global locks plus one line per room
+#define LOCK_REPORT_SIZE (64 * 1024)
+
+// Connections between client_open and the end of client_close
+static atomic_int active_clients;
+int max_clients = 0;
+
+// Take the index shard locks covering two usernames in ascending order
+void lock_user_shards(int s1, int s2, bool write) {
+    if(s1 > s2) {
+        int tmp = s1;
+        s1 = s2;
+        s2 = tmp;
     }
-    pthread_mutex_unlock(&mutex);
+    if(write) {
+        chat_wrlock(&user_shard_locks[s1]);
+        if(s2 != s1) chat_wrlock(&user_shard_locks[s2]);
+    } else {
+        chat_rdlock(&user_shard_locks[s1]);
+        if(s2 != s1) chat_rdlock(&user_shard_locks[s2]);
+    }
+}
+
+void unlock_user_shards(int s1, int s2) {
+    chat_unlock(&user_shard_locks[s1]);
+    if(s2 != s1) chat_unlock(&user_shard_locks[s2]);
 }
 
-void reader_unlock() {
-    pthread_mutex_lock(&mutex);
-    numReaders--;
-    if(numReaders == 0){
-        pthread_mutex_unlock(&rw_lock);
+// Commands the text protocol knows; any other first word makes the line a chat message
+static const char *const command_names[] = {
+    "create", "join", "leave", "connect", "disconnect", "rooms", "users", "login",
+    "help", "locks", "queues", "stats", "binary", "exit", "logout", NULL
+};
+
+static bool is_command(const char *word, size_t len) {
+    for(int i = 0; command_names[i] != NULL; i++) {
+        if(strncmp(command_names[i], word, len) == 0 && command_names[i][len] == '\0') {
+            return true;
+        }
     }
-    pthread_mutex_unlock(&mutex);
+    return false;
 }
 
-void writer_lock_func() {
-    pthread_mutex_lock(&rw_lock);
+// Send a reply to the client that issued the current command
+static void reply(struct client_conn *conn, const char *msg) {
+   if(conn->binary) {
+       struct chat_msg *frame = frame_text(OP_REPLY, msg, strlen(msg));
+       send_queue_push_msg(conn->socket, frame);
+       chat_msg_release(frame);
+       return;
+   }
+   send_queue_push(conn->socket, msg, strlen(msg));
 }
 
-void writer_unlock_func() {
-    pthread_mutex_unlock(&rw_lock);
+// Charge one request to the connection's bucket, telling the client when it is refused
+static bool conn_allow(struct client_conn *conn) {
+   if(rate_allow(&conn_rate, &conn->limit, monotonic_ns())) {
+       return true;
+   }
+   stats_add(STAT_THROTTLED_CONN, 1);
+   reply(conn, "Rate limit exceeded, slow down.\nchat>");
+   return false;
 }
 
-// Function to trim leading and trailing whitespace
-char *trimwhitespace(char *str)
-{
-  char *end;
+// Register a freshly accepted socket: greet it and park it in the Lobby as a guest
+struct client_conn *client_open(int socket) {
+   struct user_node *currentUser;
+   struct room_node *currentRoom;
 
-  // Trim leading space
-  while(isspace((unsigned char)*str)) str++;
+   struct client_conn *conn = malloc(sizeof(struct client_conn));
+   if(conn == NULL) {
+       perror("Failed to allocate client connection");
+       exit(EXIT_FAILURE);
+   }
+   conn->socket = socket;
+   conn->inlen = 0;
+   conn->binary = false;
+   token_bucket_init(&conn->limit);
+   send_queue_open(socket);
+   stats_add(STAT_CONN_OPENED, 1);
+   atomic_fetch_add(&active_clients, 1);
 
-  if(*str == 0)  // All spaces?
-    return str;
+   // Send Welcome Message of the Day
+   reply(conn, server_MOTD);
 
-  // Trim trailing space
-  end = str + strlen(str) - 1;
-  while(end > str && isspace((unsigned char)*end)) end--;
+   // Create the guest username
+   snprintf(conn->username, sizeof(conn->username), "guest%d", socket);
+
+   // Acquire the list lock and the index shard to add the user
+   int shard = userShard(conn->username);
+   chat_wrlock(&users_lock);
+   chat_wrlock(&user_shard_locks[shard]);
+   head = addUser(head, socket, conn->username);
+   currentUser = findUser(head, conn->username);
+   if(currentUser != NULL && currentUser->socket != socket) {
+       currentUser = NULL; // Someone already logged in under this guest name
+   }
+   conn->user = currentUser;
+   chat_unlock(&user_shard_locks[shard]);
+   chat_unlock(&users_lock);
 
-  // Write new null terminator character
-  end[1] = '\0';
+   // Add the GUEST to the DEFAULT ROOM (i.e., Lobby)
+   chat_rdlock(&rooms_lock);
+   currentRoom = findRoom(rooms, DEFAULT_ROOM);
+   if(currentRoom != NULL && currentUser != NULL) {
+       chat_wrlock(&currentRoom->lock);
+       addUserToRoom(currentRoom, currentUser);
+       chat_unlock(&currentRoom->lock);
+   }
+   chat_unlock(&rooms_lock);
 
-  return str;
+   return conn;
+}
+
+// Remove the user from every room, DM link and the user list, then close the socket
+void client_close(struct client_conn *conn) {
+   char *username = conn->username;
+   int shard = userShard(username);
+
+   // Remove user from the rooms it joined
+   if(conn->user != NULL) {
+       chat_rdlock(&rooms_lock);
+       while(conn->user->rooms_joined != NULL) {
+           struct room_node *r = conn->user->rooms_joined->room;
+           chat_wrlock(&r->lock);
+           removeUserFromRoom(r, conn->user);
+           chat_unlock(&r->lock);
+       }
+       chat_unlock(&rooms_lock);
+   }
+
+   // Drop DM links and the user record under one dm_lock hold so nobody can
+   // connect to a user that is on its way out. removeUser visits only this
+   // user's own peers to unlink it.
+   chat_wrlock(&dm_lock);
+
+   // Remove user from user list
+   chat_wrlock(&users_lock);
+   chat_wrlock(&user_shard_locks[shard]);
+   if(conn->user != NULL) {
+       head = removeUser(head, username);
+   }
+   chat_unlock(&user_shard_locks[shard]);
+   chat_unlock(&users_lock);
+   chat_unlock(&dm_lock);
+
+   // Nobody can queue for this socket any more; drop what never went out
+   send_queue_close(conn->socket);
+   stats_add(STAT_CONN_CLOSED, 1);
+
+   // Close socket
+   close(conn->socket);
+   chat_log(CHAT_LOG_INFO, "User '%s' has disconnected.", username);
+   free(conn);
+   atomic_fetch_sub(&active_clients, 1);
 }
 
 // Thread function to handle client communication
@@ -68,440 +172,689 @@ void *client_receive(void *ptr) {
    int client = *(int *) ptr;  // Socket descriptor
    free(ptr); // Free the dynamically allocated pointer
 
-   int received, i;
-   char buffer[MAXBUFF], sbuffer[MAXBUFF];  // Data buffers
-   char tmpbuf[MAXBUFF];  // Temporary buffer for messages
-   char cmd[MAXBUFF], username[30];
-   char *arguments[80];
-   char *token;
+   int received;
 
-   struct node *currentUser;
-   struct room_node *currentRoom;
+   struct client_conn *conn = client_open(client);
+   send_queue_watch(client);
 
-   // Send Welcome Message of the Day
-   send(client, server_MOTD, strlen(server_MOTD), 0);
+   while (1) {
 
-   // Create the guest username
-   sprintf(username, "guest%d", client);
+      if ((received = read(client, conn->inbuf + conn->inlen, INBUF_SIZE - 1 - conn->inlen)) <= 0) {
+          // Client disconnected
+          chat_log(CHAT_LOG_INFO, "Client disconnected: %s", conn->username);
+          break;
+      }
+      conn->inlen += received;
+      stats_add(STAT_BYTES_IN, received);
 
-   // Acquire write lock to add user
-   writer_lock_func();
-   head = insertFirstU(head, client, username);
-   
-   // Add the GUEST to the DEFAULT ROOM (i.e., Lobby)
-   currentRoom = findR(rooms, DEFAULT_ROOM);
-   if(currentRoom != NULL) {
-       currentUser = findU(head, username);
-       if(currentUser != NULL) {
-           addUserToRoom(currentRoom, currentUser);
-       }
+      if(client_process_input(conn)) {
+          break;
+      }
    }
-   writer_unlock_func();
 
-   while (1) {
-       
-      if ((received = read(client, buffer, MAXBUFF - 1)) <= 0) {
-          // Client disconnected
-          printf("Client disconnected: %s\n", username);
+   // User is exiting, perform cleanup
+   client_close(conn);
+   return NULL;
+}
+
+static int execute_command(struct client_conn *conn, int i, char **arguments);
+static void broadcast_message(struct client_conn *conn, const char *text);
+static void deliver(int socket, struct chat_msg *msg, struct chat_msg **framed);
+
+// Run every complete frame in the input buffer, keeping a partial tail
+static int process_frames(struct client_conn *conn) {
+   size_t used = 0;
+   int status = 0;
+   char payload[FRAME_MAX_LEN + 1];
+
+   while(status == 0) {
+      uint8_t op;
+      const char *data;
+      size_t len;
+      long n = frame_parse(conn->inbuf + used, conn->inlen - used, &op, &data, &len);
+      if(n == 0) {
           break;
       }
-      buffer[received] = '\0'; 
-      strcpy(cmd, buffer);  
-      strcpy(sbuffer, buffer);
-      
-      /////////////////////////////////////////////////////
-      // Received data from a client
-
-      // 1. Tokenize the input command
-      i = 0;
-      token = strtok(cmd, delimiters);
-      while(token != NULL && i < 80) {
-          arguments[i++] = token;
-          token = strtok(NULL, delimiters);
+      if(n < 0) {
+          stats_add(STAT_CMD_BAD, 1);
+          chat_log(CHAT_LOG_WARN, "Malformed frame from %s", conn->username);
+          return 1;
+      }
+      used += n;
+
+      // Commands expect NUL-terminated arguments
+      memcpy(payload, data, len);
+      payload[len] = '\0';
+
+      if(op == OP_TEXT) {
+          status = handle_command(conn, payload);
+      } else if(op == OP_SEND) {
+          if(conn_allow(conn)) {
+              broadcast_message(conn, payload);
+          }
+      } else if(frame_op_command(op) != NULL) {
+          char *arguments[3] = { (char *) frame_op_command(op), payload, NULL };
+          status = execute_command(conn, len > 0 ? 2 : 1, arguments);
+      } else {
+          stats_add(STAT_CMD_BAD, 1);
+          reply(conn, "Unknown opcode.\n");
       }
-      arguments[i] = NULL;
+   }
+
+   memmove(conn->inbuf, conn->inbuf + used, conn->inlen - used);
+   conn->inlen -= used;
+   return status;
+}
 
-      // Trim whitespace for each argument
-      for(int j = 0; j < i; j++) {
-          arguments[j] = trimwhitespace(arguments[j]);
+// Run every complete line in the input buffer, keeping a partial tail.
+// Lines are terminated and tokenized in place, never copied.
+static int process_lines(struct client_conn *conn) {
+   size_t used = 0;
+   int status = 0;
+
+   while(status == 0 && !conn->binary) {
+      char *line = conn->inbuf + used;
+      char *end = memchr(line, '\n', conn->inlen - used);
+      if(end == NULL) {
+          // A line that fills the whole buffer is taken as it is
+          if(used > 0 || conn->inlen < INBUF_SIZE - 1) {
+              break;
+          }
+          end = conn->inbuf + conn->inlen;
       }
+      used = end - conn->inbuf + (end < conn->inbuf + conn->inlen ? 1 : 0);
 
-      // If no command, continue
-      if(arguments[0] == NULL) {
-          sprintf(buffer, "\nchat>");
-          send(client, buffer, strlen(buffer), 0);
-          continue;
+      *end = '\0';
+      if(end > line && end[-1] == '\r') {
+          end[-1] = '\0';
       }
+      status = handle_command(conn, line);
+   }
+
+   memmove(conn->inbuf, conn->inbuf + used, conn->inlen - used);
+   conn->inlen -= used;
+
+   // "binary" switches protocol mid-buffer; the rest are frames
+   if(status == 0 && conn->binary && conn->inlen > 0) {
+      status = process_frames(conn);
+   }
+   return status;
+}
+
+// Act on the bytes the front end just appended to conn->inbuf.
+// Returns non-zero when the connection should be closed.
+int client_process_input(struct client_conn *conn) {
+   int status;
+
+   // Replies to a pipelined batch leave in as few sendmsg() calls as possible
+   send_queue_cork(conn->socket);
+   status = conn->binary ? process_frames(conn) : process_lines(conn);
+   send_queue_uncork(conn->socket);
+   return status;
+}
+
+// Parse and execute one text command line received from a client. The
+// line is tokenized in place; it is only left intact when it turns out to
+// be a chat message. Returns non-zero when the connection should be closed.
+int handle_command(struct client_conn *conn, char *line) {
+   int i = 0;
+   char *arguments[81];
+   size_t lengths[80];
+
+   /////////////////////////////////////////////////////
+   // Received data from a client
+
+   // 1. Find the words of the command
+   char *p = line;
+   while(i < 80) {
+       p += strspn(p, delimiters);
+       if(*p == '\0') {
+           break;
+       }
+       arguments[i] = p;
+       lengths[i] = strcspn(p, delimiters);
+       p += lengths[i];
+       i++;
+   }
+   arguments[i] = NULL;
+
+   // If no command, continue
+   if(i == 0) {
+       reply(conn, "\nchat>");
+       return 0;
+   }
+
+   if(!is_command(arguments[0], lengths[0])) {
+       // 3. Sending a message
+       if(conn_allow(conn)) {
+           broadcast_message(conn, line);
+       }
+       return 0;
+   }
+
+   // Terminate each word where its delimiter was
+   for(int j = 0; j < i; j++) {
+       arguments[j][lengths[j]] = '\0';
+   }
+
+   return execute_command(conn, i, arguments);
+}
+
+// Commands whose first argument is a room or user name
+static bool takes_name(const char *command) {
+   return strcmp(command, "create") == 0 || strcmp(command, "join") == 0 ||
+          strcmp(command, "leave") == 0 || strcmp(command, "connect") == 0 ||
+          strcmp(command, "disconnect") == 0 || strcmp(command, "login") == 0;
+}
+
+// Execute a parsed command, one of command_names; chat messages never get
+// here. Returns non-zero to close the connection.
+static int execute_command(struct client_conn *conn, int i, char **arguments) {
+   int client = conn->socket;
+   char *username = conn->username;
+   char buffer[MAXBUFF];
+
+   struct user_node *currentUser;
+   struct room_node *currentRoom;
 
-      /////////////////////////////////////////////////////
-      // 2. Execute command
+   /////////////////////////////////////////////////////
+   // 2. Execute command
 
-      if(strcmp(arguments[0], "create") == 0)
-      {
-         if(i < 2) {
-             strcpy(buffer, "Usage: create <room>\nchat>");
-             send(client, buffer, strlen(buffer), 0);
-             continue;
-         }
+   chat_log(CHAT_LOG_DEBUG, "%s: %s %s", username, arguments[0], i > 1 ? arguments[1] : "");
 
-         printf("Create room: %s\n", arguments[1]); 
+   // Leaving is never throttled; everything else, messages included, is charged here once
+   bool leaving = strcmp(arguments[0], "exit") == 0 || strcmp(arguments[0], "logout") == 0;
+   if(!leaving && !conn_allow(conn)) {
+       return 0;
+   }
+
+   // Room and user names the registries would truncate are refused
+   if(i > 1 && takes_name(arguments[0]) && strlen(arguments[1]) >= NAME_LEN) {
+       snprintf(buffer, sizeof(buffer), "Name too long (at most %d characters).\nchat>", NAME_LEN - 1);
+       reply(conn, buffer);
+       return 0;
+   }
+
+   if(strcmp(arguments[0], "create") == 0)
+   {
+      stats_add(STAT_CMD_CREATE, 1);
+      if(i < 2) {
+          reply(conn, "Usage: create <room>\nchat>");
+          return 0;
+      }
 
-         // Perform the operation to create room arguments[1]
-         writer_lock_func();
-         rooms = insertFirstR(rooms, arguments[1]);
-         writer_unlock_func();
+      // Perform the operation to create room arguments[1]
+      chat_wrlock(&rooms_lock);
+      rooms = addRoom(rooms, arguments[1]);
+      chat_unlock(&rooms_lock);
 
-         sprintf(buffer, "Room '%s' created.\nchat>", arguments[1]);
-         send(client, buffer, strlen(buffer), 0); 
+      snprintf(buffer, sizeof(buffer), "Room '%s' created.\nchat>", arguments[1]);
+      reply(conn, buffer);
+   }
+   else if (strcmp(arguments[0], "join") == 0)
+   {
+      stats_add(STAT_CMD_JOIN, 1);
+      if(i < 2) {
+          reply(conn, "Usage: join <room>\nchat>");
+          return 0;
       }
-      else if (strcmp(arguments[0], "join") == 0)
-      {
-         if(i < 2) {
-             strcpy(buffer, "Usage: join <room>\nchat>");
-             send(client, buffer, strlen(buffer), 0);
-             continue;
-         }
-
-         printf("Join room: %s\n", arguments[1]);  
-
-         // Perform the operation to join room arguments[1]
-         writer_lock_func();
-         currentRoom = findR(rooms, arguments[1]);
-         if(currentRoom == NULL) {
-             sprintf(buffer, "Room '%s' does not exist.\nchat>", arguments[1]);
-             writer_unlock_func();
-             send(client, buffer, strlen(buffer), 0);
-             continue;
-         }
-
-         currentUser = findU(head, username);
-         if(currentUser == NULL) {
-             sprintf(buffer, "User not found.\nchat>");
-             writer_unlock_func();
-             send(client, buffer, strlen(buffer), 0);
-             continue;
-         }
-
-         addUserToRoom(currentRoom, currentUser);
-         writer_unlock_func();
-
-         sprintf(buffer, "Joined room '%s'.\nchat>", arguments[1]);
-         send(client, buffer, strlen(buffer), 0);
+
+      // Perform the operation to join room arguments[1]
+      chat_rdlock(&rooms_lock);
+      currentRoom = findRoom(rooms, arguments[1]);
+      if(currentRoom == NULL && shard_count > 0) {
+          // It may have been created on another shard
+          chat_unlock(&rooms_lock);
+          chat_wrlock(&rooms_lock);
+          shard_import_rooms();
+          chat_unlock(&rooms_lock);
+          chat_rdlock(&rooms_lock);
+          currentRoom = findRoom(rooms, arguments[1]);
       }
-      else if (strcmp(arguments[0], "leave") == 0)
-      {
-         if(i < 2) {
-             strcpy(buffer, "Usage: leave <room>\nchat>");
-             send(client, buffer, strlen(buffer), 0);
-             continue;
-         }
-
-         printf("Leave room: %s\n", arguments[1]); 
-
-         // Perform the operation to leave room arguments[1]
-         writer_lock_func();
-         currentRoom = findR(rooms, arguments[1]);
-         if(currentRoom == NULL) {
-             sprintf(buffer, "Room '%s' does not exist.\nchat>", arguments[1]);
-             writer_unlock_func();
-             send(client, buffer, strlen(buffer), 0);
-             continue;
-         }
-
-         currentUser = findU(head, username);
-         if(currentUser == NULL) {
-             sprintf(buffer, "User not found.\nchat>");
-             writer_unlock_func();
-             send(client, buffer, strlen(buffer), 0);
-             continue;
-         }
-
-         removeUserFromRoom(currentRoom, username);
-         writer_unlock_func();
-
-         sprintf(buffer, "Left room '%s'.\nchat>", arguments[1]);
-         send(client, buffer, strlen(buffer), 0);
-      } 
-      else if (strcmp(arguments[0], "connect") == 0)
-      {
-         if(i < 2) {
-             strcpy(buffer, "Usage: connect <user>\nchat>");
-             send(client, buffer, strlen(buffer), 0);
-             continue;
-         }
-
-         printf("Connect to user: %s\n", arguments[1]);
-
-         // Perform the operation to connect to user arguments[1]
-         writer_lock_func();
-         bool success = connectUsers(head, username, arguments[1]);
-         writer_unlock_func();
-
-         if(success) {
-             sprintf(buffer, "Connected to user '%s'.\nchat>", arguments[1]);
-         }
-         else {
-             sprintf(buffer, "Failed to connect to user '%s'. They may not exist or are already connected.\nchat>", arguments[1]);
-         }
-
-         send(client, buffer, strlen(buffer), 0); 
+      if(currentRoom == NULL) {
+          snprintf(buffer, sizeof(buffer), "Room '%s' does not exist.\nchat>", arguments[1]);
+          chat_unlock(&rooms_lock);
+          reply(conn, buffer);
+          return 0;
       }
-      else if (strcmp(arguments[0], "disconnect") == 0)
-      {             
-         if(i < 2) {
-             strcpy(buffer, "Usage: disconnect <user>\nchat>");
-             send(client, buffer, strlen(buffer), 0);
-             continue;
-         }
-
-         printf("Disconnect from user: %s\n", arguments[1]);
-
-         // Perform the operation to disconnect from user arguments[1]
-         writer_lock_func();
-         bool success = disconnectUsers(head, username, arguments[1]);
-         writer_unlock_func();
-
-         if(success) {
-             sprintf(buffer, "Disconnected from user '%s'.\nchat>", arguments[1]);
-         }
-         else {
-             sprintf(buffer, "Failed to disconnect from user '%s'. They may not exist or are not connected.\nchat>", arguments[1]);
-         }
-
-         send(client, buffer, strlen(buffer), 0); 
-      }                  
-      else if (strcmp(arguments[0], "rooms") == 0)
-      {
-          printf("List all the rooms\n");
-
-          // List all rooms and append to buffer
-          writer_lock_func();
-          char room_list[MAXBUFF] = "Available rooms:\n";
-          listRooms(rooms, room_list);
-          writer_unlock_func();
-
-          strcat(room_list, "chat>");
-          send(client, room_list, strlen(room_list), 0);                            
-      }   
-      else if (strcmp(arguments[0], "users") == 0)
-      {
-          printf("List all the users\n");
-
-          // List all users and append to buffer
-          writer_lock_func();
-          char user_list[MAXBUFF] = "Connected users:\n";
-          struct node *current = head;
-          while(current != NULL) {
-              strcat(user_list, current->username);
-              strcat(user_list, "\n");
-              current = current->next;
-          }
-          writer_unlock_func();
-
-          strcat(user_list, "chat>");
-          send(client, user_list, strlen(user_list), 0); 
-      }                           
-      else if (strcmp(arguments[0], "login") == 0)
-      {
-          if(i < 2) {
-              strcpy(buffer, "Usage: login <username>\nchat>");
-              send(client, buffer, strlen(buffer), 0);
-              continue;
+
+      currentUser = conn->user;
+      if(currentUser == NULL) {
+          snprintf(buffer, sizeof(buffer), "User not found.\nchat>");
+          chat_unlock(&rooms_lock);
+          reply(conn, buffer);
+          return 0;
+      }
+
+      // A new member catches up on the room's recent messages
+      struct chat_msg *backlog = NULL;
+      chat_wrlock(&currentRoom->lock);
+      if(!isUserInRoom(currentRoom, currentUser)) {
+          addUserToRoom(currentRoom, currentUser);
+          backlog = history_replay(&currentRoom->history);
+      }
+      chat_unlock(&currentRoom->lock);
+      chat_unlock(&rooms_lock);
+
+      if(backlog != NULL) {
+          struct chat_msg *framed = NULL;
+          deliver(client, backlog, &framed);
+          chat_msg_release(backlog);
+          if(framed != NULL) {
+              chat_msg_release(framed);
           }
+      }
 
-          char *new_username = arguments[1];
-          printf("User '%s' attempting to login as '%s'\n", username, new_username);
+      snprintf(buffer, sizeof(buffer), "Joined room '%s'.\nchat>", arguments[1]);
+      reply(conn, buffer);
+   }
+   else if (strcmp(arguments[0], "leave") == 0)
+   {
+      stats_add(STAT_CMD_LEAVE, 1);
+      if(i < 2) {
+          reply(conn, "Usage: leave <room>\nchat>");
+          return 0;
+      }
 
-          writer_lock_func();
+      // Perform the operation to leave room arguments[1]
+      chat_rdlock(&rooms_lock);
+      currentRoom = findRoom(rooms, arguments[1]);
+      if(currentRoom == NULL) {
+          snprintf(buffer, sizeof(buffer), "Room '%s' does not exist.\nchat>", arguments[1]);
+          chat_unlock(&rooms_lock);
+          reply(conn, buffer);
+          return 0;
+      }
 
-          // Check if new username is already taken
-          if(findU(head, new_username) != NULL) {
-              sprintf(buffer, "Username '%s' is already taken.\nchat>", new_username);
-              writer_unlock_func();
-              send(client, buffer, strlen(buffer), 0);
-              continue;
-          }
+      currentUser = conn->user;
+      if(currentUser == NULL) {
+          snprintf(buffer, sizeof(buffer), "User not found.\nchat>");
+          chat_unlock(&rooms_lock);
+          reply(conn, buffer);
+          return 0;
+      }
 
-          // Find user node
-          currentUser = findU(head, username);
-          if(currentUser == NULL) {
-              sprintf(buffer, "User not found.\nchat>");
-              writer_unlock_func();
-              send(client, buffer, strlen(buffer), 0);
-              continue;
-          }
+      chat_wrlock(&currentRoom->lock);
+      removeUserFromRoom(currentRoom, currentUser);
+      chat_unlock(&currentRoom->lock);
+      chat_unlock(&rooms_lock);
 
-          // Update username in user list
-          strcpy(currentUser->username, new_username);
-
-          // Update username in rooms
-          struct room_node *r = rooms;
-          while(r != NULL) {
-              struct node *u = r->users;
-              while(u != NULL) {
-                  if(u->socket == client) {
-                      strcpy(u->username, new_username);
-                  }
-                  u = u->next;
-              }
-              r = r->next;
-          }
+      snprintf(buffer, sizeof(buffer), "Left room '%s'.\nchat>", arguments[1]);
+      reply(conn, buffer);
+   }
+   else if (strcmp(arguments[0], "connect") == 0)
+   {
+      stats_add(STAT_CMD_CONNECT, 1);
+      if(i < 2) {
+          reply(conn, "Usage: connect <user>\nchat>");
+          return 0;
+      }
 
-          // Update username in DM connections
-          struct node *dm = currentUser->dm_connections;
-          while(dm != NULL) {
-              // Find other user and update their DM connections
-              struct node *other = findU(head, dm->username);
-              if(other != NULL) {
-                  struct node *other_dm = other->dm_connections;
-                  while(other_dm != NULL) {
-                      if(strcmp(other_dm->username, username) == 0) {
-                          strcpy(other_dm->username, new_username);
-                          break;
-                      }
-                      other_dm = other_dm->next;
-                  }
-              }
-              dm = dm->next;
-          }
+      // Perform the operation to connect to user arguments[1]
+      int shard = userShard(username), peer_shard = userShard(arguments[1]);
+      chat_wrlock(&dm_lock);
+      lock_user_shards(shard, peer_shard, false);
+      bool success = connectUsersDM(head, username, arguments[1]);
+      unlock_user_shards(shard, peer_shard);
+      chat_unlock(&dm_lock);
 
-          // Update username variable for this thread
-          strcpy(username, new_username);
-
-          writer_unlock_func();
-
-          sprintf(buffer, "Logged in as '%s'.\nchat>", new_username);
-          send(client, buffer, strlen(buffer), 0); 
-      } 
-      else if (strcmp(arguments[0], "help") == 0 )
-      {
-          strcpy(buffer, "Available commands:\n");
-          strcat(buffer, "login <username> - \"login with username\"\n");
-          strcat(buffer, "create <room> - \"create a room\"\n");
-          strcat(buffer, "join <room> - \"join a room\"\n");
-          strcat(buffer, "leave <room> - \"leave a room\"\n");
-          strcat(buffer, "users - \"list all users\"\n");
-          strcat(buffer, "rooms -  \"list all rooms\"\n");
-          strcat(buffer, "connect <user> - \"connect to user (DM)\"\n");
-          strcat(buffer, "disconnect <user> - \"disconnect from user (DM)\"\n");
-          strcat(buffer, "exit or logout - \"exit chat\"\n");
-          strcat(buffer, "chat>");
-          send(client, buffer, strlen(buffer), 0); // Send back to client 
+      if(success) {
+          snprintf(buffer, sizeof(buffer), "Connected to user '%s'.\nchat>", arguments[1]);
+      }
+      else {
+          snprintf(buffer, sizeof(buffer), "Failed to connect to user '%s'. They may not exist or are already connected.\nchat>", arguments[1]);
       }
-      else if (strcmp(arguments[0], "exit") == 0 || strcmp(arguments[0], "logout") == 0)
-      {
-          // Remove the initiating user from all rooms and direct connections, then close the socket descriptor.
-          printf("User '%s' is exiting.\n", username);
-
-          writer_lock_func();
-
-          // Remove user from all rooms
-          struct room_node *r = rooms;
-          while(r != NULL) {
-              removeUserFromRoom(r, username);
-              r = r->next;
-          }
 
-          // Disconnect from all DM connections
-          struct node *current_dm = head;
-          while(current_dm != NULL) {
-              if(strcmp(current_dm->username, username) != 0 && areConnected(head, username, current_dm->username)) {
-                  disconnectUsers(head, username, current_dm->username);
-              }
-              current_dm = current_dm->next;
-          }
+      reply(conn, buffer);
+   }
+   else if (strcmp(arguments[0], "disconnect") == 0)
+   {
+      stats_add(STAT_CMD_DISCONNECT, 1);
+      if(i < 2) {
+          reply(conn, "Usage: disconnect <user>\nchat>");
+          return 0;
+      }
 
-          // Remove user from user list
-          head = deleteU(head, username);
-
-          writer_unlock_func();
-
-          // Close socket
-          close(client);
-          printf("User '%s' has exited.\n", username);
-          break; // Exit the thread
-      }                         
-      else { 
-           /////////////////////////////////////////////////////////////
-           // 3. Sending a message
-   
-           // Format the message
-           char formatted_msg[MAXBUFF];
-           sprintf(formatted_msg, "::%s> %s\nchat>", username, buffer);
-
-           // Acquire write lock to send messages
-           writer_lock_func();
-
-           // Send to all users in the same rooms
-           struct room_node *r = rooms;
-           while(r != NULL) {
-               // Check if user is in the room
-               struct node *u = r->users;
-               bool in_room = false;
-               while(u != NULL) {
-                   if(strcmp(u->username, username) == 0) {
-                       in_room = true;
-                       break;
-                   }
-                   u = u->next;
-               }
-               if(in_room) {
-                   // Send to all users in the room
-                   struct node *recipient = r->users;
-                   while(recipient != NULL) {
-                       if(recipient->socket != client) { // Don't send to self
-                           send(recipient->socket, formatted_msg, strlen(formatted_msg), 0);
-                       }
-                       recipient = recipient->next;
-                   }
-               }
-               r = r->next;
-           }
-
-           // Send to all DM connections
-           currentUser = findU(head, username);
-           if(currentUser != NULL) {
-               struct node *dm = currentUser->dm_connections;
-               while(dm != NULL) {
-                   send(dm->socket, formatted_msg, strlen(formatted_msg), 0);
-                   dm = dm->next;
-               }
-           }
-
-           writer_unlock_func();
+      // Perform the operation to disconnect from user arguments[1]
+      int shard = userShard(username), peer_shard = userShard(arguments[1]);
+      chat_wrlock(&dm_lock);
+      lock_user_shards(shard, peer_shard, false);
+      bool success = disconnectUsersDM(head, username, arguments[1]);
+      unlock_user_shards(shard, peer_shard);
+      chat_unlock(&dm_lock);
+
+      if(success) {
+          snprintf(buffer, sizeof(buffer), "Disconnected from user '%s'.\nchat>", arguments[1]);
+      }
+      else {
+          snprintf(buffer, sizeof(buffer), "Failed to disconnect from user '%s'. They may not exist or are not connected.\nchat>", arguments[1]);
       }
 
-      // Reset buffer
-      memset(buffer, 0, sizeof(buffer));
+      reply(conn, buffer);
    }
+   else if (strcmp(arguments[0], "rooms") == 0)
+   {
+       stats_add(STAT_CMD_ROOMS, 1);
+       // List all rooms and append to buffer
+       // Rooms created on other shards are listed too
+       if(shard_count > 0) {
+           chat_wrlock(&rooms_lock);
+           shard_import_rooms();
+           chat_unlock(&rooms_lock);
+       }
 
-   // User is exiting, perform cleanup
+       chat_rdlock(&rooms_lock);
+       char room_list[MAXBUFF] = "Available rooms:\n";
+       listAllRooms(rooms, room_list, sizeof(room_list) - sizeof("chat>"));
+       chat_unlock(&rooms_lock);
+
+       strcat(room_list, "chat>");
+       reply(conn, room_list);
+   }
+   else if (strcmp(arguments[0], "users") == 0)
+   {
+       stats_add(STAT_CMD_USERS, 1);
+       // List all users and append to buffer
+       chat_rdlock(&users_lock);
+       char user_list[MAXBUFF] = "Connected users:\n";
+       listAllUsers(head, user_list, sizeof(user_list) - sizeof("chat>"));
+       chat_unlock(&users_lock);
+
+       strcat(user_list, "chat>");
+       reply(conn, user_list);
+   }
+   else if (strcmp(arguments[0], "login") == 0)
+   {
+       stats_add(STAT_CMD_LOGIN, 1);
+       if(i < 2) {
+           reply(conn, "Usage: login <username>\nchat>");
+           return 0;
+       }
+
+       char *new_username = arguments[1];
+
+       // dm_lock is held throughout so logins and DM edits never interleave
+       int old_shard = userShard(username), new_shard = userShard(new_username);
+       chat_wrlock(&dm_lock);
+       chat_wrlock(&users_lock);
+       lock_user_shards(old_shard, new_shard, true);
+
+       // Check if new username is already taken
+       if(findUser(head, new_username) != NULL) {
+           snprintf(buffer, sizeof(buffer), "Username '%s' is already taken.\nchat>", new_username);
+           unlock_user_shards(old_shard, new_shard);
+           chat_unlock(&users_lock);
+           chat_unlock(&dm_lock);
+           reply(conn, buffer);
+           return 0;
+       }
+
+       // Find user node
+       currentUser = conn->user;
+       if(currentUser == NULL) {
+           snprintf(buffer, sizeof(buffer), "User not found.\nchat>");
+           unlock_user_shards(old_shard, new_shard);
+           chat_unlock(&users_lock);
+           chat_unlock(&dm_lock);
+           reply(conn, buffer);
+           return 0;
+       }
+
+       // Update username in user list and its index; room memberships and
+       // DM edges point at this record and follow along
+       renameUser(head, username, new_username);
+       unlock_user_shards(old_shard, new_shard);
+       chat_unlock(&users_lock);
+
+       // Update username for this connection
+       snprintf(conn->username, sizeof(conn->username), "%s", new_username);
 
-   writer_lock_func();
+       chat_unlock(&dm_lock);
 
-   // Remove user from all rooms
-   struct room_node *r = rooms;
-   while(r != NULL) {
-       removeUserFromRoom(r, username);
-       r = r->next;
+       // Back into the rooms and DMs this name had before a restart
+       snapshot_restore_user(new_username);
+
+       snprintf(buffer, sizeof(buffer), "Logged in as '%s'.\nchat>", new_username);
+       reply(conn, buffer);
+   }
+   else if (strcmp(arguments[0], "help") == 0 )
+   {
+       stats_add(STAT_CMD_HELP, 1);
+       strcpy(buffer, "Available commands:\n");
+       strcat(buffer, "login <username> - \"login with username\"\n");
+       strcat(buffer, "create <room> - \"create a room\"\n");
+       strcat(buffer, "join <room> - \"join a room\"\n");
+       strcat(buffer, "leave <room> - \"leave a room\"\n");
+       strcat(buffer, "users - \"list all users\"\n");
+       strcat(buffer, "rooms -  \"list all rooms\"\n");
+       strcat(buffer, "connect <user> - \"connect to user (DM)\"\n");
+       strcat(buffer, "disconnect <user> - \"disconnect from user (DM)\"\n");
+       strcat(buffer, "locks - \"show lock contention counters\"\n");
+       strcat(buffer, "queues - \"show outbound queue counters\"\n");
+       strcat(buffer, "stats - \"show server metrics\"\n");
+       strcat(buffer, "binary - \"switch to length-prefixed binary frames\"\n");
+       strcat(buffer, "exit or logout - \"exit chat\"\n");
+       strcat(buffer, "chat>");
+       reply(conn, buffer); // Send back to client
+   }
+   else if (strcmp(arguments[0], "locks") == 0)
+   {
+       stats_add(STAT_CMD_ADMIN, 1);
+       // One line per lock: name, acquisitions, contended acquisitions, microseconds waited
+       char *report = malloc(LOCK_REPORT_SIZE);
+       if(report == NULL) {
+           reply(conn, "Out of memory.\nchat>");
+           return 0;
+       }
+       strcpy(report, "Locks (name acquisitions contended wait_us):\n");
+       chat_lock_report(report, LOCK_REPORT_SIZE - sizeof("chat>"));
+       strcat(report, "chat>");
+       reply(conn, report);
+       free(report);
+   }
+   else if (strcmp(arguments[0], "queues") == 0)
+   {
+       stats_add(STAT_CMD_ADMIN, 1);
+       strcpy(buffer, "Outbound queues:\n");
+       send_queue_report(buffer, MAXBUFF - sizeof("chat>"));
+       strcat(buffer, "chat>");
+       reply(conn, buffer);
+   }
+   else if (strcmp(arguments[0], "stats") == 0)
+   {
+       stats_add(STAT_CMD_ADMIN, 1);
+       // Metrics in Prometheus text format, the same as the -u socket serves
+       char *report = malloc(STATS_REPORT_SIZE);
+       if(report == NULL) {
+           reply(conn, "Out of memory.\nchat>");
+           return 0;
+       }
+       report[0] = '\0';
+       stats_report(report, STATS_REPORT_SIZE - sizeof("chat>"));
+       strcat(report, "chat>");
+       reply(conn, report);
+       free(report);
+   }
+   else if (strcmp(arguments[0], "binary") == 0)
+   {
+       stats_add(STAT_CMD_BINARY, 1);
+       // Everything after this reply is framed in both directions
+       reply(conn, "Binary framing enabled.\n");
+       conn->binary = true;
+       send_queue_set_framed(client, true);
+   }
+   else if (strcmp(arguments[0], "exit") == 0 || strcmp(arguments[0], "logout") == 0)
+   {
+       stats_add(STAT_CMD_EXIT, 1);
+       // The caller removes the user from all rooms and direct connections and closes the socket
+       return 1;
    }
 
-   // Disconnect from all DM connections
-   struct node *current_dm = head;
-   while(current_dm != NULL) {
-       if(strcmp(current_dm->username, username) != 0 && areConnected(head, username, current_dm->username)) {
-           disconnectUsers(head, username, current_dm->username);
+   return 0;
+}
+
+// Queue a message for one recipient in the encoding it negotiated; the
+// framed copy is built on first use and shared like the text one
+static void deliver(int socket, struct chat_msg *msg, struct chat_msg **framed) {
+   if(send_queue_framed(socket)) {
+       if(*framed == NULL) {
+           *framed = frame_text(OP_CHAT, msg->data, msg->len);
        }
-       current_dm = current_dm->next;
+       send_queue_push_msg(socket, *framed);
+   } else {
+       send_queue_push_msg(socket, msg);
    }
+}
 
-   // Remove user from user list
-   head = deleteU(head, username);
+// Send text to everyone in the sender's rooms and DM connections. The
+// caller has already charged it to the sender's rate limit.
+static void broadcast_message(struct client_conn *conn, const char *text) {
+        int client = conn->socket;
+        struct user_node *currentUser;
+        struct chat_msg *framed = NULL;
+        uint64_t fanout = 0;
+        bool room_throttled = false;
+        uint64_t now = monotonic_ns();
+
+        // Format the message once; every recipient queue shares it
+        struct chat_msg *msg = chat_msg_printf("::%s> %s\nchat>", conn->username, text);
+        size_t history_len = msg->len - strlen("chat>"); // Replays end with one prompt of their own
+
+        // Rooms are only read here, so broadcasts in any rooms run in parallel.
+        // Pushes that must wait for a slow reader wait after the locks go.
+        currentUser = conn->user;
+        send_queue_batch_begin();
+        chat_rdlock(&rooms_lock);
+
+        // Send to all users in the rooms the sender joined
+        struct room_link *link = currentUser != NULL ? currentUser->rooms_joined : NULL;
+        while(link != NULL) {
+            struct room_node *r = link->room;
+            // A room over its rate is skipped; the sender's other rooms and DMs still get the message
+            if(!rate_allow(&room_rate, &r->limit, now)) {
+                stats_add(STAT_THROTTLED_ROOM, 1);
+                room_throttled = true;
+                link = link->next;
+                continue;
+            }
+            chat_rdlock(&r->lock);
+            history_append(&r->history, msg->data, history_len);
+            struct room_link *member = r->members;
+            while(member != NULL) {
+                int recipient = member->user->socket;
+                if(recipient != client) { // Don't send to self
+                    deliver(recipient, msg, &framed);
+                    fanout++;
+                }
+                member = member->next_member;
+            }
+            chat_unlock(&r->lock);
+            shard_relay(name_str(r->name), msg->data, msg->len);
+            link = link->next;
+        }
+        chat_unlock(&rooms_lock);
+
+        // Send to all DM connections
+        if(currentUser != NULL) {
+            chat_rdlock(&dm_lock);
+            for(uint32_t k = 0; k < currentUser->dms.count; k++) {
+                deliver(currentUser->dms.peers[k].user->socket, msg, &framed);
+                fanout++;
+            }
+            chat_unlock(&dm_lock);
+        }
+        send_queue_batch_end();
+
+        if(room_throttled) {
+            reply(conn, "Some rooms are over their message rate; not delivered there.\nchat>");
+        }
+
+        stats_add(STAT_MESSAGES, 1);
+        stats_add(STAT_DELIVERIES, fanout);
+        stats_observe(STAT_HIST_FANOUT, fanout);
+
+        chat_msg_release(msg);
+        if(framed != NULL) {
+            chat_msg_release(framed);
+        }
+}
 
-   writer_unlock_func();
+bool relay_deliver(const char *room, const char *data, size_t len) {
+   struct chat_msg *framed = NULL;
+   uint64_t fanout = 0;
+
+   send_queue_batch_begin();
+   chat_rdlock(&rooms_lock);
+   struct room_node *r = findRoom(rooms, (char *) room);
+   if(r == NULL) {
+       chat_unlock(&rooms_lock);
+       send_queue_batch_end();
+       return false;
+   }
 
-   // Close socket
-   close(client);
-   printf("User '%s' has disconnected.\n", username);
-   return NULL;
+   struct chat_msg *msg = chat_msg_new(data, len);
+   chat_rdlock(&r->lock);
+   if(r->members != NULL) {
+       history_append(&r->history, msg->data, len - strlen("chat>"));
+   }
+   for(struct room_link *member = r->members; member != NULL; member = member->next_member) {
+       deliver(member->user->socket, msg, &framed);
+       fanout++;
+   }
+   chat_unlock(&r->lock);
+   chat_unlock(&rooms_lock);
+   send_queue_batch_end();
+
+   stats_add(STAT_DELIVERIES, fanout);
+   chat_msg_release(msg);
+   if(framed != NULL) {
+       chat_msg_release(framed);
+   }
+   return fanout > 0;
+}
+
+void notify_clients(const char *text) {
+   struct chat_msg *msg = chat_msg_new(text, strlen(text));
+   struct chat_msg *framed = NULL;
+
+   send_queue_batch_begin();
+   chat_rdlock(&users_lock);
+   for(struct user_node *user = head; user != NULL; user = user->next) {
+       deliver(user->socket, msg, &framed);
+   }
+   chat_unlock(&users_lock);
+   send_queue_batch_end();
+
+   chat_msg_release(msg);
+   if(framed != NULL) {
+       chat_msg_release(framed);
+   }
+}
+
+// The front ends see EOF and close each connection the usual way
+void hangup_clients(void) {
+   chat_rdlock(&users_lock);
+   for(struct user_node *user = head; user != NULL; user = user->next) {
+       shutdown(user->socket, SHUT_RDWR);
+   }
+   chat_unlock(&users_lock);
+}
+
+int clients_active(void) {
+   return atomic_load(&active_clients);
+}
+
+bool client_admit(int socket) {
+   if(max_clients == 0 || atomic_load(&active_clients) < max_clients) {
+      return true;
+   }
+
+   // Turned away before it costs a registry entry: one best-effort write
+   if(send(socket, BUSY_REPLY, strlen(BUSY_REPLY), MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+      chat_log(CHAT_LOG_DEBUG, "Busy reply: %s", strerror(errno));
+   }
+   close(socket);
+   stats_add(STAT_CONN_SHED, 1);
+   chat_log(CHAT_LOG_DEBUG, "Connection shed at %d open", max_clients);
+   return false;
 }
@@ -0,0 +1,206 @@
+#include "server.h"
+#include "shard.h"
+#include <errno.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+int shard_count = 0;
+int shard_id = 0;
+
+// The shared mapping: directory, then rings[from * shard_count + to]
+struct shard_shm {
+    _Atomic uint32_t rooms_created; // Lets shards skip import scans when nothing changed
+    struct shard_room rooms[SHARD_ROOM_SLOTS];
+    struct relay_ring rings[];
+};
+
+static struct shard_shm *shm;
+static int wake_fds[SHARD_MAX]; // eventfds inherited from the supervisor, one per shard
+static uint32_t rooms_imported;  // This shard's last view of rooms_created
+
+int shard_init(int count) {
+    if (count < 1 || count > SHARD_MAX) {
+        fprintf(stderr, "Shard count must be between 1 and %d\n", SHARD_MAX);
+        return -1;
+    }
+
+    // Pages are touched lazily, so idle rings cost address space only
+    size_t size = sizeof(struct shard_shm) + (size_t) count * count * sizeof(struct relay_ring);
+    shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shm == MAP_FAILED) {
+        perror("Failed to map shard state");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        wake_fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fds[i] == -1) {
+            perror("eventfd");
+            return -1;
+        }
+    }
+    shard_count = count;
+    return 0;
+}
+
+// Every worker keeps all the eventfds: it reads its own and writes the others
+void shard_attach(int id) {
+    shard_id = id;
+}
+
+// Find name in the directory, claiming a slot for it if create is set.
+// Slots are never freed, so a probe stops at the first empty one.
+static struct shard_room *directory_probe(const char *name, bool create) {
+    uint32_t hash = hashName(name);
+
+    for (uint32_t i = 0; i < SHARD_ROOM_SLOTS; i++) {
+        struct shard_room *slot = &shm->rooms[(hash + i) & (SHARD_ROOM_SLOTS - 1)];
+        uint32_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+
+        if (state == SHARD_SLOT_EMPTY) {
+            if (!create) {
+                return NULL;
+            }
+            if (atomic_compare_exchange_strong(&slot->state, &state, SHARD_SLOT_CLAIMED)) {
+                slot->hash = hash;
+                snprintf(slot->name, sizeof(slot->name), "%s", name);
+                atomic_store_explicit(&slot->state, SHARD_SLOT_READY, memory_order_release);
+                atomic_fetch_add(&shm->rooms_created, 1);
+                return slot;
+            }
+        }
+        // Another shard is writing this slot's name; it only takes a moment
+        while (state == SHARD_SLOT_CLAIMED) {
+            sched_yield();
+            state = atomic_load_explicit(&slot->state, memory_order_acquire);
+        }
+        if (state == SHARD_SLOT_READY && slot->hash == hash && strcmp(slot->name, name) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+void shard_room_add(const char *name) {
+    if (shard_count == 0) {
+        return;
+    }
+    if (directory_probe(name, true) == NULL) {
+        chat_log(CHAT_LOG_WARN, "Room directory full; '%s' stays local to shard %d", name, shard_id);
+    }
+}
+
+void shard_room_join(const char *name) {
+    if (shard_count == 0) {
+        return;
+    }
+    struct shard_room *room = directory_probe(name, false);
+    if (room != NULL) {
+        atomic_fetch_or(&room->members, 1ULL << shard_id);
+    }
+}
+
+void shard_import_rooms(void) {
+    if (shard_count == 0) {
+        return;
+    }
+    uint32_t created = atomic_load(&shm->rooms_created);
+    if (created == rooms_imported) {
+        return;
+    }
+    rooms_imported = created;
+
+    for (int i = 0; i < SHARD_ROOM_SLOTS; i++) {
+        struct shard_room *slot = &shm->rooms[i];
+        if (atomic_load_explicit(&slot->state, memory_order_acquire) == SHARD_SLOT_READY &&
+            findRoom(rooms, slot->name) == NULL) {
+            rooms = addRoom(rooms, slot->name);
+        }
+    }
+}
+
+static struct relay_ring *ring(int from, int to) {
+    return &shm->rings[from * shard_count + to];
+}
+
+void shard_relay(const char *room, const char *data, size_t len) {
+    if (shard_count == 0) {
+        return;
+    }
+    struct shard_room *entry = directory_probe(room, false);
+    if (entry == NULL) {
+        return;
+    }
+    if (len > RELAY_MSG_MAX) {
+        stats_add(STAT_RELAY_DROPPED, 1);
+        return;
+    }
+
+    uint64_t targets = atomic_load_explicit(&entry->members, memory_order_relaxed) & ~(1ULL << shard_id);
+    while (targets != 0) {
+        int to = __builtin_ctzll(targets);
+        targets &= targets - 1;
+
+        // This shard's loop thread is the ring's only producer
+        struct relay_ring *r = ring(shard_id, to);
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        if (tail - atomic_load(&r->head) == RELAY_SLOTS) {
+            stats_add(STAT_RELAY_DROPPED, 1);
+            continue;
+        }
+        struct relay_slot *slot = &r->slots[tail & (RELAY_SLOTS - 1)];
+        snprintf(slot->room, sizeof(slot->room), "%s", room);
+        slot->len = len;
+        memcpy(slot->data, data, len);
+        atomic_store(&r->tail, tail + 1);
+        stats_add(STAT_RELAYED, 1);
+
+        // The consumer rechecks tail after publishing head, so it only
+        // needs waking when it had caught up with everything before this
+        if (atomic_load(&r->head) == tail) {
+            uint64_t one = 1;
+            if (write(wake_fds[to], &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                chat_log(CHAT_LOG_ERROR, "Shard wake write: %s", strerror(errno));
+            }
+        }
+    }
+}
+
+int shard_wake_fd(void) {
+    return shard_count > 0 ? wake_fds[shard_id] : -1;
+}
+
+void shard_relay_drain(void) {
+    uint64_t count;
+    bool progress = true;
+
+    if (read(wake_fds[shard_id], &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        chat_log(CHAT_LOG_ERROR, "Shard wake read: %s", strerror(errno));
+    }
+
+    while (progress) {
+        progress = false;
+        for (int from = 0; from < shard_count; from++) {
+            if (from == shard_id) {
+                continue;
+            }
+            struct relay_ring *r = ring(from, shard_id);
+            uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+            uint64_t tail = atomic_load(&r->tail);
+            while (head != tail) {
+                struct relay_slot *slot = &r->slots[head & (RELAY_SLOTS - 1)];
+                // Nobody here is in the room any more: stop receiving it
+                if (!relay_deliver(slot->room, slot->data, slot->len)) {
+                    struct shard_room *entry = directory_probe(slot->room, false);
+                    if (entry != NULL) {
+                        atomic_fetch_and(&entry->members, ~(1ULL << shard_id));
+                    }
+                }
+                head++;
+                atomic_store(&r->head, head);
+                tail = atomic_load(&r->tail);
+                progress = true;
+            }
+        }
+    }
+}
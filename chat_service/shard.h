@@ -0,0 +1,78 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Multi-process mode: a supervisor forks one worker process per shard and
+// every worker runs a single epoll loop with its own SO_REUSEPORT
+// listener, so the kernel spreads connections across shards. Each worker
+// keeps its own registries and locks; what they share lives in one
+// MAP_SHARED mapping set up before the fork:
+//
+//   - a room directory, an open-addressing hash of room names where every
+//     room records which shards have local members (one bit per shard);
+//   - one single-producer/single-consumer ring per ordered shard pair,
+//     carrying room broadcasts to the shards that need them.
+//
+// Only rooms span shards. Users, DMs and the user list are per shard.
+#define SHARD_MAX 64               // Shards fit the directory's member bitmask
+#define SHARD_ROOM_SLOTS 4096      // Directory capacity (power of two); rooms are never removed
+#define RELAY_SLOTS 64             // Messages in flight per shard pair (power of two)
+#define RELAY_MSG_MAX 4352         // A full input line plus the sender prefix
+
+enum shard_slot_state {
+    SHARD_SLOT_EMPTY,
+    SHARD_SLOT_CLAIMED, // Name being written by the shard that claimed it
+    SHARD_SLOT_READY
+};
+
+struct shard_room {
+    _Atomic uint32_t state;        // enum shard_slot_state
+    uint32_t hash;
+    char name[30];
+    _Atomic uint64_t members;      // Bit n: shard n has local members
+};
+
+struct relay_slot {
+    char room[30];
+    uint16_t len;
+    char data[RELAY_MSG_MAX];
+};
+
+// head and tail count slots ever consumed and produced; each sits on its own cache line
+struct relay_ring {
+    _Atomic uint64_t head;
+    char pad1[56];
+    _Atomic uint64_t tail;
+    char pad2[56];
+    struct relay_slot slots[RELAY_SLOTS];
+};
+
+extern int shard_count; // 0 unless running sharded
+extern int shard_id;
+
+// Supervisor, before forking: map the shared state for count shards
+int shard_init(int count);
+
+// Worker, right after the fork
+void shard_attach(int id);
+
+// Directory upkeep, called by the registries. No-ops when not sharded.
+void shard_room_add(const char *name);
+void shard_room_join(const char *name);
+
+// Add local copies of rooms created on other shards. Caller holds
+// rooms_lock for writing.
+void shard_import_rooms(void);
+
+// Send a formatted room message to every other shard with members in room
+void shard_relay(const char *room, const char *data, size_t len);
+
+// Readable when other shards have relayed messages; drain them with shard_relay_drain
+int shard_wake_fd(void);
+void shard_relay_drain(void);
+
+#endif // SHARD_H
@@ -0,0 +1,407 @@
+#include "server.h"
+#include "snapshot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static const char *snapshot_path = NULL;
+static int snapshot_interval = SNAPSHOT_DEFAULT_INTERVAL;
+
+// The loaded snapshot stays mapped; its strings key saved_users
+static const struct snapshot_header *loaded = NULL;
+static const uint32_t *loaded_rooms;
+static const struct snapshot_user *loaded_users;
+static const uint32_t *loaded_refs;
+static const char *loaded_strings;
+static uint32_t *saved_users;         // loaded_users indexes sorted by name, read-only after load
+static atomic_bool *restored;         // Per saved user: memberships already replayed
+
+// An interned name and its index in the snapshot being written
+struct name_ref {
+    uint32_t name;
+    uint32_t index;
+};
+
+static int compare_name_refs(const void *a, const void *b) {
+    uint32_t x = ((const struct name_ref *) a)->name, y = ((const struct name_ref *) b)->name;
+    return (x > y) - (x < y);
+}
+
+// Index of name in refs sorted by name, or -1
+static long find_name_ref(const struct name_ref *refs, uint32_t count, uint32_t name) {
+    struct name_ref key = { name, 0 };
+    const struct name_ref *found = bsearch(&key, refs, count, sizeof(key), compare_name_refs);
+    return found != NULL ? (long) found->index : -1;
+}
+
+// Saved users by name; a name saved twice keeps its first entry first
+static int compare_saved_users(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    int order = strcmp(loaded_strings + loaded_users[x].name, loaded_strings + loaded_users[y].name);
+    return order != 0 ? order : (x > y) - (x < y);
+}
+
+// The first user saved under name, or NULL
+static const struct snapshot_user *find_saved_user(const char *name) {
+    uint32_t lo = 0, hi = loaded->user_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(loaded_strings + loaded_users[saved_users[mid]].name, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == loaded->user_count || strcmp(loaded_strings + loaded_users[saved_users[lo]].name, name) != 0) {
+        return NULL;
+    }
+    return &loaded_users[saved_users[lo]];
+}
+
+// Freeze the registries for a consistent copy: DM edits need dm_lock for
+// writing, membership changes need rooms_lock for reading, renames and
+// additions need users_lock for writing
+static void freeze_registries(void) {
+    chat_rdlock(&dm_lock);
+    chat_wrlock(&rooms_lock);
+    chat_rdlock(&users_lock);
+}
+
+static void thaw_registries(void) {
+    chat_unlock(&users_lock);
+    chat_unlock(&rooms_lock);
+    chat_unlock(&dm_lock);
+}
+
+static int write_file(const char *path, const char *data, size_t len) {
+    char tmp[PATH_MAX];
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+        return -1;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            unlink(tmp);
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    // Readers only ever see a complete snapshot
+    if (fsync(fd) == -1 || close(fd) == -1 || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Serialize the registries to path. The caller keeps them frozen. Safe in
+// a forked child: takes no locks and does not log.
+static int snapshot_write(const char *path) {
+    uint32_t room_count = 0, user_count = 0, ref_count = 0;
+    size_t strings_len = 0;
+
+    for (struct room_node *r = rooms; r != NULL; r = r->next) {
+        room_count++;
+        strings_len += strlen(name_str(r->name)) + 1;
+    }
+    for (struct user_node *u = head; u != NULL; u = u->next) {
+        user_count++;
+        strings_len += strlen(name_str(u->name)) + 1;
+        for (struct room_link *link = u->rooms_joined; link != NULL; link = link->next) {
+            ref_count++;
+        }
+        ref_count += u->dms.count;
+    }
+    strings_len = (strings_len + 3) & ~(size_t) 3;
+
+    size_t size = sizeof(struct snapshot_header) + room_count * sizeof(uint32_t) +
+                  user_count * sizeof(struct snapshot_user) + ref_count * sizeof(uint32_t) + strings_len;
+    char *buf = calloc(1, size);
+    // The interned names of rooms and users, sorted to find their indexes
+    struct name_ref *room_ids = malloc((room_count ? room_count : 1) * sizeof(struct name_ref));
+    struct name_ref *user_ids = malloc((user_count ? user_count : 1) * sizeof(struct name_ref));
+    if (buf == NULL || room_ids == NULL || user_ids == NULL) {
+        free(buf);
+        free(room_ids);
+        free(user_ids);
+        return -1;
+    }
+
+    struct snapshot_header *hdr = (struct snapshot_header *) buf;
+    uint32_t *room_names = (uint32_t *) (hdr + 1);
+    struct snapshot_user *users = (struct snapshot_user *) (room_names + room_count);
+    uint32_t *refs = (uint32_t *) (users + user_count);
+    char *strings = (char *) (refs + ref_count);
+
+    memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+    hdr->version = SNAPSHOT_VERSION;
+    hdr->room_count = room_count;
+    hdr->user_count = user_count;
+    hdr->ref_count = ref_count;
+    hdr->strings_len = strings_len;
+
+    size_t offset = 0;
+    uint32_t i = 0;
+
+    for (struct room_node *r = rooms; r != NULL; r = r->next, i++) {
+        room_names[i] = offset;
+        strcpy(strings + offset, name_str(r->name));
+        room_ids[i] = (struct name_ref) { r->name, i };
+        offset += strlen(name_str(r->name)) + 1;
+    }
+    i = 0;
+    for (struct user_node *u = head; u != NULL; u = u->next, i++) {
+        users[i].name = offset;
+        strcpy(strings + offset, name_str(u->name));
+        user_ids[i] = (struct name_ref) { u->name, i };
+        offset += strlen(name_str(u->name)) + 1;
+    }
+    qsort(room_ids, room_count, sizeof(struct name_ref), compare_name_refs);
+    qsort(user_ids, user_count, sizeof(struct name_ref), compare_name_refs);
+
+    uint32_t ref = 0;
+    i = 0;
+    for (struct user_node *u = head; u != NULL; u = u->next, i++) {
+        users[i].first_ref = ref;
+        for (struct room_link *link = u->rooms_joined; link != NULL; link = link->next) {
+            long index = find_name_ref(room_ids, room_count, link->room->name);
+            if (index >= 0) {
+                refs[ref++] = index;
+                users[i].rooms++;
+            }
+        }
+        for (uint32_t k = 0; k < u->dms.count; k++) {
+            long index = find_name_ref(user_ids, user_count, u->dms.peers[k].user->name);
+            if (index >= 0) {
+                refs[ref++] = index;
+                users[i].peers++;
+            }
+        }
+    }
+    free(room_ids);
+    free(user_ids);
+
+    int status = write_file(path, buf, size);
+    free(buf);
+    return status;
+}
+
+int snapshot_save(void) {
+    if (snapshot_path == NULL) {
+        return 0;
+    }
+
+    freeze_registries();
+    int status = snapshot_write(snapshot_path);
+    thaw_registries();
+
+    if (status == -1) {
+        chat_log(CHAT_LOG_ERROR, "Snapshot to %s failed: %s", snapshot_path, strerror(errno));
+    }
+    return status;
+}
+
+// Fork with the registries frozen; the child serializes its copy-on-write
+// view while the parent resumes serving
+static void snapshot_fork(void) {
+    freeze_registries();
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(snapshot_write(snapshot_path) == 0 ? 0 : 1);
+    }
+    thaw_registries();
+
+    if (pid == -1) {
+        chat_log(CHAT_LOG_ERROR, "Snapshot fork: %s", strerror(errno));
+        return;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        chat_log(CHAT_LOG_ERROR, "Snapshot to %s failed", snapshot_path);
+    }
+}
+
+static void *snapshot_thread(void *arg) {
+    while (1) {
+        sleep(snapshot_interval);
+        snapshot_fork();
+    }
+    return NULL;
+}
+
+int snapshot_start(const char *path, int interval) {
+    pthread_t thread;
+
+    snapshot_path = path;
+    snapshot_interval = interval;
+    if (interval <= 0) {
+        return 0; // Only written at shutdown
+    }
+    if (pthread_create(&thread, NULL, snapshot_thread, NULL) != 0) {
+        perror("Snapshot thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Every offset and index in the mapping must stay inside it
+static bool snapshot_valid(const char *map, size_t size) {
+    const struct snapshot_header *hdr = (const struct snapshot_header *) map;
+
+    if (size < sizeof(*hdr) || memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != SNAPSHOT_VERSION) {
+        return false;
+    }
+    uint64_t expect = sizeof(*hdr) + (uint64_t) hdr->room_count * sizeof(uint32_t) +
+                      (uint64_t) hdr->user_count * sizeof(struct snapshot_user) +
+                      (uint64_t) hdr->ref_count * sizeof(uint32_t) + hdr->strings_len;
+    if (expect != size) {
+        return false;
+    }
+
+    const uint32_t *room_names = (const uint32_t *) (hdr + 1);
+    const struct snapshot_user *users = (const struct snapshot_user *) (room_names + hdr->room_count);
+    const uint32_t *refs = (const uint32_t *) (users + hdr->user_count);
+    const char *strings = (const char *) (refs + hdr->ref_count);
+
+    // Names must be NUL-terminated inside the table and fit a node's name field
+    for (uint32_t i = 0; i < hdr->room_count + hdr->user_count; i++) {
+        uint32_t name = i < hdr->room_count ? room_names[i] : users[i - hdr->room_count].name;
+        if (name >= hdr->strings_len ||
+            strnlen(strings + name, hdr->strings_len - name) >= NAME_LEN) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < hdr->user_count; i++) {
+        const struct snapshot_user *u = &users[i];
+        if ((uint64_t) u->first_ref + u->rooms + u->peers > hdr->ref_count) {
+            return false;
+        }
+        for (uint32_t j = 0; j < u->rooms + u->peers; j++) {
+            if (refs[u->first_ref + j] >= (j < u->rooms ? hdr->room_count : hdr->user_count)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int snapshot_load(const char *path) {
+    struct timespec start, end;
+    struct stat st;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror("Snapshot open");
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Snapshot mmap");
+        return -1;
+    }
+    if (!snapshot_valid(map, st.st_size)) {
+        fprintf(stderr, "Ignoring corrupt snapshot %s\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    loaded = (const struct snapshot_header *) map;
+    loaded_rooms = (const uint32_t *) (loaded + 1);
+    loaded_users = (const struct snapshot_user *) (loaded_rooms + loaded->room_count);
+    loaded_refs = (const uint32_t *) (loaded_users + loaded->user_count);
+    loaded_strings = (const char *) (loaded_refs + loaded->ref_count);
+    restored = calloc(loaded->user_count ? loaded->user_count : 1, sizeof(atomic_bool));
+    saved_users = malloc((loaded->user_count ? loaded->user_count : 1) * sizeof(uint32_t));
+    if (restored == NULL || saved_users == NULL) {
+        perror("Snapshot restore flags");
+        exit(EXIT_FAILURE);
+    }
+
+    // The list is saved head first; adding tail first keeps its order
+    chat_wrlock(&rooms_lock);
+    for (uint32_t i = loaded->room_count; i-- > 0;) {
+        char *name = (char *) loaded_strings + loaded_rooms[i];
+        if (findRoom(rooms, name) == NULL) {
+            rooms = addRoom(rooms, name);
+        }
+    }
+    chat_unlock(&rooms_lock);
+
+    for (uint32_t i = 0; i < loaded->user_count; i++) {
+        saved_users[i] = i;
+    }
+    qsort(saved_users, loaded->user_count, sizeof(uint32_t), compare_saved_users);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    chat_log(CHAT_LOG_INFO, "Loaded snapshot %s: %u rooms, %u users in %.3f ms", path,
+             loaded->room_count, loaded->user_count,
+             (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+}
+
+void snapshot_restore_user(const char *username) {
+    if (loaded == NULL) {
+        return;
+    }
+    const struct snapshot_user *saved = find_saved_user(username);
+    if (saved == NULL || atomic_exchange(&restored[saved - loaded_users], true)) {
+        return;
+    }
+    const uint32_t *refs = loaded_refs + saved->first_ref;
+
+    chat_rdlock(&rooms_lock);
+    int shard = userShard(username);
+    chat_rdlock(&user_shard_locks[shard]);
+    struct user_node *user = findUser(head, (char *) username);
+    chat_unlock(&user_shard_locks[shard]);
+    for (uint32_t i = 0; user != NULL && i < saved->rooms; i++) {
+        struct room_node *room = findRoom(rooms, (char *) loaded_strings + loaded_rooms[refs[i]]);
+        if (room != NULL) {
+            chat_wrlock(&room->lock);
+            if (!isUserInRoom(room, user)) {
+                addUserToRoom(room, user);
+            }
+            chat_unlock(&room->lock);
+        }
+    }
+    chat_unlock(&rooms_lock);
+
+    // Edges to peers still away come back when they log in
+    chat_wrlock(&dm_lock);
+    for (uint32_t i = saved->rooms; i < saved->rooms + saved->peers; i++) {
+        char *peer = (char *) loaded_strings + loaded_users[refs[i]].name;
+        int peer_shard = userShard(peer);
+        lock_user_shards(shard, peer_shard, false);
+        connectUsersDM(head, (char *) username, peer);
+        unlock_user_shards(shard, peer_shard);
+    }
+    chat_unlock(&dm_lock);
+}
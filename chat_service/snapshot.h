@@ -0,0 +1,53 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+// Binary snapshot of the room list, room memberships and DM graph.
+//
+// Layout (host byte order, every section 4-byte aligned):
+//   struct snapshot_header
+//   uint32_t room_names[room_count]      offsets into the string table
+//   struct snapshot_user users[user_count]
+//   uint32_t refs[ref_count]             per user: room indexes, then peer user indexes
+//   char strings[strings_len]            NUL-terminated names
+//
+// Rooms are recreated when the snapshot is loaded. Users only exist while
+// connected, so a saved user's memberships and DM edges are restored when
+// someone next logs in under that name (an edge once both ends are back).
+#define SNAPSHOT_MAGIC "CHATSNP1"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_DEFAULT_INTERVAL 30 // Seconds between periodic snapshots
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t room_count;
+    uint32_t user_count;
+    uint32_t ref_count;
+    uint32_t strings_len;
+    uint32_t reserved;
+};
+
+struct snapshot_user {
+    uint32_t name;
+    uint32_t first_ref;
+    uint32_t rooms;
+    uint32_t peers;
+};
+
+// Map the snapshot at path and recreate its rooms. A missing file is not
+// an error. Call before any client connects.
+int snapshot_load(const char *path);
+
+// Write a snapshot every interval seconds from a fork()ed copy of the
+// registries; the server is only paused for the fork itself
+int snapshot_start(const char *path, int interval);
+
+// Write a snapshot now, from the calling thread (used at shutdown)
+int snapshot_save(void);
+
+// Rejoin the rooms and DM peers saved for username, once per saved user
+void snapshot_restore_user(const char *username);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,311 @@
+#include "stats.h"
+#include "log.h"
+#include "chat_lock.h"
+#include "pool.h"
+#include "send_queue.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// One thread's metrics. Only the owning thread writes a live shard, so
+// updates are a relaxed load and store rather than a locked add.
+struct stats_shard {
+    _Atomic uint64_t counters[STAT_COUNTERS];
+    _Atomic uint64_t buckets[STAT_HISTS][STATS_BUCKETS];
+    _Atomic uint64_t sums[STAT_HISTS];
+    struct stats_shard *next;
+    struct stats_shard *prev;
+};
+
+static const char *const command_labels[] = {
+    "create", "join", "leave", "connect", "disconnect", "rooms", "users",
+    "login", "help", "admin", "binary", "exit", "bad"
+};
+
+static const char *const hist_names[STAT_HISTS] = { "chat_fanout", "chat_lock_wait_us" };
+
+// Guards the shard list and the retired totals
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_shard *shards = NULL;
+static struct stats_shard retired;
+
+static __thread struct stats_shard *local;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+static void bump(_Atomic uint64_t *cell, uint64_t n) {
+    atomic_store_explicit(cell, atomic_load_explicit(cell, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static uint64_t read_cell(_Atomic uint64_t *cell) {
+    return atomic_load_explicit(cell, memory_order_relaxed);
+}
+
+// Fold an exiting thread's shard into the retired totals
+static void shard_retire(void *ptr) {
+    struct stats_shard *shard = ptr;
+
+    pthread_mutex_lock(&shards_mutex);
+    if (shard->prev == NULL) {
+        shards = shard->next;
+    } else {
+        shard->prev->next = shard->next;
+    }
+    if (shard->next != NULL) {
+        shard->next->prev = shard->prev;
+    }
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        bump(&retired.counters[i], read_cell(&shard->counters[i]));
+    }
+    for (int h = 0; h < STAT_HISTS; h++) {
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            bump(&retired.buckets[h][b], read_cell(&shard->buckets[h][b]));
+        }
+        bump(&retired.sums[h], read_cell(&shard->sums[h]));
+    }
+    pthread_mutex_unlock(&shards_mutex);
+
+    local = NULL;
+    free(shard);
+}
+
+static void shard_key_create(void) {
+    pthread_key_create(&shard_key, shard_retire);
+}
+
+static struct stats_shard *local_shard(void) {
+    if (local != NULL) {
+        return local;
+    }
+
+    struct stats_shard *shard = calloc(1, sizeof(struct stats_shard));
+    if (shard == NULL) {
+        perror("Failed to allocate stats shard");
+        exit(EXIT_FAILURE);
+    }
+    pthread_once(&shard_key_once, shard_key_create);
+    pthread_setspecific(shard_key, shard);
+
+    pthread_mutex_lock(&shards_mutex);
+    shard->prev = NULL;
+    shard->next = shards;
+    if (shards != NULL) {
+        shards->prev = shard;
+    }
+    shards = shard;
+    pthread_mutex_unlock(&shards_mutex);
+
+    local = shard;
+    return shard;
+}
+
+void stats_add(enum stat_counter counter, uint64_t n) {
+    bump(&local_shard()->counters[counter], n);
+}
+
+void stats_observe(enum stat_hist hist, uint64_t value) {
+    struct stats_shard *shard = local_shard();
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+    bump(&shard->buckets[hist][bucket], 1);
+    bump(&shard->sums[hist], value);
+}
+
+// Sum of the retired totals and every live shard, taken under shards_mutex
+static void stats_collect(struct stats_shard *total) {
+    memset(total, 0, sizeof(*total));
+
+    pthread_mutex_lock(&shards_mutex);
+    for (struct stats_shard *shard = &retired; shard != NULL; shard = shard == &retired ? shards : shard->next) {
+        for (int i = 0; i < STAT_COUNTERS; i++) {
+            bump(&total->counters[i], read_cell(&shard->counters[i]));
+        }
+        for (int h = 0; h < STAT_HISTS; h++) {
+            for (int b = 0; b < STATS_BUCKETS; b++) {
+                bump(&total->buckets[h][b], read_cell(&shard->buckets[h][b]));
+            }
+            bump(&total->sums[h], read_cell(&shard->sums[h]));
+        }
+    }
+    pthread_mutex_unlock(&shards_mutex);
+}
+
+uint64_t stats_total(enum stat_counter counter) {
+    uint64_t sum;
+
+    pthread_mutex_lock(&shards_mutex);
+    sum = read_cell(&retired.counters[counter]);
+    for (struct stats_shard *shard = shards; shard != NULL; shard = shard->next) {
+        sum += read_cell(&shard->counters[counter]);
+    }
+    pthread_mutex_unlock(&shards_mutex);
+    return sum;
+}
+
+// Append one formatted line, dropping it whole when it doesn't fit
+static int append(char *buffer, size_t size, size_t *len, const char *fmt, ...) {
+    va_list ap;
+
+    if (*len >= size) {
+        return -1;
+    }
+    va_start(ap, fmt);
+    int n = vsnprintf(buffer + *len, size - *len, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t) n >= size - *len) {
+        buffer[*len] = '\0';
+        return -1;
+    }
+    *len += n;
+    return 0;
+}
+
+void stats_report(char *buffer, size_t size) {
+    struct stats_shard *total = malloc(sizeof(struct stats_shard));
+    size_t len = strlen(buffer);
+
+    if (total == NULL) {
+        return;
+    }
+    stats_collect(total);
+
+    uint64_t opened = read_cell(&total->counters[STAT_CONN_OPENED]);
+    uint64_t closed = read_cell(&total->counters[STAT_CONN_CLOSED]);
+    append(buffer, size, &len, "chat_connections_opened_total %lu\n", (unsigned long) opened);
+    append(buffer, size, &len, "chat_connections_closed_total %lu\n", (unsigned long) closed);
+    append(buffer, size, &len, "chat_connections_active %lu\n", (unsigned long) (opened - closed));
+    append(buffer, size, &len, "chat_connections_shed_total %lu\n",
+           (unsigned long) read_cell(&total->counters[STAT_CONN_SHED]));
+    append(buffer, size, &len, "chat_bytes_in_total %lu\n",
+           (unsigned long) read_cell(&total->counters[STAT_BYTES_IN]));
+    append(buffer, size, &len, "chat_bytes_out_total %lu\n",
+           (unsigned long) read_cell(&total->counters[STAT_BYTES_OUT]));
+    append(buffer, size, &len, "chat_messages_total %lu\n",
+           (unsigned long) read_cell(&total->counters[STAT_MESSAGES]));
+    append(buffer, size, &len, "chat_deliveries_total %lu\n",
+           (unsigned long) read_cell(&total->counters[STAT_DELIVERIES]));
+    append(buffer, size, &len, "chat_log_dropped_total %lu\n",
+           (unsigned long) read_cell(&total->counters[STAT_LOG_DROPPED]));
+    append(buffer, size, &len, "chat_throttled_total{scope=\"connection\"} %lu\n",
+           (unsigned long) read_cell(&total->counters[STAT_THROTTLED_CONN]));
+    append(buffer, size, &len, "chat_throttled_total{scope=\"room\"} %lu\n",
+           (unsigned long) read_cell(&total->counters[STAT_THROTTLED_ROOM]));
+    append(buffer, size, &len, "chat_shard_relayed_total %lu\n",
+           (unsigned long) read_cell(&total->counters[STAT_RELAYED]));
+    append(buffer, size, &len, "chat_shard_relay_dropped_total %lu\n",
+           (unsigned long) read_cell(&total->counters[STAT_RELAY_DROPPED]));
+    for (int i = STAT_CMD_CREATE; i < STAT_COUNTERS; i++) {
+        append(buffer, size, &len, "chat_commands_total{command=\"%s\"} %lu\n",
+               command_labels[i - STAT_CMD_CREATE], (unsigned long) read_cell(&total->counters[i]));
+    }
+
+    // Cumulative buckets up to the highest one in use, then +Inf
+    for (int h = 0; h < STAT_HISTS; h++) {
+        int top = 0;
+        uint64_t count = 0;
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            if (read_cell(&total->buckets[h][b]) != 0) {
+                top = b;
+            }
+        }
+        for (int b = 0; b <= top && b < STATS_BUCKETS - 1; b++) {
+            count += read_cell(&total->buckets[h][b]);
+            append(buffer, size, &len, "%s_bucket{le=\"%lu\"} %lu\n", hist_names[h],
+                   (1UL << b) - 1, (unsigned long) count);
+        }
+        count = 0;
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            count += read_cell(&total->buckets[h][b]);
+        }
+        append(buffer, size, &len, "%s_bucket{le=\"+Inf\"} %lu\n", hist_names[h], (unsigned long) count);
+        append(buffer, size, &len, "%s_sum %lu\n", hist_names[h], (unsigned long) read_cell(&total->sums[h]));
+        append(buffer, size, &len, "%s_count %lu\n", hist_names[h], (unsigned long) count);
+    }
+    free(total);
+
+    send_queue_metrics(buffer, size);
+    pool_metrics(buffer, size);
+    chat_lock_metrics(buffer, size);
+}
+
+// Answer every connection with one report, then hang up
+static void *stats_server(void *arg) {
+    int fd = (int) (intptr_t) arg;
+    char *report = malloc(STATS_REPORT_SIZE);
+
+    if (report == NULL) {
+        perror("Failed to allocate stats report");
+        return NULL;
+    }
+    while (1) {
+        int client = accept(fd, NULL, NULL);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            chat_log(CHAT_LOG_ERROR, "Stats accept: %s", strerror(errno));
+            break;
+        }
+
+        report[0] = '\0';
+        stats_report(report, STATS_REPORT_SIZE);
+        size_t len = strlen(report), off = 0;
+        while (off < len) {
+            ssize_t n = send(client, report + off, len - off, MSG_NOSIGNAL);
+            if (n <= 0) {
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            off += n;
+        }
+        close(client);
+    }
+    free(report);
+    return NULL;
+}
+
+int stats_serve(const char *path) {
+    struct sockaddr_un addr;
+    pthread_t thread;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Stats socket path too long: %s\n", path);
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("Stats socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path); // A stale socket from an earlier run
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 8) == -1) {
+        perror("Stats bind");
+        close(fd);
+        return -1;
+    }
+
+    if (pthread_create(&thread, NULL, stats_server, (void *) (intptr_t) fd) != 0) {
+        perror("Stats thread");
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
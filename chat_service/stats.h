@@ -0,0 +1,64 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Runtime counters and histograms. Each thread updates its own shard with
+// plain relaxed stores (no shared cache lines, no atomic read-modify-write);
+// readers sum every shard when a report is asked for. Shards of exited
+// threads are folded into a retired total.
+enum stat_counter {
+    STAT_CONN_OPENED,
+    STAT_CONN_CLOSED,
+    STAT_CONN_SHED,       // Turned away by admission control
+    STAT_BYTES_IN,        // Read from client sockets
+    STAT_BYTES_OUT,       // Written to client sockets
+    STAT_MESSAGES,        // Chat messages broadcast
+    STAT_DELIVERIES,      // Recipient queues those messages were pushed to
+    STAT_LOG_DROPPED,     // Log records lost to a full ring
+    STAT_THROTTLED_CONN,  // Commands and messages refused by a connection's rate limit
+    STAT_THROTTLED_ROOM,  // Room fan-outs skipped by the room's rate limit
+    STAT_RELAYED,         // Room messages handed to other shards
+    STAT_RELAY_DROPPED,   // ...and lost to a full ring
+
+    // Commands by type, in the order stats_report names them
+    STAT_CMD_CREATE,
+    STAT_CMD_JOIN,
+    STAT_CMD_LEAVE,
+    STAT_CMD_CONNECT,
+    STAT_CMD_DISCONNECT,
+    STAT_CMD_ROOMS,
+    STAT_CMD_USERS,
+    STAT_CMD_LOGIN,
+    STAT_CMD_HELP,
+    STAT_CMD_ADMIN,       // locks, queues, stats
+    STAT_CMD_BINARY,
+    STAT_CMD_EXIT,
+    STAT_CMD_BAD,         // Unknown opcodes and malformed frames
+
+    STAT_COUNTERS
+};
+
+// Power-of-two bucketed histograms
+enum stat_hist {
+    STAT_HIST_FANOUT,     // Recipients per broadcast
+    STAT_HIST_LOCK_WAIT,  // Microseconds blocked on a contended chat_lock
+
+    STAT_HISTS
+};
+
+#define STATS_BUCKETS 32      // Bucket b holds values below 2^b; the last is open-ended
+#define STATS_REPORT_SIZE (64 * 1024)
+
+void stats_add(enum stat_counter counter, uint64_t n);
+void stats_observe(enum stat_hist hist, uint64_t value);
+uint64_t stats_total(enum stat_counter counter);
+
+// Append every metric in Prometheus text format, one "name{labels} value" per line
+void stats_report(char *buffer, size_t size);
+
+// Serve stats_report to anyone connecting to a UNIX socket at path
+int stats_serve(const char *path);
+
+#endif // STATS_H
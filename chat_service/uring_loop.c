@@ -0,0 +1,644 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "pool.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES 256       // Submission queue slots
+#define URING_CQ_ENTRIES 4096   // Multishot operations post many completions each
+#define URING_BUFS 512          // Provided receive buffers per ring (power of two)
+#define URING_BUF_SIZE 2048
+#define URING_BGID 0
+
+// Completions carry an object pointer with the operation in its low bits
+enum uring_op {
+   UOP_IGNORE,  // Cancellations
+   UOP_ACCEPT,  // Loop
+   UOP_WAKE,    // Loop
+   UOP_RECV,    // Connection
+   UOP_POLLOUT, // Connection
+   UOP_SEND     // struct send_async
+};
+#define UOP_MASK 7
+
+// A loop's record of one of its connections. Outlives the client_conn
+// until every multishot operation armed for it has posted its last completion.
+struct uring_conn {
+   struct client_conn *conn; // NULL once closed
+   int pending;              // Operations still armed
+};
+
+struct fd_list {
+   int *fds;
+   int count;
+   int capacity;
+};
+
+// One ring: its own listening socket (SO_REUSEPORT), provided buffers and
+// thread, like an epoll loop. A socket's writes are only ever submitted by
+// the loop that accepted it; since that loop is also the one that closes
+// the socket, a write can never reach a descriptor reused by a newer
+// connection. Other loops hand it the sockets they queued output for.
+struct uring_loop {
+   int id;
+   int ring_fd;
+   int listen_fd;
+   int wake_fd;          // eventfd written on state changes and handoffs
+   pthread_t thread;
+
+   void *ring_map;
+   size_t ring_size;
+   struct io_uring_sqe *sqes;
+   unsigned sq_entries;
+   unsigned *sq_head, *sq_tail, *sq_mask;
+   unsigned sq_local;    // Tail including slots not yet published
+   unsigned *cq_head, *cq_tail, *cq_mask;
+   struct io_uring_cqe *cqes;
+
+   struct io_uring_buf_ring *buf_ring;
+   char *bufs;
+   uint16_t buf_tail;
+
+   unsigned char *dirty_mark; // Indexed by socket: already in dirty
+   struct fd_list dirty;      // Sockets with output to write after this batch
+   struct fd_list *outbox;    // Dirty sockets owned by each other loop
+
+   pthread_mutex_t inbox_lock;
+   struct fd_list inbox;      // Handed over by other loops
+   struct fd_list inbox_spare;
+};
+
+enum uring_state {
+   URING_RUNNING,
+   URING_DRAINING, // Listeners closed; connections still served
+   URING_STOPPED   // Loops return
+};
+
+static struct uring_loop *loops;
+static int loops_count;
+static atomic_int loops_state = URING_RUNNING;
+
+// Loop id + 1 of each socket's owner, 0 when none
+static atomic_int *socket_owner;
+static int max_sockets;
+
+static __thread struct uring_loop *current_loop;
+
+static struct pool conn_pool = POOL_INITIALIZER("uring_conn", sizeof(struct uring_conn));
+static struct pool send_pool = POOL_INITIALIZER("uring_send", sizeof(struct send_async));
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+   return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+   return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+   return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static uint64_t tag(void *ptr, enum uring_op op) {
+   return (uint64_t) (uintptr_t) ptr | op;
+}
+
+static void fd_list_push(struct fd_list *list, int fd) {
+   if(list->count == list->capacity) {
+      int capacity = list->capacity ? list->capacity * 2 : 64;
+      int *fds = realloc(list->fds, capacity * sizeof(int));
+      if(fds == NULL) {
+         perror("Failed to grow socket list");
+         exit(EXIT_FAILURE);
+      }
+      list->fds = fds;
+      list->capacity = capacity;
+   }
+   list->fds[list->count++] = fd;
+}
+
+// Publish queued submissions; with wait, also block for one completion
+static int ring_enter(struct uring_loop *loop, unsigned wait) {
+   __atomic_store_n(loop->sq_tail, loop->sq_local, __ATOMIC_RELEASE);
+   unsigned to_submit = loop->sq_local - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+   if(to_submit == 0 && wait == 0) {
+      return 0;
+   }
+   return sys_io_uring_enter(loop->ring_fd, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+}
+
+static struct io_uring_sqe *get_sqe(struct uring_loop *loop) {
+   // Without SQPOLL the kernel consumes every published entry on enter
+   while(loop->sq_local - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) == loop->sq_entries) {
+      if(ring_enter(loop, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+         chat_log(CHAT_LOG_ERROR, "io_uring_enter: %s", strerror(errno));
+      }
+   }
+   struct io_uring_sqe *sqe = &loop->sqes[loop->sq_local & *loop->sq_mask];
+   memset(sqe, 0, sizeof(*sqe));
+   loop->sq_local++;
+   return sqe;
+}
+
+static void prep_accept(struct uring_loop *loop) {
+   struct io_uring_sqe *sqe = get_sqe(loop);
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = loop->listen_fd;
+   sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+   sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+   sqe->user_data = tag(loop, UOP_ACCEPT);
+}
+
+// Reads land in whichever provided buffer is next in the loop's group
+static void prep_recv(struct uring_loop *loop, struct uring_conn *uc) {
+   struct io_uring_sqe *sqe = get_sqe(loop);
+   sqe->opcode = IORING_OP_RECV;
+   sqe->fd = uc->conn->socket;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = URING_BGID;
+   sqe->user_data = tag(uc, UOP_RECV);
+}
+
+static void prep_poll(struct uring_loop *loop, int fd, unsigned events, uint64_t user_data) {
+   struct io_uring_sqe *sqe = get_sqe(loop);
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = fd;
+   sqe->poll32_events = events;
+   sqe->len = IORING_POLL_ADD_MULTI;
+   sqe->user_data = user_data;
+}
+
+static void prep_cancel(struct uring_loop *loop, uint64_t user_data) {
+   struct io_uring_sqe *sqe = get_sqe(loop);
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->addr = user_data;
+   sqe->user_data = tag(NULL, UOP_IGNORE);
+}
+
+// Hand a provided buffer back to the kernel
+static void buf_recycle(struct uring_loop *loop, unsigned bid) {
+   struct io_uring_buf *buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_BUFS - 1)];
+   buf->addr = (uintptr_t) (loop->bufs + (size_t) bid * URING_BUF_SIZE);
+   buf->len = URING_BUF_SIZE;
+   buf->bid = bid;
+   loop->buf_tail++;
+   __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+// send_queue defer hook: remember the socket and write it after the batch
+static void mark_dirty(int socket) {
+   struct uring_loop *loop = current_loop;
+   if(socket < 0 || socket >= max_sockets || loop->dirty_mark[socket]) {
+      return;
+   }
+   loop->dirty_mark[socket] = 1;
+   fd_list_push(&loop->dirty, socket);
+}
+
+static void submit_send(struct uring_loop *loop, int socket) {
+   struct send_async *op = pool_alloc(&send_pool);
+   if(!send_queue_begin_async(socket, op)) {
+      pool_free(&send_pool, op);
+      return;
+   }
+   struct io_uring_sqe *sqe = get_sqe(loop);
+   sqe->opcode = IORING_OP_SENDMSG;
+   sqe->fd = socket;
+   sqe->addr = (uintptr_t) &op->hdr;
+   sqe->msg_flags = MSG_NOSIGNAL;
+   sqe->user_data = tag(op, UOP_SEND);
+}
+
+// Move a batch of sockets into another loop's inbox, waking it when the
+// inbox was empty
+static void hand_over(struct uring_loop *to, struct fd_list *sockets) {
+   pthread_mutex_lock(&to->inbox_lock);
+   bool was_empty = to->inbox.count == 0;
+   for(int i = 0; i < sockets->count; i++) {
+      fd_list_push(&to->inbox, sockets->fds[i]);
+   }
+   pthread_mutex_unlock(&to->inbox_lock);
+   sockets->count = 0;
+
+   uint64_t one = 1;
+   if(was_empty && write(to->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+      chat_log(CHAT_LOG_ERROR, "Wake write: %s", strerror(errno));
+   }
+}
+
+// Start one sendmsg per dirty socket this loop owns and pass the rest on
+static void flush_dirty(struct uring_loop *loop) {
+   for(int i = 0; i < loop->dirty.count; i++) {
+      int socket = loop->dirty.fds[i];
+      loop->dirty_mark[socket] = 0;
+      int owner = atomic_load_explicit(&socket_owner[socket], memory_order_relaxed) - 1;
+      if(owner == loop->id) {
+         submit_send(loop, socket);
+      } else if(owner >= 0) {
+         fd_list_push(&loop->outbox[owner], socket);
+      }
+   }
+   loop->dirty.count = 0;
+
+   for(int i = 0; i < loops_count; i++) {
+      if(loop->outbox[i].count > 0) {
+         hand_over(&loops[i], &loop->outbox[i]);
+      }
+   }
+}
+
+static void conn_release(struct uring_conn *uc) {
+   if(--uc->pending == 0 && uc->conn == NULL) {
+      pool_free(&conn_pool, uc);
+   }
+}
+
+// Cancel the connection's operations and close it. Armed operations hold
+// their own reference to the socket, not its descriptor, so they finish
+// with ECANCELED whether they see the cancellation before or after the close.
+static void conn_close(struct uring_loop *loop, struct uring_conn *uc) {
+   struct client_conn *conn = uc->conn;
+
+   uc->conn = NULL;
+   atomic_store_explicit(&socket_owner[conn->socket], 0, memory_order_relaxed);
+   prep_cancel(loop, tag(uc, UOP_RECV));
+   prep_cancel(loop, tag(uc, UOP_POLLOUT));
+   // A failed enter may have left writes to this socket unsubmitted; they
+   // must take their reference before the descriptor can be reused
+   if(ring_enter(loop, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      chat_log(CHAT_LOG_ERROR, "io_uring_enter: %s", strerror(errno));
+   }
+   client_close(conn);
+}
+
+static void on_accept(struct uring_loop *loop, struct io_uring_cqe *cqe) {
+   if(cqe->res >= 0 && cqe->res >= max_sockets) {
+      chat_log(CHAT_LOG_ERROR, "Accept: descriptor %d above the limit seen at startup", cqe->res);
+      close(cqe->res);
+   } else if(cqe->res >= 0 && client_admit(cqe->res)) {
+      // Owned before client_open queues the welcome message
+      atomic_store_explicit(&socket_owner[cqe->res], loop->id + 1, memory_order_relaxed);
+      struct uring_conn *uc = pool_alloc(&conn_pool);
+      uc->conn = client_open(cqe->res);
+      uc->pending = 2;
+      prep_recv(loop, uc);
+      // Edges tell us when a full socket can take queued output again
+      prep_poll(loop, cqe->res, POLLOUT | EPOLLET, tag(uc, UOP_POLLOUT));
+   } else if(cqe->res < 0 && cqe->res != -ECANCELED) {
+      chat_log(CHAT_LOG_ERROR, "Accept: %s", strerror(-cqe->res));
+   }
+
+   if(!(cqe->flags & IORING_CQE_F_MORE) && cqe->res != -ECANCELED && loop->listen_fd != -1) {
+      prep_accept(loop);
+   }
+}
+
+// Append received bytes to the connection's input and run it, a buffer's
+// worth at a time. Returns true once the connection should be closed.
+static bool conn_input(struct client_conn *conn, const char *data, size_t len) {
+   stats_add(STAT_BYTES_IN, len);
+   while(len > 0) {
+      size_t n = INBUF_SIZE - 1 - conn->inlen;
+      if(n == 0) {
+         return true;
+      }
+      if(n > len) {
+         n = len;
+      }
+      memcpy(conn->inbuf + conn->inlen, data, n);
+      conn->inlen += n;
+      data += n;
+      len -= n;
+      if(client_process_input(conn)) {
+         return true;
+      }
+   }
+   return false;
+}
+
+static void on_recv(struct uring_loop *loop, struct uring_conn *uc, struct io_uring_cqe *cqe) {
+   bool more = cqe->flags & IORING_CQE_F_MORE;
+   bool close_it = false;
+
+   if(cqe->flags & IORING_CQE_F_BUFFER) {
+      unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      if(uc->conn != NULL && cqe->res > 0) {
+         close_it = conn_input(uc->conn, loop->bufs + (size_t) bid * URING_BUF_SIZE, cqe->res);
+      }
+      buf_recycle(loop, bid);
+   }
+   if(uc->conn != NULL && cqe->res <= 0 && cqe->res != -ENOBUFS) {
+      // EOF or hard error
+      chat_log(CHAT_LOG_INFO, "Client disconnected: %s", uc->conn->username);
+      close_it = true;
+   }
+   if(close_it) {
+      conn_close(loop, uc);
+   }
+
+   if(!more) {
+      // Out of buffers, or the kernel ended the multishot receive early
+      if(uc->conn != NULL) {
+         prep_recv(loop, uc);
+      } else {
+         conn_release(uc);
+      }
+   }
+}
+
+static void on_pollout(struct uring_loop *loop, struct uring_conn *uc, struct io_uring_cqe *cqe) {
+   if(uc->conn != NULL && cqe->res > 0) {
+      mark_dirty(uc->conn->socket);
+   }
+   if(!(cqe->flags & IORING_CQE_F_MORE)) {
+      if(uc->conn != NULL && cqe->res >= 0) {
+         prep_poll(loop, uc->conn->socket, POLLOUT | EPOLLET, tag(uc, UOP_POLLOUT));
+      } else {
+         conn_release(uc);
+      }
+   }
+}
+
+// Returns false once the loop should stop
+static bool on_wake(struct uring_loop *loop, struct io_uring_cqe *cqe) {
+   uint64_t count;
+   if(read(loop->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+      chat_log(CHAT_LOG_ERROR, "Wake read: %s", strerror(errno));
+   }
+   if(!(cqe->flags & IORING_CQE_F_MORE)) {
+      prep_poll(loop, loop->wake_fd, POLLIN, tag(loop, UOP_WAKE));
+   }
+
+   // Swap the inbox out so other loops only wait for the swap
+   pthread_mutex_lock(&loop->inbox_lock);
+   struct fd_list handed = loop->inbox;
+   loop->inbox = loop->inbox_spare;
+   pthread_mutex_unlock(&loop->inbox_lock);
+   for(int i = 0; i < handed.count; i++) {
+      mark_dirty(handed.fds[i]);
+   }
+   handed.count = 0;
+   loop->inbox_spare = handed;
+
+   int state = atomic_load(&loops_state);
+   if(state >= URING_DRAINING && loop->listen_fd != -1) {
+      // The armed accept holds the listener open until it is cancelled
+      prep_cancel(loop, tag(loop, UOP_ACCEPT));
+      close(loop->listen_fd);
+      loop->listen_fd = -1;
+   }
+   return state != URING_STOPPED;
+}
+
+static void *uring_loop_run(void *ptr) {
+   struct uring_loop *loop = ptr;
+   bool running = true;
+
+   current_loop = loop;
+   send_queue_defer(mark_dirty);
+   send_queue_never_wait();
+   while(running) {
+      if(ring_enter(loop, 1) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+         chat_log(CHAT_LOG_ERROR, "io_uring_enter: %s", strerror(errno));
+         break;
+      }
+
+      unsigned head = *loop->cq_head;
+      while(head != __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE)) {
+         struct io_uring_cqe cqe = loop->cqes[head & *loop->cq_mask];
+         __atomic_store_n(loop->cq_head, ++head, __ATOMIC_RELEASE);
+
+         void *object = (void *) (uintptr_t) (cqe.user_data & ~(uint64_t) UOP_MASK);
+         switch(cqe.user_data & UOP_MASK) {
+         case UOP_ACCEPT:
+            on_accept(loop, &cqe);
+            break;
+         case UOP_WAKE:
+            running = on_wake(loop, &cqe) && running;
+            break;
+         case UOP_RECV:
+            on_recv(loop, object, &cqe);
+            break;
+         case UOP_POLLOUT:
+            on_pollout(loop, object, &cqe);
+            break;
+         case UOP_SEND:
+            if(send_queue_end_async(object, cqe.res)) {
+               mark_dirty(((struct send_async *) object)->socket);
+            }
+            pool_free(&send_pool, object);
+            break;
+         }
+      }
+
+      // Everything this batch queued leaves in one submission
+      flush_dirty(loop);
+   }
+   send_queue_defer(NULL);
+   return NULL;
+}
+
+// Set up a ring and its provided buffers, or fail if the kernel lacks
+// anything the loop relies on: multishot receive (6.0, probed through the
+// zero-copy send that arrived with it), provided buffer rings and
+// completions that are never dropped.
+static int ring_init(struct uring_loop *loop) {
+   struct io_uring_params params;
+
+   memset(&params, 0, sizeof(params));
+   params.flags = IORING_SETUP_CQSIZE;
+   params.cq_entries = URING_CQ_ENTRIES;
+   loop->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+   if(loop->ring_fd == -1) {
+      return -1;
+   }
+   if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+      errno = EOPNOTSUPP;
+      return -1;
+   }
+
+   size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+   struct io_uring_probe *probe = calloc(1, probe_size);
+   if(probe == NULL) {
+      return -1;
+   }
+   int probed = sys_io_uring_register(loop->ring_fd, IORING_REGISTER_PROBE, probe, 256);
+   bool supported = probed == 0 && probe->last_op >= IORING_OP_SEND_ZC &&
+                    (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+   free(probe);
+   if(!supported) {
+      errno = EOPNOTSUPP;
+      return -1;
+   }
+
+   size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   loop->ring_size = sq_size > cq_size ? sq_size : cq_size;
+   loop->ring_map = mmap(NULL, loop->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         loop->ring_fd, IORING_OFF_SQ_RING);
+   loop->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, loop->ring_fd, IORING_OFF_SQES);
+   if(loop->ring_map == MAP_FAILED || loop->sqes == MAP_FAILED) {
+      return -1;
+   }
+
+   char *ring = loop->ring_map;
+   loop->sq_entries = params.sq_entries;
+   loop->sq_head = (unsigned *) (ring + params.sq_off.head);
+   loop->sq_tail = (unsigned *) (ring + params.sq_off.tail);
+   loop->sq_mask = (unsigned *) (ring + params.sq_off.ring_mask);
+   loop->sq_local = *loop->sq_tail;
+   loop->cq_head = (unsigned *) (ring + params.cq_off.head);
+   loop->cq_tail = (unsigned *) (ring + params.cq_off.tail);
+   loop->cq_mask = (unsigned *) (ring + params.cq_off.ring_mask);
+   loop->cqes = (struct io_uring_cqe *) (ring + params.cq_off.cqes);
+
+   // Slots always map to the entry of the same index
+   unsigned *array = (unsigned *) (ring + params.sq_off.array);
+   for(unsigned i = 0; i < params.sq_entries; i++) {
+      array[i] = i;
+   }
+
+   loop->buf_ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   loop->bufs = malloc((size_t) URING_BUFS * URING_BUF_SIZE);
+   if(loop->buf_ring == MAP_FAILED || loop->bufs == NULL) {
+      return -1;
+   }
+   struct io_uring_buf_reg reg = {
+      .ring_addr = (uintptr_t) loop->buf_ring,
+      .ring_entries = URING_BUFS,
+      .bgid = URING_BGID
+   };
+   if(sys_io_uring_register(loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+      return -1;
+   }
+   for(unsigned i = 0; i < URING_BUFS; i++) {
+      buf_recycle(loop, i);
+   }
+   return 0;
+}
+
+static void ring_free(struct uring_loop *loop) {
+   if(loop->ring_fd != -1) {
+      close(loop->ring_fd);
+   }
+   if(loop->ring_map != NULL && loop->ring_map != MAP_FAILED) {
+      munmap(loop->ring_map, loop->ring_size);
+   }
+   if(loop->sqes != NULL && loop->sqes != MAP_FAILED) {
+      munmap(loop->sqes, loop->sq_entries * sizeof(struct io_uring_sqe));
+   }
+   if(loop->buf_ring != NULL && loop->buf_ring != MAP_FAILED) {
+      munmap(loop->buf_ring, URING_BUFS * sizeof(struct io_uring_buf));
+   }
+   free(loop->bufs);
+}
+
+static void free_loops(void) {
+   for(int i = 0; i < loops_count; i++) {
+      ring_free(&loops[i]);
+      free(loops[i].dirty_mark);
+      free(loops[i].outbox);
+   }
+   free(loops);
+   loops = NULL;
+   loops_count = 0;
+}
+
+static void wake_loops(int state) {
+   uint64_t one = 1;
+
+   atomic_store(&loops_state, state);
+   for(int i = 0; i < loops_count; i++) {
+      if(write(loops[i].wake_fd, &one, sizeof(one)) == -1) {
+         chat_log(CHAT_LOG_ERROR, "Wake write: %s", strerror(errno));
+      }
+   }
+}
+
+// Start num_loops io_uring reactors on listen_port, each on its own thread.
+// Returns -1, having started nothing, when the kernel cannot run them.
+int start_uring_loops(int num_loops) {
+   struct rlimit rl;
+
+   loops = calloc(num_loops, sizeof(struct uring_loop));
+   if(loops == NULL) {
+      perror("Failed to allocate io_uring loops");
+      exit(EXIT_FAILURE);
+   }
+   loops_count = num_loops;
+
+   // Rings first, so a kernel without io_uring leaves the port unbound
+   for(int i = 0; i < num_loops; i++) {
+      loops[i].ring_fd = -1;
+   }
+   for(int i = 0; i < num_loops; i++) {
+      if(ring_init(&loops[i]) == -1) {
+         chat_log(CHAT_LOG_WARN, "io_uring unavailable (%s)", strerror(errno));
+         free_loops();
+         return -1;
+      }
+   }
+
+   if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < (1 << 22)) {
+      max_sockets = (int) rl.rlim_cur;
+   } else {
+      max_sockets = 1 << 22;
+   }
+   socket_owner = calloc(max_sockets, sizeof(atomic_int));
+   if(socket_owner == NULL) {
+      perror("Failed to allocate socket owners");
+      exit(EXIT_FAILURE);
+   }
+
+   for(int i = 0; i < num_loops; i++) {
+      struct uring_loop *loop = &loops[i];
+      loop->id = i;
+      loop->listen_fd = get_server_socket(1);
+      if(start_server(loop->listen_fd, listen_backlog) == -1) {
+         printf("Start server error\n");
+         exit(1);
+      }
+      loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      loop->dirty_mark = calloc(max_sockets, 1);
+      loop->outbox = calloc(num_loops, sizeof(struct fd_list));
+      if(loop->wake_fd == -1 || loop->dirty_mark == NULL || loop->outbox == NULL) {
+         perror("Failed to set up io_uring loop");
+         exit(EXIT_FAILURE);
+      }
+      pthread_mutex_init(&loop->inbox_lock, NULL);
+
+      // Picked up by the loop's first submission
+      prep_accept(loop);
+      prep_poll(loop, loop->wake_fd, POLLIN, tag(loop, UOP_WAKE));
+   }
+
+   for(int i = 0; i < num_loops; i++) {
+      pthread_create(&loops[i].thread, NULL, uring_loop_run, &loops[i]);
+   }
+   return 0;
+}
+
+// Close every listener; the loops keep serving their connections
+void uring_loops_stop_accepting(void) {
+   wake_loops(URING_DRAINING);
+}
+
+// Make every loop return and wait for it
+void stop_uring_loops(void) {
+   wake_loops(URING_STOPPED);
+   for(int i = 0; i < loops_count; i++) {
+      pthread_join(loops[i].thread, NULL);
+      close(loops[i].wake_fd);
+   }
+   free_loops();
+}
@@ -1,59 +1,439 @@
-#include <netinet/in.h> //structure for storing address information 
-#include <stdio.h> 
-#include <stdlib.h> 
+#include <netinet/in.h> //structure for storing address information
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h> //for socket APIs 
-#include <sys/types.h> 
-  
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h> //for socket APIs
+#include <sys/types.h>
+
 #define PORT 9001
 #define MAX_COMMAND_LINE_LEN 1024
+#define REPLY_BUF 65536
+
+// A connection to the server, with reply bytes read past the last full line
+struct conn {
+    int fd;
+    size_t len;
+    char buf[REPLY_BUF];
+};
+
+// Benchmark settings (-b, -l)
+struct bench_opts {
+    int conns;
+    int ops;        // Commands per connection
+    bool own_list;  // Each connection uses a list of its own instead of sharing one
+    int depth;      // Commands sent before waiting for their replies
+    long load;      // Values to bulk load and scan back (-l)
+    int batch;      // Values per add_back_many / get_range
+};
+
+static pthread_barrier_t bench_start;
 
 char* getCommandLine(char *command_line){
 
-	do{ 
+	do{
 
             // Read input from stdin and store it in command_line. If there's an
             // error, exit immediately. (If you want to learn more about this line,
             // you can Google "man fgets")
-        
+
             if ((fgets(command_line, MAX_COMMAND_LINE_LEN, stdin) == NULL) && ferror(stdin)) {
                 fprintf(stderr, "fgets error");
                 exit(0);
             }
- 
+
         }while(command_line[0] == 0x0A);  // while just ENTER pressed
         command_line[strlen(command_line) - 1] = '\0';
 				return command_line;
 }
 
-int main(int argc, char const* argv[]) 
-{ 
-    int sockID = socket(AF_INET, SOCK_STREAM, 0); 
+static int connect_server(void) {
+    int sockID = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in servAddr;
+
+    servAddr.sin_family = AF_INET;
+    servAddr.sin_port = htons(PORT); // use some unused port number
+    servAddr.sin_addr.s_addr = INADDR_ANY;
+
+    if (sockID < 0 || connect(sockID, (struct sockaddr*)&servAddr, sizeof(servAddr)) == -1) {
+        return -1;
+    }
+    // Pipelined writes end in a partial segment; don't let Nagle hold it
+    int one = 1;
+    setsockopt(sockID, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sockID;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read one newline-terminated reply into line, without the newline. A
+// reply longer than size is truncated. Returns -1 once the server is gone.
+static int read_reply(struct conn *c, char *line, size_t size) {
+    size_t copied = 0;
+
+    while (1) {
+        char *end = memchr(c->buf, '\n', c->len);
+        size_t n = end != NULL ? (size_t) (end - c->buf) : c->len;
+        size_t copy = n < size - 1 - copied ? n : size - 1 - copied;
+        memcpy(line + copied, c->buf, copy);
+        copied += copy;
+        line[copied] = '\0';
+        if (end != NULL) {
+            n++;
+            memmove(c->buf, c->buf + n, c->len - n);
+            c->len -= n;
+            return 0;
+        }
+        c->len = 0;
+
+        ssize_t r = recv(c->fd, c->buf, sizeof(c->buf), 0);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        c->len = r;
+    }
+}
+
+// Decode count zigzag varints, the body of a print_binary reply, into
+// values (or just skip them when values is NULL). Returns -1 once the
+// server is gone.
+static int read_values(struct conn *c, int *values, long count) {
+    uint32_t z = 0;
+    int shift = 0;
+    long got = 0;
+
+    while (1) {
+        size_t i = 0;
+        while (i < c->len && got < count) {
+            unsigned char b = c->buf[i++];
+            z |= (uint32_t) (b & 0x7f) << shift;
+            if (b & 0x80) {
+                shift += 7;
+                continue;
+            }
+            if (values != NULL) {
+                values[got] = (int) (z >> 1) ^ -(int) (z & 1);
+            }
+            got++;
+            z = 0;
+            shift = 0;
+        }
+        memmove(c->buf, c->buf + i, c->len - i);
+        c->len -= i;
+        if (got == count) {
+            return 0;
+        }
+
+        ssize_t r = recv(c->fd, c->buf, sizeof(c->buf), 0);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        c->len = r;
+    }
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct bench_thread {
+    pthread_t thread;
+    int id;
+    const struct bench_opts *opts;
+    long done;      // Commands answered
+};
+
+// One benchmark connection cycling through add_front, get_length and
+// remove_front so the list stays short. Commands go out depth at a time
+// in one write, then their replies are read.
+static void *bench_run(void *arg) {
+    struct bench_thread *t = arg;
+    struct conn *c = calloc(1, sizeof(struct conn));
+    char cmd[64], line[MAX_COMMAND_LINE_LEN];
+    char *frame = malloc((size_t) t->opts->depth * sizeof(cmd));
+
+    if (c == NULL || frame == NULL || (c->fd = connect_server()) == -1) {
+        fprintf(stderr, "connection %d failed\n", t->id);
+        exit(1);
+    }
+    if (t->opts->own_list) {
+        snprintf(cmd, sizeof(cmd), "use bench%d\n", t->id);
+        if (send_all(c->fd, cmd, strlen(cmd)) == -1 || read_reply(c, line, sizeof(line)) == -1) {
+            fprintf(stderr, "connection %d lost\n", t->id);
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&bench_start);
+    for (int i = 0; i < t->opts->ops; ) {
+        int burst = t->opts->ops - i < t->opts->depth ? t->opts->ops - i : t->opts->depth;
+        size_t len = 0;
+        for (int k = 0; k < burst; k++, i++) {
+            switch (i % 3) {
+            case 0: len += sprintf(frame + len, "add_front %d\n", i); break;
+            case 1: len += sprintf(frame + len, "get_length\n"); break;
+            default: len += sprintf(frame + len, "remove_front\n"); break;
+            }
+        }
+        if (send_all(c->fd, frame, len) == -1) {
+            fprintf(stderr, "connection %d lost\n", t->id);
+            break;
+        }
+        for (int k = 0; k < burst; k++) {
+            if (read_reply(c, line, sizeof(line)) == -1) {
+                fprintf(stderr, "connection %d lost\n", t->id);
+                i = t->opts->ops;
+                break;
+            }
+            t->done++;
+        }
+    }
+
+    close(c->fd);
+    free(frame);
+    free(c);
+    return NULL;
+}
+
+// Throughput benchmark: many connections issuing commands at once
+static void run_bench(const struct bench_opts *o) {
+    struct bench_thread *threads = calloc(o->conns, sizeof(struct bench_thread));
+    long total = 0;
+
+    if (threads == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    pthread_barrier_init(&bench_start, NULL, o->conns + 1);
+    for (int i = 0; i < o->conns; i++) {
+        threads[i].id = i;
+        threads[i].opts = o;
+        pthread_create(&threads[i].thread, NULL, bench_run, &threads[i]);
+    }
+
+    pthread_barrier_wait(&bench_start);
+    double start = now_s();
+    for (int i = 0; i < o->conns; i++) {
+        pthread_join(threads[i].thread, NULL);
+        total += threads[i].done;
+    }
+    double elapsed = now_s() - start;
+
+    printf("%d connections (%s), pipeline depth %d, %ld commands in %.3f s\n", o->conns,
+           o->own_list ? "a list each" : "one shared list", o->depth, total, elapsed);
+    printf("%.0f commands/s, %.1f us per round trip\n", total / elapsed,
+           total > 0 ? elapsed * 1e6 * o->conns / total : 0);
+    free(threads);
+}
+
+// Send a command and wait for its reply; any failure ends the benchmark
+static void round_trip(struct conn *c, const char *cmd, char *line, size_t size) {
+    if (send_all(c->fd, cmd, strlen(cmd)) == -1 || read_reply(c, line, size) == -1) {
+        fprintf(stderr, "connection lost\n");
+        exit(1);
+    }
+}
+
+// Bulk load: append o->load values to the list "bulk" with add_back_many,
+// o->batch values per command and o->depth commands per write, read them
+// back with get_range, print and print_binary, then remove them again
+static void run_load(const struct bench_opts *o) {
+    struct conn *c = calloc(1, sizeof(struct conn));
+    size_t line_size = (size_t) o->batch * 12 + 64;
+    size_t frame_size = (size_t) o->depth * line_size;
+    char *line = malloc(line_size);
+    char *frame = malloc(frame_size);
+    char cmd[128];
+    int base;
+
+    if (c == NULL || line == NULL || frame == NULL || (c->fd = connect_server()) == -1) {
+        fprintf(stderr, "connection failed\n");
+        exit(1);
+    }
+    round_trip(c, "use bulk\n", line, line_size);
+    round_trip(c, "get_length\n", line, line_size);
+    if (sscanf(line, "Length = %d", &base) != 1) {
+        fprintf(stderr, "unexpected reply: %s\n", line);
+        exit(1);
+    }
+
+    double start = now_s();
+    for (long v = 0; v < o->load; ) {
+        size_t len = 0;
+        int commands = 0;
+        for (; commands < o->depth && v < o->load; commands++) {
+            len += sprintf(frame + len, "add_back_many");
+            for (int k = 0; k < o->batch && v < o->load; k++, v++) {
+                len += sprintf(frame + len, " %ld", v);
+            }
+            frame[len++] = '\n';
+        }
+        if (send_all(c->fd, frame, len) == -1) {
+            fprintf(stderr, "connection lost\n");
+            exit(1);
+        }
+        for (int k = 0; k < commands; k++) {
+            if (read_reply(c, line, line_size) == -1) {
+                fprintf(stderr, "connection lost\n");
+                exit(1);
+            }
+        }
+    }
+    double load_s = now_s() - start;
+
+    // Each reply ends with its values; count them to check nothing is missing
+    long scanned = 0;
+    start = now_s();
+    for (long first = base + 1; first <= base + o->load; ) {
+        size_t len = 0;
+        int commands = 0;
+        for (; commands < o->depth && first <= base + o->load; commands++, first += o->batch) {
+            len += sprintf(frame + len, "get_range %ld %ld\n", first, first + o->batch - 1);
+        }
+        if (send_all(c->fd, frame, len) == -1) {
+            fprintf(stderr, "connection lost\n");
+            exit(1);
+        }
+        for (int k = 0; k < commands; k++) {
+            if (read_reply(c, line, line_size) == -1) {
+                fprintf(stderr, "connection lost\n");
+                exit(1);
+            }
+            char *values = strchr(line, '=');
+            for (char *p = values; p != NULL && (p = strchr(p + 1, ' ')) != NULL; ) {
+                scanned++;
+            }
+        }
+    }
+    double scan_s = now_s() - start;
+
+    // Whole-list dumps, as text and as varints
+    long total = base + o->load, printed = 0, decoded;
+    char *text = malloc(total * 12 + 64);
+    if (text == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    start = now_s();
+    round_trip(c, "print\n", text, total * 12 + 64);
+    for (char *p = text; (p = strstr(p, "->")) != NULL; p += 2) {
+        printed++;
+    }
+    double print_s = now_s() - start;
+    free(text);
+
+    start = now_s();
+    round_trip(c, "print_binary\n", line, line_size);
+    if (sscanf(line, "Binary %ld", &decoded) != 1 || read_values(c, NULL, decoded) == -1) {
+        fprintf(stderr, "unexpected reply: %s\n", line);
+        exit(1);
+    }
+    double binary_s = now_s() - start;
+
+    snprintf(cmd, sizeof(cmd), "remove_range %d %ld\n", base + 1, base + o->load);
+    round_trip(c, cmd, line, line_size);
+
+    // Timings of a list that did not come back whole mean nothing
+    if (scanned != o->load || printed != total || decoded != total) {
+        fprintf(stderr, "list came back wrong: scanned %ld of %ld values, printed %ld and decoded %ld of %ld\n",
+                scanned, o->load, printed, decoded, total);
+        exit(1);
+    }
+
+    printf("loaded  %ld values in %.3f s (%.0f values/s), %d per command, depth %d\n",
+           o->load, load_s, o->load / load_s, o->batch, o->depth);
+    printf("scanned %ld values in %.3f s (%.0f values/s)\n", scanned, scan_s, scanned / scan_s);
+    printf("print        %ld values in %.3f s (%.0f values/s)\n", printed, print_s, printed / print_s);
+    printf("print_binary %ld values in %.3f s (%.0f values/s)\n", decoded, binary_s, decoded / binary_s);
+    close(c->fd);
+    free(frame);
+    free(line);
+    free(c);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s                               interactive\n"
+                    "       %s -b [-c connections] [-n commands_per_connection] [-u] [-p depth]\n"
+                    "       %s -l values [-m values_per_command] [-p depth]\n", prog, prog, prog);
+    exit(1);
+}
+
+int main(int argc, char* const argv[])
+{
+    struct bench_opts o = { 8, 30000, false, 1, 0, 1000 };
+    bool bench = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "bc:n:up:l:m:")) != -1) {
+        switch (opt) {
+        case 'b': bench = true; break;
+        case 'c': o.conns = atoi(optarg); break;
+        case 'n': o.ops = atoi(optarg); break;
+        case 'u': o.own_list = true; break;
+        case 'p': o.depth = atoi(optarg); break;
+        case 'l': o.load = atol(optarg); break;
+        case 'm': o.batch = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (o.conns < 1 || o.ops < 0 || o.depth < 1 || o.load < 0 || o.batch < 1) {
+        usage(argv[0]);
+    }
+    if (bench) {
+        run_bench(&o);
+        return 0;
+    }
+    if (o.load > 0) {
+        run_load(&o);
+        return 0;
+    }
+
     char  *token, *cp;
-    char buf[MAX_COMMAND_LINE_LEN];
+    char buf[MAX_COMMAND_LINE_LEN + 1];
 		char responeData[MAX_COMMAND_LINE_LEN];
+    struct conn *server = calloc(1, sizeof(struct conn));
+
+    if (server == NULL || (server->fd = connect_server()) == -1) {
+        printf("Error...\n");
+    }
+    else {
 
-    struct sockaddr_in servAddr; 
-  
-    servAddr.sin_family = AF_INET; 
-    servAddr.sin_port 
-        = htons(PORT); // use some unused port number 
-    servAddr.sin_addr.s_addr = INADDR_ANY; 
-  
-    int connectStatus 
-        = connect(sockID, (struct sockaddr*)&servAddr, 
-                  sizeof(servAddr)); 
-  
-    if (connectStatus == -1) { 
-        printf("Error...\n"); 
-    } 
-    else { 
-  
 			while(1) {
 			  printf("Enter Command (or menu): ");
         getCommandLine(buf);
 
-				send(sockID, buf, strlen(buf), 0);  // send command and args to server
+				// send command and args to server, one line per command
+				strcat(buf, "\n");
+				send_all(server->fd, buf, strlen(buf));
+				buf[strlen(buf) - 1] = '\0';
 
 				cp = buf;
         token = strtok(cp, " ");
@@ -62,16 +442,32 @@ int main(int argc, char const* argv[])
 					exit(1);
 				}
 				else if(strcmp(token,"menu") == 0){
-					printf("COMMANDS:\n---------\n1. print\n2. get_length\n3. add_back <value>\n4. add_front <value>\n5. add_position <index> <value>\n6. remove_back\n7. remove_front\n8. remove_position <index>\n9. get <index>\n10. exit\n");
+					printf("COMMANDS:\n---------\n1. print\n1b. print_binary\n2. get_length\n3. add_back <value>\n4. add_front <value>\n5. add_position <index> <value>\n6. remove_back\n7. remove_front\n8. remove_position <index>\n9. get <index>\n10. add_back_many <value> ...\n11. get_range <first> <last>\n12. remove_range <first> <last>\n13. use <list>\n14. lists\n15. exit\n");
 				}
- 
-        recv(sockID, responeData, sizeof(responeData), 0); // receive response from server
-  
-        printf("\nSERVER RESPONSE: %s\n", responeData); 
-				memset(buf, '\0', MAX_COMMAND_LINE_LEN);
+
+        if (read_reply(server, responeData, sizeof(responeData)) == -1) { // receive response from server
+            printf("\nServer closed the connection\n");
+            exit(1);
+        }
+
+        printf("\nSERVER RESPONSE: %s\n", responeData);
+
+        // A binary print carries its values after the header line
+        long count;
+        if (strcmp(token, "print_binary") == 0 && sscanf(responeData, "Binary %ld", &count) == 1) {
+            int *values = malloc((count ? count : 1) * sizeof(int));
+            if (values == NULL || read_values(server, values, count) == -1) {
+                printf("\nServer closed the connection\n");
+                exit(1);
+            }
+            for (long i = 0; i < count; i++) {
+                printf("%d%s", values[i], i + 1 < count ? " " : "\n");
+            }
+            free(values);
+        }
+				memset(buf, '\0', sizeof(buf));
 			}
-    } 
- 
-    return 0; 
-}
+    }
 
+    return 0;
+}
@@ -1,34 +1,1007 @@
+#define _GNU_SOURCE
 #include <netinet/in.h> // structure for storing address information
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
 #include <sys/socket.h> // for socket APIs
 #include <sys/types.h>
 #include "list.h"
+#include "store.h"
 
 #define PORT 9001
 #define ACK "ACK"
+#define BACKLOG 128
+#define MAX_WORKERS 64
+#define DEFAULT_WORKERS 4
+#define MAX_EVENTS 64
+#define MAX_LINE (1 << 20)     // Longest command line (batch commands run long)
+#define MIN_INBUF 1024         // Input buffers start here and grow up to MAX_LINE
+#define DUMP_CHUNK 65536       // Reply bytes a print serializes ahead of the socket
+#define OUT_HIGH_WATER (256 * 1024) // Unsent reply bytes at which input stops being read
+#define NAME_LEN 32            // Longest list name, with its terminator
+#define REGISTRY_BUCKETS 256   // Power of two
+#define DEFAULT_LIST "default"
+#define SNAPSHOT_CHUNK 65536   // Values per record when a list is written out in full
+
+// A named list shared by every client. Readers (print, get, get_length,
+// get_range) share its lock; commands that change the list take it
+// exclusively. The list is changed here rather than through list.c, whose
+// operations are left for the list lab.
+struct named_list {
+    char name[NAME_LEN];
+    list_t *list;
+    pthread_rwlock_t lock;
+    node_t *tail;              // Last node when known, else NULL; appends use it
+    int length;                // Values in the list
+    uint32_t id;               // Index in lists_by_id; names the list in the store
+    struct named_list *next;   // Registry bucket chain
+};
+
+// Named lists are created on first use and live until the server exits
+static struct named_list *registry[REGISTRY_BUCKETS];
+static struct named_list **lists_by_id;
+static uint32_t num_lists, lists_cap;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct worker {
+    int epfd;
+    pthread_t thread;
+};
+
+// How a print or get_range serializes its values
+enum dump_format {
+    DUMP_ARROWS,   // print: "1->2->NULL"
+    DUMP_BINARY,   // print_binary: a zigzag LEB128 varint each
+    DUMP_SPACED    // get_range: " 1 2" ending the "Values i..j =" line
+};
+
+// One connected client, only ever touched by the worker serving it
+struct client {
+    int fd;
+    struct worker *worker;
+    struct named_list *current;  // Target of the list commands
+    bool framed;                 // Sent a newline, so commands are lines from now on
+    bool discarding;             // Skipping the rest of an overlong line
+    size_t inlen, incap;
+    char *inbuf;                 // incap bytes plus room for a terminator
+    char *out;                   // Replies not yet written
+    size_t outlen, outsent, outcap;
+    bool want_out;               // Registered for EPOLLOUT
+    bool reading;                // Registered for EPOLLIN (see output_paused)
+    bool failed;                 // No memory for its replies; closed once seen
+    elem *dump;                  // Values of a print still being sent, else NULL
+    size_t dump_len, dump_pos;
+    enum dump_format dump_format;
+};
+
+static struct worker workers[MAX_WORKERS];
+static int num_workers = DEFAULT_WORKERS;
+
+static unsigned hash_name(const char *name) {
+    unsigned hash = 5381;
+    while (*name) {
+        hash = hash * 33 + (unsigned char) *name++;
+    }
+    return hash;
+}
+
+// Add an empty list with the given id. Caller holds registry_lock.
+static struct named_list *create_list(const char *name, uint32_t id) {
+    unsigned bucket = hash_name(name) & (REGISTRY_BUCKETS - 1);
+    struct named_list *nl = calloc(1, sizeof(struct named_list));
+    list_t *list = calloc(1, sizeof(list_t));
+
+    if (id >= lists_cap) {
+        uint32_t cap = lists_cap ? lists_cap * 2 : 16;
+        while (cap <= id) {
+            cap *= 2;
+        }
+        struct named_list **by_id = realloc(lists_by_id, cap * sizeof(*by_id));
+        if (by_id == NULL) {
+            nl = NULL;
+        } else {
+            memset(by_id + lists_cap, 0, (cap - lists_cap) * sizeof(*by_id));
+            lists_by_id = by_id;
+            lists_cap = cap;
+        }
+    }
+    if (nl == NULL || list == NULL) {
+        perror("Failed to allocate list");
+        exit(1);
+    }
+    snprintf(nl->name, sizeof(nl->name), "%s", name);
+    nl->list = list;
+    nl->id = id;
+    pthread_rwlock_init(&nl->lock, NULL);
+    nl->next = registry[bucket];
+    registry[bucket] = nl;
+    lists_by_id[id] = nl;
+    if (id >= num_lists) {
+        num_lists = id + 1;
+    }
+    return nl;
+}
+
+// Find the list called name, creating it if needed. Names are cut to
+// NAME_LEN - 1 characters before anything else, as they are stored.
+static struct named_list *lookup_list(const char *full_name) {
+    char name[NAME_LEN];
+    snprintf(name, sizeof(name), "%s", full_name);
+    unsigned bucket = hash_name(name) & (REGISTRY_BUCKETS - 1);
+    struct named_list *nl;
+
+    pthread_mutex_lock(&registry_lock);
+    for (nl = registry[bucket]; nl != NULL; nl = nl->next) {
+        if (strcmp(nl->name, name) == 0) {
+            break;
+        }
+    }
+    if (nl == NULL) {
+        nl = create_list(name, num_lists);
+        size_t len = strlen(nl->name);
+        char *payload = store_begin(STORE_CREATE, nl->id, 0, 0, len);
+        if (payload != NULL) {
+            memcpy(payload, nl->name, len);
+            store_end();
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return nl;
+}
+
+// Make room for more than n further bytes of replies. Without memory for
+// them the client is marked failed, to be closed; other clients carry on.
+static bool reserve_output(struct client *c, size_t n) {
+    if (c->outlen + n < c->outcap) {
+        return true;
+    }
+    size_t cap = c->outcap ? c->outcap * 2 : 4096;
+    while (cap <= c->outlen + n) {
+        cap *= 2;
+    }
+    char *out = realloc(c->out, cap);
+    if (out == NULL) {
+        perror("Failed to grow reply buffer");
+        c->failed = true;
+        return false;
+    }
+    c->out = out;
+    c->outcap = cap;
+    return true;
+}
+
+// Append formatted text to the client's pending replies
+static void reply(struct client *c, const char *fmt, ...) {
+    va_list ap;
+
+    while (!c->failed) {
+        va_start(ap, fmt);
+        int n = vsnprintf(c->out + c->outlen, c->outcap - c->outlen, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return;
+        }
+        if (c->outlen + n < c->outcap) {
+            c->outlen += n;
+            return;
+        }
+        if (!reserve_output(c, n)) {
+            return;
+        }
+    }
+}
+
+// Copy up to max values starting at node for continue_dump to send; the
+// caller holds the list's lock. Returns false without memory for them.
+static bool start_dump(struct client *c, node_t *node, size_t max, enum dump_format format) {
+    size_t len = 0;
+    for (node_t *n = node; n != NULL && len < max; n = n->next) {
+        len++;
+    }
+    elem *values = malloc((len ? len : 1) * sizeof(elem));
+    if (values == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++, node = node->next) {
+        values[i] = node->value;
+    }
+    c->dump = values;
+    c->dump_len = len;
+    c->dump_pos = 0;
+    c->dump_format = format;
+    return true;
+}
+
+// Serialize the next part of a pending print or get_range, keeping at
+// most about DUMP_CHUNK unsent bytes queued
+static void continue_dump(struct client *c) {
+    if (c->outsent > 0) {
+        memmove(c->out, c->out + c->outsent, c->outlen - c->outsent);
+        c->outlen -= c->outsent;
+        c->outsent = 0;
+    }
+    if (!reserve_output(c, DUMP_CHUNK + 16)) {
+        free(c->dump);
+        c->dump = NULL;
+        return;
+    }
+
+    while (c->dump_pos < c->dump_len && c->outlen < DUMP_CHUNK) {
+        elem v = c->dump[c->dump_pos++];
+        if (c->dump_format == DUMP_BINARY) {
+            uint32_t z = ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+            while (z >= 0x80) {
+                c->out[c->outlen++] = (char) (z | 0x80);
+                z >>= 7;
+            }
+            c->out[c->outlen++] = (char) z;
+        } else if (c->dump_format == DUMP_SPACED) {
+            c->outlen += sprintf(c->out + c->outlen, " %d", v);
+        } else {
+            c->outlen += sprintf(c->out + c->outlen, "%d->", v);
+        }
+    }
+    if (c->dump_pos == c->dump_len) {
+        if (c->dump_format == DUMP_ARROWS) {
+            reply(c, "NULL\n");
+        } else if (c->dump_format == DUMP_SPACED) {
+            reply(c, "\n");
+        }
+        free(c->dump);
+        c->dump = NULL;
+    }
+}
+
+// Input is left unread while a print is being sent, so later replies
+// cannot overtake it, and while replies pile up unsent, so a client that
+// does not read cannot make the server buffer without bound
+static bool output_paused(struct client *c) {
+    return c->dump != NULL || c->outlen - c->outsent >= OUT_HIGH_WATER;
+}
+
+// Write pending replies without blocking, serializing a pending print as
+// the socket takes it; the rest waits for EPOLLOUT. Returns -1 once the
+// connection is broken.
+static int flush_output(struct client *c) {
+    bool blocked = false;
+
+    do {
+        if (c->dump != NULL) {
+            continue_dump(c);
+        }
+        while (c->outsent < c->outlen) {
+            ssize_t n = send(c->fd, c->out + c->outsent, c->outlen - c->outsent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    blocked = true;
+                    break;
+                }
+                return -1;
+            }
+            c->outsent += n;
+        }
+        if (c->outsent == c->outlen) {
+            c->outsent = c->outlen = 0;
+        }
+    } while (c->dump != NULL && !blocked);
+
+    bool want_out = c->outlen > 0 || c->dump != NULL;
+    bool reading = !output_paused(c);
+    if (want_out != c->want_out || reading != c->reading) {
+        struct epoll_event ev = { .events = (reading ? EPOLLIN | EPOLLRDHUP : 0) | (want_out ? EPOLLOUT : 0),
+                                  .data.ptr = c };
+        epoll_ctl(c->worker->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_out = want_out;
+        c->reading = reading;
+    }
+    return 0;
+}
+
+static void free_nodes(node_t *node) {
+    while (node != NULL) {
+        node_t *next = node->next;
+        free(node);
+        node = next;
+    }
+}
+
+static node_t *new_node(elem value) {
+    node_t *node = malloc(sizeof(node_t));
+    if (node != NULL) {
+        node->value = value;
+        node->next = NULL;
+    }
+    return node;
+}
+
+// Next space-separated argument as an integer. Returns false when it is missing.
+static bool int_arg(char **save, int *out) {
+    char *token = strtok_r(NULL, " \r", save);
+    if (token == NULL) {
+        return false;
+    }
+    *out = atoi(token);
+    return true;
+}
+
+// Allocate a chain of nodes for the values in the rest of the line.
+// Returns the number of values, or -1 when there is no memory for them.
+static int parse_values(char **save, node_t **first, node_t **last) {
+    int count = 0;
+    char *token;
+
+    *first = *last = NULL;
+    while ((token = strtok_r(NULL, " \r", save)) != NULL) {
+        node_t *node = malloc(sizeof(node_t));
+        if (node == NULL) {
+            free_nodes(*first);
+            return -1;
+        }
+        node->value = atoi(token);
+        node->next = NULL;
+        if (*last == NULL) {
+            *first = node;
+        } else {
+            (*last)->next = node;
+        }
+        *last = node;
+        count++;
+    }
+    return count;
+}
+
+// Link a chain of nodes after the last one. Walks the list only when the
+// tail is not already known. Caller holds the list's lock exclusively.
+static void append_nodes(struct named_list *nl, node_t *first, node_t *last) {
+    if (nl->tail == NULL && nl->list->head != NULL) {
+        nl->tail = nl->list->head;
+        while (nl->tail->next != NULL) {
+            nl->tail = nl->tail->next;
+        }
+    }
+    if (nl->tail == NULL) {
+        nl->list->head = first;
+    } else {
+        nl->tail->next = first;
+    }
+    nl->tail = last;
+}
+
+// Node at 1-based index (as for get), or NULL past the end
+static node_t *node_at(list_t *l, int idx) {
+    node_t *node = l->head;
+    while (node != NULL && idx > 1) {
+        node = node->next;
+        idx--;
+    }
+    return idx < 1 ? NULL : node;
+}
+
+// Unlink the node at 1-based index, or return NULL when there is none.
+// Caller holds the list's lock exclusively.
+static node_t *unlink_at(struct named_list *nl, int idx) {
+    if (idx < 1 || idx > nl->length) {
+        return NULL;
+    }
+    node_t *prev = NULL, **link = &nl->list->head;
+    for (int i = 1; i < idx; i++) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    node_t *node = *link;
+    *link = node->next;
+    if (node->next == NULL) {
+        nl->tail = prev;
+    }
+    node->next = NULL;
+    nl->length--;
+    return node;
+}
+
+// The changes a list can go through, each recorded in the store. Commands
+// and the replay of the store both make them through these; the caller
+// holds the list's lock exclusively. Nodes are allocated and freed by the
+// caller, outside the lock.
+static void add_front(struct named_list *nl, node_t *node) {
+    node->next = nl->list->head;
+    if (node->next == NULL) {
+        nl->tail = node;
+    }
+    nl->list->head = node;
+    nl->length++;
+    store_log(STORE_ADD_FRONT, nl->id, node->value, 0);
+}
+
+// Append a chain of count nodes
+static void add_back(struct named_list *nl, node_t *first, node_t *last, int count) {
+    append_nodes(nl, first, last);
+    nl->length += count;
+    int32_t *values = store_begin(STORE_ADD_BACK, nl->id, 0, 0, count * sizeof(int32_t));
+    if (values != NULL) {
+        for (node_t *node = first; node != NULL; node = node->next) {
+            *values++ = node->value;
+        }
+        store_end();
+    }
+}
+
+// Insert so the node ends up at 1-based index, at most one past the end.
+// Returns false, leaving the list alone, for any other index.
+static bool add_at(struct named_list *nl, int idx, node_t *node) {
+    if (idx < 1 || idx > nl->length + 1) {
+        return false;
+    }
+    node_t **link = &nl->list->head;
+    for (int i = 1; i < idx; i++) {
+        link = &(*link)->next;
+    }
+    node->next = *link;
+    *link = node;
+    if (node->next == NULL) {
+        nl->tail = node;
+    }
+    nl->length++;
+    store_log(STORE_ADD_AT, nl->id, idx, node->value);
+    return true;
+}
+
+// The removals return the unlinked node, or NULL when there is none
+static node_t *remove_front(struct named_list *nl) {
+    node_t *node = unlink_at(nl, 1);
+    if (node != NULL) {
+        store_log(STORE_REMOVE_FRONT, nl->id, 0, 0);
+    }
+    return node;
+}
+
+static node_t *remove_back(struct named_list *nl) {
+    node_t *node = unlink_at(nl, nl->length);
+    if (node != NULL) {
+        store_log(STORE_REMOVE_BACK, nl->id, 0, 0);
+    }
+    return node;
+}
+
+static node_t *remove_at(struct named_list *nl, int idx) {
+    node_t *node = unlink_at(nl, idx);
+    if (node != NULL) {
+        store_log(STORE_REMOVE_AT, nl->id, idx, 0);
+    }
+    return node;
+}
+
+// Unlink positions idx..end (1-based, inclusive), as many as exist.
+// Returns the unlinked chain for the caller to free once unlocked.
+static node_t *remove_range(struct named_list *nl, int idx, int end, int *count) {
+    node_t *removed = NULL;
+    node_t **link = &nl->list->head;
+
+    *count = 0;
+    for (int i = 1; i < idx && *link != NULL; i++) {
+        link = &(*link)->next;
+    }
+    if (idx >= 1 && end >= idx && *link != NULL) {
+        node_t *last = *link;
+        removed = last;
+        *count = 1;
+        while (*count <= end - idx && last->next != NULL) {
+            last = last->next;
+            (*count)++;
+        }
+        *link = last->next;
+        last->next = NULL;
+        nl->tail = NULL;
+        nl->length -= *count;
+        store_log(STORE_REMOVE_RANGE, nl->id, idx, end);
+    }
+    return removed;
+}
+
+// Apply one record of the store as the server starts, before any client
+static void replay_record(const struct store_record *rec, const void *payload) {
+    if (rec->op == STORE_CREATE) {
+        char name[NAME_LEN];
+        snprintf(name, sizeof(name), "%.*s", (int) rec->len, (const char *) payload);
+        create_list(name, rec->list);
+        return;
+    }
+    if (rec->list >= num_lists || lists_by_id[rec->list] == NULL) {
+        fprintf(stderr, "List store names unknown list %u\n", rec->list);
+        return;
+    }
+
+    struct named_list *nl = lists_by_id[rec->list];
+    node_t *node;
+    switch (rec->op) {
+    case STORE_ADD_FRONT:
+    case STORE_ADD_AT:
+        node = new_node(rec->op == STORE_ADD_FRONT ? rec->a : rec->b);
+        if (node == NULL) {
+            perror("Failed to load list store");
+            exit(1);
+        }
+        if (rec->op == STORE_ADD_FRONT) {
+            add_front(nl, node);
+        } else if (!add_at(nl, rec->a, node)) {
+            free(node);
+        }
+        break;
+    case STORE_REMOVE_FRONT: free(remove_front(nl)); break;
+    case STORE_REMOVE_BACK: free(remove_back(nl)); break;
+    case STORE_REMOVE_AT: free(remove_at(nl, rec->a)); break;
+    case STORE_REMOVE_RANGE: {
+        int count;
+        free_nodes(remove_range(nl, rec->a, rec->b, &count));
+        break;
+    }
+    case STORE_ADD_BACK: {
+        const int32_t *values = payload;
+        int count = rec->len / sizeof(int32_t);
+        node_t *first = NULL, *last = NULL;
+        for (int i = 0; i < count; i++) {
+            node_t *node = malloc(sizeof(node_t));
+            if (node == NULL) {
+                perror("Failed to load list store");
+                exit(1);
+            }
+            node->value = values[i];
+            node->next = NULL;
+            if (last == NULL) {
+                first = node;
+            } else {
+                last->next = node;
+            }
+            last = node;
+        }
+        if (count > 0) {
+            add_back(nl, first, last, count);
+        }
+        break;
+    }
+    default:
+        fprintf(stderr, "List store has unknown record type %u\n", rec->op);
+    }
+}
+
+// Write every list out as its create record and its values, for the store
+// to replace its log with. All lists are read-locked, and the registry
+// locked, so nothing changes part way through. A store with ids missing
+// leaves gaps in lists_by_id, which are skipped.
+static void snapshot_lists(void) {
+    pthread_mutex_lock(&registry_lock);
+    for (uint32_t i = 0; i < num_lists; i++) {
+        if (lists_by_id[i] != NULL) {
+            pthread_rwlock_rdlock(&lists_by_id[i]->lock);
+        }
+    }
+
+    bool rewritten = store_rewrite_begin() == 0;
+    if (rewritten) {
+        for (uint32_t i = 0; i < num_lists; i++) {
+            struct named_list *nl = lists_by_id[i];
+            if (nl == NULL) {
+                continue;
+            }
+            size_t len = strlen(nl->name);
+            memcpy(store_begin(STORE_CREATE, nl->id, 0, 0, len), nl->name, len);
+            store_end();
+
+            for (node_t *node = nl->list->head; node != NULL; ) {
+                int count = 0;
+                for (node_t *n = node; n != NULL && count < SNAPSHOT_CHUNK; n = n->next) {
+                    count++;
+                }
+                int32_t *values = store_begin(STORE_ADD_BACK, nl->id, 0, 0, count * sizeof(int32_t));
+                for (int k = 0; k < count; k++, node = node->next) {
+                    values[k] = node->value;
+                }
+                store_end();
+            }
+        }
+        store_rewrite_written();
+    }
+
+    for (uint32_t i = 0; i < num_lists; i++) {
+        if (lists_by_id[i] != NULL) {
+            pthread_rwlock_unlock(&lists_by_id[i]->lock);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    // Changes made while the new log is synced are appended to it
+    if (rewritten) {
+        store_rewrite_end();
+    }
+}
+
+// Run one command line. Returns non-zero when the client asked to leave.
+static int handle_command(struct client *c, char *line) {
+    int val, idx;
+    char *save;
+    list_t *mylist = c->current->list;
+    pthread_rwlock_t *lock = &c->current->lock;
+
+    // Tokenize the received line (workers run commands concurrently)
+    char *token = strtok_r(line, " \r", &save);
+    if (token == NULL) {
+        reply(c, "Empty command\n");
+        return 0;
+    }
+
+    if (strcmp(token, "exit") == 0) {
+        // Ends this client's session; the lists stay for everyone else
+        return 1;
+    } else if (strcmp(token, "use") == 0) {
+        token = strtok_r(NULL, " \r", &save);
+        if (token == NULL) {
+            reply(c, "Missing list name\n");
+            return 0;
+        }
+        c->current = lookup_list(token);
+        reply(c, "Using list %s\n", c->current->name);
+    } else if (strcmp(token, "lists") == 0) {
+        reply(c, "Lists:");
+        pthread_mutex_lock(&registry_lock);
+        for (int i = 0; i < REGISTRY_BUCKETS; i++) {
+            for (struct named_list *nl = registry[i]; nl != NULL; nl = nl->next) {
+                reply(c, " %s", nl->name);
+            }
+        }
+        pthread_mutex_unlock(&registry_lock);
+        reply(c, "\n");
+    } else if (strcmp(token, "get_length") == 0) {
+        // Get the length of the list
+        pthread_rwlock_rdlock(lock);
+        val = c->current->length;
+        pthread_rwlock_unlock(lock);
+        reply(c, "%s%d\n", "Length = ", val);
+    } else if (strcmp(token, "add_front") == 0) {
+        if (!int_arg(&save, &val)) {
+            reply(c, "Missing value\n");
+            return 0;
+        }
+        node_t *node = new_node(val);
+        if (node == NULL) {
+            reply(c, "Out of memory\n");
+            return 0;
+        }
+        pthread_rwlock_wrlock(lock);
+        add_front(c->current, node);
+        pthread_rwlock_unlock(lock);
+        reply(c, "%s%d\n", ACK, val);
+    } else if (strcmp(token, "add_back") == 0) {
+        if (!int_arg(&save, &val)) {
+            reply(c, "Missing value\n");
+            return 0;
+        }
+        node_t *node = new_node(val);
+        if (node == NULL) {
+            reply(c, "Out of memory\n");
+            return 0;
+        }
+        pthread_rwlock_wrlock(lock);
+        add_back(c->current, node, node, 1);
+        pthread_rwlock_unlock(lock);
+        reply(c, "%s%d\n", ACK, val);
+    } else if (strcmp(token, "add_back_many") == 0) {
+        // The nodes are built before taking the lock, then linked in one go
+        node_t *first, *last;
+        int count = parse_values(&save, &first, &last);
+        if (count < 0) {
+            reply(c, "Out of memory\n");
+            return 0;
+        }
+        if (count > 0) {
+            pthread_rwlock_wrlock(lock);
+            add_back(c->current, first, last, count);
+            pthread_rwlock_unlock(lock);
+        }
+        reply(c, "%s%d values\n", ACK, count);
+    } else if (strcmp(token, "add_position") == 0) {
+        if (!int_arg(&save, &idx) || !int_arg(&save, &val)) {
+            reply(c, "Missing index or value\n");
+            return 0;
+        }
+        node_t *node = new_node(val);
+        if (node == NULL) {
+            reply(c, "Out of memory\n");
+            return 0;
+        }
+        pthread_rwlock_wrlock(lock);
+        bool added = add_at(c->current, idx, node);
+        pthread_rwlock_unlock(lock);
+        if (!added) {
+            free(node);
+            reply(c, "No position %d\n", idx);
+            return 0;
+        }
+        reply(c, "%s%d at position %d\n", ACK, val, idx);
+    } else if (strcmp(token, "remove_front") == 0 || strcmp(token, "remove_back") == 0) {
+        // The node is freed once the lock is released
+        pthread_rwlock_wrlock(lock);
+        node_t *node = token[7] == 'f' ? remove_front(c->current) : remove_back(c->current);
+        pthread_rwlock_unlock(lock);
+        if (node == NULL) {
+            reply(c, "List is empty\n");
+            return 0;
+        }
+        reply(c, "%s%d\n", ACK, node->value);
+        free(node);
+    } else if (strcmp(token, "remove_position") == 0) {
+        if (!int_arg(&save, &idx)) {
+            reply(c, "Missing index\n");
+            return 0;
+        }
+        pthread_rwlock_wrlock(lock);
+        node_t *node = remove_at(c->current, idx);
+        pthread_rwlock_unlock(lock);
+        if (node == NULL) {
+            reply(c, "No position %d\n", idx);
+            return 0;
+        }
+        reply(c, "%s%d\n", ACK, node->value);
+        free(node);
+    } else if (strcmp(token, "remove_range") == 0) {
+        int end;
+        if (!int_arg(&save, &idx) || !int_arg(&save, &end)) {
+            reply(c, "Missing range\n");
+            return 0;
+        }
+        // The removed nodes are freed once the lock is released
+        int count;
+        pthread_rwlock_wrlock(lock);
+        node_t *removed = remove_range(c->current, idx, end, &count);
+        pthread_rwlock_unlock(lock);
+        free_nodes(removed);
+        reply(c, "%s%d values\n", ACK, count);
+    } else if (strcmp(token, "print") == 0 || strcmp(token, "print_binary") == 0) {
+        // Copy the values under the lock; they are serialized as the
+        // socket drains, so the list can be any length
+        bool binary = token[5] == '_';
+        pthread_rwlock_rdlock(lock);
+        bool ok = start_dump(c, mylist->head, SIZE_MAX, binary ? DUMP_BINARY : DUMP_ARROWS);
+        pthread_rwlock_unlock(lock);
+        if (!ok) {
+            reply(c, "Out of memory\n");
+            return 0;
+        }
+        if (binary) {
+            reply(c, "Binary %zu\n", c->dump_len);
+        }
+    } else if (strcmp(token, "get") == 0) {
+        if (!int_arg(&save, &idx)) {
+            reply(c, "Missing index\n");
+            return 0;
+        }
+        pthread_rwlock_rdlock(lock);
+        node_t *node = node_at(mylist, idx);
+        bool found = node != NULL;
+        if (found) {
+            val = node->value;
+        }
+        pthread_rwlock_unlock(lock);
+        if (!found) {
+            reply(c, "No position %d\n", idx);
+            return 0;
+        }
+        reply(c, "Value at index %d = %d\n", idx, val);
+    } else if (strcmp(token, "get_range") == 0) {
+        int end;
+        if (!int_arg(&save, &idx) || !int_arg(&save, &end)) {
+            reply(c, "Missing range\n");
+            return 0;
+        }
+        // Positions idx..end (1-based, inclusive), as many as exist, sent
+        // as the socket drains like a print
+        size_t count = end >= idx ? (size_t) end - idx + 1 : 0;
+        pthread_rwlock_rdlock(lock);
+        bool ok = start_dump(c, count ? node_at(mylist, idx) : NULL, count, DUMP_SPACED);
+        pthread_rwlock_unlock(lock);
+        if (!ok) {
+            reply(c, "Out of memory\n");
+            return 0;
+        }
+        reply(c, "Values %d..%d =", idx, end);
+    } else {
+        reply(c, "Unknown command: %s\n", token);
+    }
+    return 0;
+}
+
+// Run every complete command in the input buffer, keeping a partial tail.
+// Commands are newline-terminated lines; a client that has never sent a
+// newline (like the original one) gets each read taken as one command, so
+// a new client's first line has to arrive in one piece. A read that fills
+// the buffer is not taken as a whole command, as the rest of a long first
+// line (say an add_back_many) is still to come. Pipelined
+// commands are all run before any reply is sent, and their replies leave
+// together. A print, or a backlog of unsent replies, stops the run until
+// the socket has taken them.
+static int process_input(struct client *c) {
+    size_t used = 0;
+    int status = 0;
+
+    while (status == 0 && !output_paused(c) && !c->failed && used < c->inlen) {
+        char *line = c->inbuf + used;
+        char *end = memchr(line, '\n', c->inlen - used);
+        if (end != NULL) {
+            c->framed = true;
+        } else if (!c->framed && c->inlen < c->incap) {
+            end = c->inbuf + c->inlen;
+        } else if (used == 0 && c->inlen == c->incap && c->incap == MAX_LINE) {
+            // No newline in a full buffer: refuse the line and skip to its end
+            if (!c->discarding) {
+                reply(c, "Command too long\n");
+            }
+            c->discarding = true;
+            used = c->inlen;
+            break;
+        } else {
+            break;
+        }
+        used = end - c->inbuf + (end < c->inbuf + c->inlen ? 1 : 0);
+        *end = '\0';
+
+        if (c->discarding) {
+            c->discarding = false;
+            continue;
+        }
+        status = handle_command(c, line);
+    }
+
+    memmove(c->inbuf, c->inbuf + used, c->inlen - used);
+    c->inlen -= used;
+    return status;
+}
+
+// Run buffered commands and send their replies, carrying on whenever the
+// socket takes everything that paused them. Replies owed before an exit
+// are sent; a full socket drops them. Returns -1 once the client is gone.
+static int run_commands(struct client *c) {
+    while (1) {
+        int status = process_input(c);
+        bool paused = output_paused(c);
+        if (flush_output(c) == -1) {
+            perror("Send failed");
+            return -1;
+        }
+        if (status || c->failed) {
+            return -1;
+        }
+        if (!paused || output_paused(c)) {
+            return 0;
+        }
+    }
+}
+
+static void close_client(struct client *c) {
+    epoll_ctl(c->worker->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->inbuf);
+    free(c->out);
+    free(c->dump);
+    free(c);
+}
+
+// Read what the client sent, run it and send the replies. Returns -1 once
+// the client is gone.
+static int serve_client(struct client *c, unsigned events) {
+    if (events & EPOLLOUT) {
+        bool paused = output_paused(c);
+        if (flush_output(c) == -1 || c->failed) {
+            return -1;
+        }
+        // Commands held up behind unsent output run now
+        if (paused && !output_paused(c) && run_commands(c) == -1) {
+            return -1;
+        }
+    }
+    if (output_paused(c)) {
+        return (events & (EPOLLHUP | EPOLLERR)) ? -1 : 0;
+    }
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        return 0;
+    }
+
+    // A partial line that fills the buffer makes it grow, up to MAX_LINE
+    if (c->inlen == c->incap && c->incap < MAX_LINE) {
+        size_t cap = c->incap ? c->incap * 2 : MIN_INBUF;
+        char *inbuf = realloc(c->inbuf, cap + 1);
+        if (inbuf == NULL) {
+            perror("Failed to grow input buffer");
+            return -1;
+        }
+        c->inbuf = inbuf;
+        c->incap = cap;
+    }
+    ssize_t n = recv(c->fd, c->inbuf + c->inlen, c->incap - c->inlen, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (n <= 0) {
+        if (n == 0) {
+            printf("Client disconnected\n");
+        } else {
+            perror("Recv failed");
+        }
+        return -1;
+    }
+    c->inlen += n;
+    return run_commands(c);
+}
+
+static void *worker_run(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            struct client *c = events[i].data.ptr;
+            if (serve_client(c, events[i].events) == -1) {
+                close_client(c);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w workers] [-f store_file]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char* const argv[]) {
+    const char *store_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:f:")) != -1) {
+        switch (opt) {
+        case 'f':
+            store_path = optarg;
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            if (num_workers < 1 || num_workers > MAX_WORKERS) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-int main(int argc, char const* argv[]) {
-    int n, val, idx;
     // Create server socket
     int servSockD = socket(AF_INET, SOCK_STREAM, 0);
     if (servSockD < 0) {
         perror("Socket creation failed");
         exit(1);
     }
-
-    // String store data to recv/send to/from client
-    char buf[1024];
-    char sbuf[1024];
-    char* token;
+    int one = 1;
+    setsockopt(servSockD, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
     // Define server address
     struct sockaddr_in servAddr;
 
-    // List
-    list_t *mylist;
-
     servAddr.sin_family = AF_INET;
     servAddr.sin_port = htons(PORT);
     servAddr.sin_addr.s_addr = INADDR_ANY;
@@ -40,93 +1013,58 @@ int main(int argc, char const* argv[]) {
     }
 
     // Listen for connections
-    if (listen(servSockD, 1) < 0) {
+    if (listen(servSockD, BACKLOG) < 0) {
         perror("Listen failed");
         exit(1);
     }
 
-    // Integer to hold client socket
-    int clientSocket = accept(servSockD, NULL, NULL);
-    if (clientSocket < 0) {
-        perror("Accept failed");
-        exit(1);
+    // Lists kept in a store are back before the first client
+    if (store_path != NULL) {
+        store_open(store_path, replay_record, snapshot_lists);
     }
 
-    // Initialize the list
-    mylist = list_alloc();
+    // Clients start on the default list
+    struct named_list *default_list = lookup_list(DEFAULT_LIST);
 
-    while (1) {
-        // Receive messages from the client socket
-        n = recv(clientSocket, buf, sizeof(buf), 0);
-        if (n <= 0) {
-            if (n == 0) {
-                printf("Client disconnected\n");
-            } else {
-                perror("Recv failed");
-            }
-            break;
+    // Each worker serves its share of the clients from its own epoll set
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (workers[i].epfd < 0) {
+            perror("epoll_create1");
+            exit(1);
         }
+        pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+    }
 
-        buf[n] = '\0';
-
-        // Tokenize the received buffer
-        token = strtok(buf, " ");
-
-        if (strcmp(token, "exit") == 0) {
-            list_free(mylist);
-            close(clientSocket);
-            exit(0);
-        } else if (strcmp(token, "get_length") == 0) {
-            // Get the length of the list
-            val = list_length(mylist);
-            sprintf(sbuf, "%s%d", "Length = ", val);
-        } else if (strcmp(token, "add_front") == 0) {
-            token = strtok(NULL, " ");  // Get next token (value)
-            val = atoi(token);
-            list_add_to_front(mylist, val);
-            sprintf(sbuf, "%s%d", ACK, val);
-        } else if (strcmp(token, "add_back") == 0) {
-            token = strtok(NULL, " ");  // Get next token (value)
-            val = atoi(token);
-            list_add_to_back(mylist, val);
-            sprintf(sbuf, "%s%d", ACK, val);
-        } else if (strcmp(token, "add_position") == 0) {
-            token = strtok(NULL, " ");  // Get index
-            idx = atoi(token);
-            token = strtok(NULL, " ");  // Get value
-            val = atoi(token);
-            list_add_at_index(mylist, idx, val);
-            sprintf(sbuf, "%s%d at position %d", ACK, val, idx);
-        } else if (strcmp(token, "remove_front") == 0) {
-            val = list_remove_from_front(mylist);
-            sprintf(sbuf, "%s%d", ACK, val);
-        } else if (strcmp(token, "remove_back") == 0) {
-            val = list_remove_from_back(mylist);
-            sprintf(sbuf, "%s%d", ACK, val);
-        } else if (strcmp(token, "remove_position") == 0) {
-            token = strtok(NULL, " ");
-            idx = atoi(token);
-            val = list_remove_at_index(mylist, idx);
-            sprintf(sbuf, "%s%d", ACK, val);
-        } else if (strcmp(token, "print") == 0) {
-            // Print the list
-            sprintf(sbuf, "%s", listToString(mylist));
-        } else if (strcmp(token, "get") == 0) {
-            token = strtok(NULL, " ");  // Get index
-            idx = atoi(token);
-            val = list_get_at_index(mylist, idx);
-            sprintf(sbuf, "Value at index %d = %d", idx, val);
-        } else {
-            sprintf(sbuf, "Unknown command: %s", token);
+    // Accept clients and hand them to the workers in turn
+    for (int next = 0; ; next = (next + 1) % num_workers) {
+        int clientSocket = accept4(servSockD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("Accept failed");
+            }
+            continue;
         }
+        // Replies go out as commands finish; a later small write must not
+        // wait on the client's delayed ACK for an earlier one
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
-        // Send the response to the client
-        if (send(clientSocket, sbuf, strlen(sbuf), 0) < 0) {
-            perror("Send failed");
-            break;
+        struct client *c = calloc(1, sizeof(struct client));
+        if (c == NULL) {
+            perror("Failed to allocate client");
+            exit(1);
         }
+        c->fd = clientSocket;
+        c->worker = &workers[next];
+        c->current = default_list;
+        c->reading = true;
 
-        memset(buf, '\0', sizeof(buf));  // Clear buffer for next command
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+        if (epoll_ctl(c->worker->epfd, EPOLL_CTL_ADD, clientSocket, &ev) < 0) {
+            perror("epoll_ctl");
+            close(clientSocket);
+            free(c);
+        }
     }
 
     return 0;
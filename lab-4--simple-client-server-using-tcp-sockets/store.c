@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include "store.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STORE_MAGIC 0x3154534c     // "LST1"
+#define STORE_MIN_SIZE (1 << 20)   // Files start at this size and double as they fill
+#define COMPACT_MIN (4 << 20)      // Logs smaller than this are left alone
+
+// Payloads are padded so every record starts 4-byte aligned
+#define RECORD_BYTES(len) (sizeof(struct store_record) + (((len) + 3) & ~(size_t) 3))
+
+struct store_header {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t used;          // Bytes of complete records after the header
+};
+
+struct log_file {
+    int fd;
+    char *map;
+    size_t size;            // Bytes mapped, all of the file
+};
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_wake = PTHREAD_COND_INITIALIZER;
+static bool enabled;            // Set once the log has been replayed
+static bool rewriting;          // Records go to next rather than current
+static bool compact_wanted;     // Set until the rewrite it asks for is over
+static struct log_file current, next;
+static uint64_t compacted;      // Log size when last written out in full
+static uint64_t snapshot_used;  // Bytes of next holding the snapshot itself
+static size_t pending;          // Size of the record between begin and end
+static char *log_path, *tmp_path;
+static store_snapshot_fn snapshot_lists;
+
+static struct store_header *header(struct log_file *f) {
+    return (struct store_header *) f->map;
+}
+
+// Map the log at path, starting an empty one if the file is new or
+// truncate is set. Returns -1 with errno set on failure.
+static int log_map(struct log_file *f, const char *path, bool truncate) {
+    struct stat st;
+
+    f->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+    if (f->fd < 0) {
+        return -1;
+    }
+    if (fstat(f->fd, &st) < 0) {
+        goto fail;
+    }
+    if (st.st_size != 0 && st.st_size < STORE_MIN_SIZE) {
+        errno = EINVAL;
+        goto fail;
+    }
+    if (st.st_size == 0 && ftruncate(f->fd, STORE_MIN_SIZE) < 0) {
+        goto fail;
+    }
+    f->size = st.st_size ? (size_t) st.st_size : STORE_MIN_SIZE;
+    f->map = mmap(NULL, f->size, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+    if (f->map == MAP_FAILED) {
+        goto fail;
+    }
+    if (st.st_size == 0) {
+        header(f)->magic = STORE_MAGIC;
+        header(f)->used = 0;
+    } else if (header(f)->magic != STORE_MAGIC ||
+               header(f)->used > f->size - sizeof(struct store_header)) {
+        munmap(f->map, f->size);
+        errno = EINVAL;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    close(f->fd);
+    return -1;
+}
+
+static void log_unmap(struct log_file *f) {
+    munmap(f->map, f->size);
+    close(f->fd);
+}
+
+// Make room for bytes more of records, growing the file and its mapping
+static int log_reserve(struct log_file *f, size_t bytes) {
+    size_t need = sizeof(struct store_header) + header(f)->used + bytes;
+    if (need <= f->size) {
+        return 0;
+    }
+    size_t size = f->size * 2;
+    while (size < need) {
+        size *= 2;
+    }
+    if (ftruncate(f->fd, size) < 0) {
+        return -1;
+    }
+    char *map = mremap(f->map, f->size, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    f->map = map;
+    f->size = size;
+    return 0;
+}
+
+// Waits until the log has doubled since it was last written out, then has
+// the server write it out again
+static void *compact_run(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&store_lock);
+    while (1) {
+        while (!compact_wanted) {
+            pthread_cond_wait(&compact_wake, &store_lock);
+        }
+        pthread_mutex_unlock(&store_lock);
+        snapshot_lists();
+        pthread_mutex_lock(&store_lock);
+    }
+    return NULL;
+}
+
+void store_open(const char *path, store_replay_fn replay, store_snapshot_fn snapshot) {
+    if (log_map(&current, path, false) < 0) {
+        fprintf(stderr, "Cannot open list store %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    // A record is only counted in used once it is complete, so a crash
+    // mid-append leaves nothing half-written to replay
+    uint64_t used = header(&current)->used, off = 0;
+    while (off + sizeof(struct store_record) <= used) {
+        struct store_record *rec = (struct store_record *) (current.map + sizeof(struct store_header) + off);
+        if (off + RECORD_BYTES(rec->len) > used) {
+            break;
+        }
+        replay(rec, rec + 1);
+        off += RECORD_BYTES(rec->len);
+    }
+    if (off != used) {
+        fprintf(stderr, "List store %s: ignoring %llu bytes of damaged records\n", path,
+                (unsigned long long) (used - off));
+        header(&current)->used = off;
+    }
+
+    log_path = strdup(path);
+    if (log_path == NULL || asprintf(&tmp_path, "%s.tmp", path) < 0) {
+        perror("Failed to open list store");
+        exit(1);
+    }
+    snapshot_lists = snapshot;
+    compacted = off;
+    enabled = true;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, compact_run, NULL) != 0) {
+        perror("Failed to start store compaction");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+void *store_begin(enum store_op op, uint32_t list, int32_t a, int32_t b, uint32_t len) {
+    if (!enabled) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&store_lock);
+    struct log_file *f = rewriting ? &next : &current;
+    pending = RECORD_BYTES(len);
+    if (log_reserve(f, pending) < 0) {
+        // Carrying on would leave the file behind the lists for good
+        perror("Failed to grow list store");
+        exit(1);
+    }
+    struct store_record *rec = (struct store_record *) (f->map + sizeof(struct store_header) + header(f)->used);
+    rec->len = len;
+    rec->op = op;
+    rec->reserved = 0;
+    rec->list = list;
+    rec->a = a;
+    rec->b = b;
+    return rec + 1;
+}
+
+void store_end(void) {
+    struct log_file *f = rewriting ? &next : &current;
+    header(f)->used += pending;
+    if (!rewriting && header(f)->used > COMPACT_MIN && header(f)->used > 2 * compacted && !compact_wanted) {
+        compact_wanted = true;
+        pthread_cond_signal(&compact_wake);
+    }
+    pthread_mutex_unlock(&store_lock);
+}
+
+void store_log(enum store_op op, uint32_t list, int32_t a, int32_t b) {
+    if (store_begin(op, list, a, b, 0) != NULL) {
+        store_end();
+    }
+}
+
+// Like store_begin() for a record already complete at rec
+static void log_append(struct log_file *f, const struct store_record *rec) {
+    size_t bytes = RECORD_BYTES(rec->len);
+    if (log_reserve(f, bytes) < 0) {
+        perror("Failed to grow list store");
+        exit(1);
+    }
+    memcpy(f->map + sizeof(struct store_header) + header(f)->used, rec, bytes);
+    header(f)->used += bytes;
+}
+
+int store_rewrite_begin(void) {
+    pthread_mutex_lock(&store_lock);
+    int status = log_map(&next, tmp_path, true);
+    if (status < 0) {
+        fprintf(stderr, "Cannot compact list store into %s: %s\n", tmp_path, strerror(errno));
+        // Not again until the log has doubled once more
+        compacted = header(&current)->used;
+        compact_wanted = false;
+    } else {
+        rewriting = true;
+    }
+    pthread_mutex_unlock(&store_lock);
+    return status;
+}
+
+void store_rewrite_written(void) {
+    pthread_mutex_lock(&store_lock);
+    snapshot_used = header(&next)->used;
+    pthread_mutex_unlock(&store_lock);
+}
+
+void store_rewrite_end(void) {
+    // The snapshot reaches the disk before it replaces the log. Writers
+    // carry on appending to next meanwhile, which may move its mapping, so
+    // the file is synced rather than the mapping.
+    int status = fsync(next.fd);
+
+    pthread_mutex_lock(&store_lock);
+    if (status < 0 || rename(tmp_path, log_path) < 0) {
+        fprintf(stderr, "Cannot compact list store %s: %s\n", log_path, strerror(errno));
+        // Changes logged since the snapshot only went to next
+        for (uint64_t off = snapshot_used; off < header(&next)->used; ) {
+            struct store_record *rec = (struct store_record *) (next.map + sizeof(struct store_header) + off);
+            log_append(&current, rec);
+            off += RECORD_BYTES(rec->len);
+        }
+        log_unmap(&next);
+        unlink(tmp_path);
+        // Not again until the log has doubled once more
+        compacted = header(&current)->used;
+    } else {
+        log_unmap(&current);
+        current = next;
+        compacted = snapshot_used;
+    }
+    rewriting = false;
+    compact_wanted = false;
+    pthread_mutex_unlock(&store_lock);
+}
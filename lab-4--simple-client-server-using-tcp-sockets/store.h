@@ -0,0 +1,60 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+
+// Optional persistence for the list server: every change to a list is
+// appended to a memory-mapped log file, replayed on the next start. Once
+// the log has doubled since it was last written out in full, a background
+// thread rewrites it as a snapshot of the current lists.
+
+// Log records. Lists are named by the id given in their STORE_CREATE.
+enum store_op {
+    STORE_CREATE = 1,       // Payload: the list's name
+    STORE_ADD_FRONT,        // a = value
+    STORE_ADD_BACK,         // Payload: the values, as int32_t
+    STORE_ADD_AT,           // a = index, b = value
+    STORE_REMOVE_FRONT,
+    STORE_REMOVE_BACK,
+    STORE_REMOVE_AT,        // a = index
+    STORE_REMOVE_RANGE      // a = first, b = last
+};
+
+struct store_record {
+    uint32_t len;           // Payload bytes following the record
+    uint16_t op;
+    uint16_t reserved;
+    uint32_t list;
+    int32_t a, b;
+};
+
+// Called for each record of the log as it is opened
+typedef void (*store_replay_fn)(const struct store_record *rec, const void *payload);
+
+// Called on the compaction thread to write every list out again between
+// store_rewrite_begin() and store_rewrite_written(), keeping the lists from
+// changing meanwhile, then to let them go and call store_rewrite_end().
+typedef void (*store_snapshot_fn)(void);
+
+// Open or create the log at path and replay it. Exits on failure.
+void store_open(const char *path, store_replay_fn replay, store_snapshot_fn snapshot);
+
+// Append a record with room for len payload bytes, returned for the caller
+// to fill before store_end(). Returns NULL without a store, or while it is
+// being replayed; store_end() must not be called then. Callers log a
+// change while holding the lock of the list it changes, so each list's
+// records are in the order its changes were made.
+void *store_begin(enum store_op op, uint32_t list, int32_t a, int32_t b, uint32_t len);
+void store_end(void);
+
+// A record without payload
+void store_log(enum store_op op, uint32_t list, int32_t a, int32_t b);
+
+// Used by the snapshot callback: records logged from begin to end go to a
+// new file, which replaces the log at the end once it is on disk. Should
+// that fail, the records logged after the snapshot are moved to the log.
+int store_rewrite_begin(void);
+void store_rewrite_written(void);
+void store_rewrite_end(void);
+
+#endif